@@ -1,9 +1,14 @@
 #include <assert.h>
 #include "background-image.h"
 #include "cairo.h"
+#include "cpu.h"
 #include "log.h"
 #include "swaylock.h"
 
+#ifdef CPU_X86_SIMD
+#include <immintrin.h>
+#endif
+
 // Cairo RGB24 uses 32 bits per pixel, as XRGB, in native endianness.
 // xrgb32_le uses 32 bits per pixel, as XRGB, little endian (BGRX big endian).
 void cairo_rgb24_from_xrgb32_le(unsigned char *buf, int width, int height, int stride) {
@@ -18,17 +23,72 @@ void cairo_rgb24_from_xrgb32_le(unsigned char *buf, int width, int height, int s
 	}
 }
 
+static void xbgr32_le_row_scalar(unsigned char *row, int width) {
+	for (int x = 0; x < width; ++x) {
+		unsigned char *pix = row + x * 4;
+		*(uint32_t *)pix = 0 |
+			(uint32_t)pix[0] << 16 |
+			(uint32_t)pix[1] << 8 |
+			(uint32_t)pix[2];
+	}
+}
+
+#ifdef CPU_X86_SIMD
+
+// Only built for x86, so the native order is already little endian and
+// converting is just swapping the R and B bytes and clearing X.
+TARGET_SSE2 static void xbgr32_le_row_sse2(unsigned char *row, int width) {
+	const __m128i g_mask = _mm_set1_epi32(0x0000ff00);
+	const __m128i rb_mask = _mm_set1_epi32(0x000000ff);
+	int x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i *pix = (__m128i *)(row + x * 4);
+		__m128i v = _mm_loadu_si128(pix);
+		__m128i r = _mm_and_si128(v, rb_mask);
+		__m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), rb_mask);
+		v = _mm_or_si128(_mm_and_si128(v, g_mask),
+				_mm_or_si128(_mm_slli_epi32(r, 16), b));
+		_mm_storeu_si128(pix, v);
+	}
+	xbgr32_le_row_scalar(row + x * 4, width - x);
+}
+
+TARGET_AVX2 static void xbgr32_le_row_avx2(unsigned char *row, int width) {
+	const __m256i shuffle = _mm256_setr_epi8(
+			2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1,
+			2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i *pix = (__m256i *)(row + x * 4);
+		_mm256_storeu_si256(pix, _mm256_shuffle_epi8(_mm256_loadu_si256(pix), shuffle));
+	}
+	xbgr32_le_row_scalar(row + x * 4, width - x);
+}
+
+#endif
+
 // Cairo RGB24 uses 32 bits per pixel, as XRGB, in native endianness.
 // xbgr32_le uses 32 bits per pixel, as XBGR, little endian (RGBX big endian).
 void cairo_rgb24_from_xbgr32_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			unsigned char *pix = buf + y * stride + x * 4;
-			*(uint32_t *)pix = 0 |
-				(uint32_t)pix[0] << 16 |
-				(uint32_t)pix[1] << 8 |
-				(uint32_t)pix[2];
+	static void (*convert_row)(unsigned char *row, int width) = NULL;
+	if (!convert_row) {
+		convert_row = xbgr32_le_row_scalar;
+#ifdef CPU_X86_SIMD
+		switch (cpu_level()) {
+		case CPU_LEVEL_AVX2:
+			convert_row = xbgr32_le_row_avx2;
+			break;
+		case CPU_LEVEL_SSE2:
+			convert_row = xbgr32_le_row_sse2;
+			break;
+		case CPU_LEVEL_SCALAR:
+			break;
 		}
+#endif
+	}
+
+	for (int y = 0; y < height; ++y) {
+		convert_row(buf + y * stride, width);
 	}
 }
 
@@ -51,7 +111,8 @@ enum background_mode parse_background_mode(const char *mode) {
 }
 
 cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
-		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform) {
+		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform,
+		cairo_surface_t *(*create_image)(cairo_format_t format, int width, int height)) {
 	bool rotated =
 		transform == WL_OUTPUT_TRANSFORM_90 ||
 		transform == WL_OUTPUT_TRANSFORM_270 ||
@@ -60,9 +121,9 @@ cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
 
 	cairo_surface_t *image;
 	if (rotated) {
-		image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, height, width);
+		image = create_image(CAIRO_FORMAT_RGB24, height, width);
 	} else {
-		image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+		image = create_image(CAIRO_FORMAT_RGB24, width, height);
 	}
 	if (image == NULL) {
 		swaylock_log(LOG_ERROR, "Failed to create image..");
@@ -222,6 +283,44 @@ cairo_surface_t *load_background_image(const char *path) {
 	return image;
 }
 
+cairo_surface_t *create_background_preview(cairo_surface_t *image, int factor) {
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	cairo_format_t format = cairo_image_surface_get_format(image);
+	int small_width = width / factor > 0 ? width / factor : 1;
+	int small_height = height / factor > 0 ? height / factor : 1;
+
+	// Nearest neighbour only reads one pixel in factor^2, so shrinking is
+	// nearly free, and scaling back up smoothly hides the aliasing
+	cairo_surface_t *small = cairo_image_surface_create(format, small_width, small_height);
+	cairo_t *cairo = cairo_create(small);
+	cairo_scale(cairo, (double)small_width / width, (double)small_height / height);
+	cairo_set_source_surface(cairo, image, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_FAST);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+
+	cairo_surface_t *preview = cairo_image_surface_create(format, width, height);
+	cairo = cairo_create(preview);
+	cairo_scale(cairo, (double)width / small_width, (double)height / small_height);
+	cairo_set_source_surface(cairo, small, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_BILINEAR);
+	cairo_pattern_set_extend(cairo_get_source(cairo), CAIRO_EXTEND_PAD);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+	cairo_surface_destroy(small);
+
+	if (cairo_surface_status(preview) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to create background preview: %s",
+				cairo_status_to_string(cairo_surface_status(preview)));
+		cairo_surface_destroy(preview);
+		return NULL;
+	}
+	return preview;
+}
+
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height) {
 	double width = cairo_image_surface_get_width(image);
@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "log.h"
+
+static const char *level_names[] = {
+	[CPU_LEVEL_SCALAR] = "scalar",
+	[CPU_LEVEL_SSE2] = "sse2",
+	[CPU_LEVEL_AVX2] = "avx2",
+};
+
+static enum cpu_level max_level = CPU_LEVEL_AVX2;
+
+static enum cpu_level supported_level = CPU_LEVEL_SCALAR;
+
+static void detect(void) {
+#ifdef CPU_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		supported_level = CPU_LEVEL_AVX2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		supported_level = CPU_LEVEL_SSE2;
+	}
+#endif
+	swaylock_log(LOG_DEBUG, "CPU supports %s kernels", level_names[supported_level]);
+}
+
+// Effect threads may be the first to ask
+static enum cpu_level detect_level(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, detect);
+	return supported_level;
+}
+
+enum cpu_level cpu_level(void) {
+	enum cpu_level level = detect_level();
+	return level < max_level ? level : max_level;
+}
+
+void cpu_set_max_level(enum cpu_level level) {
+	enum cpu_level supported = detect_level();
+	if (level > supported) {
+		swaylock_log(LOG_DEBUG, "CPU or build doesn't support %s kernels, using %s",
+				level_names[level], level_names[supported]);
+	}
+	max_level = level;
+}
+
+bool cpu_parse_level(const char *name, enum cpu_level *level) {
+	// AVX2 is the best level there are kernels for
+	if (strcmp(name, "auto") == 0) {
+		*level = CPU_LEVEL_AVX2;
+		return true;
+	}
+
+	for (size_t i = 0; i < sizeof(level_names) / sizeof(*level_names); ++i) {
+		if (strcmp(name, level_names[i]) == 0) {
+			*level = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *cpu_level_name(enum cpu_level level) {
+	return level_names[level];
+}
@@ -0,0 +1,614 @@
+#define _GNU_SOURCE // memfd_create, MSG_CMSG_CLOEXEC
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+#include "effects.h"
+#include "effects-helper.h"
+#include "log.h"
+#include "swaylock.h"
+
+// Images go back and forth as memfds which both processes map, so a
+// request or reply is just this header and a file descriptor. The helper's
+// effects make their images in memfds too, so results aren't copied either,
+// unless an effect had cairo allocate one. A reply
+// without a file descriptor means the effects ran in place, and one with a
+// width of 0 means they failed.
+struct helper_image {
+	int32_t width, height, stride;
+	int32_t format;
+	int32_t scale;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int helper_fd = -1;
+static pid_t helper_pid = -1;
+
+struct shared_image {
+	int fd;
+	void *data;
+	size_t size;
+};
+
+static cairo_user_data_key_t shared_image_key;
+
+static void shared_image_destroy(void *data) {
+	struct shared_image *shared = data;
+	munmap(shared->data, shared->size);
+	close(shared->fd);
+	free(shared);
+}
+
+// Whether a header describes an image we can map, and 'fd' (if any) is big
+// enough for it and sealed so the other side can't shrink it later, which
+// would make reading the mapping crash with SIGBUS
+static bool check_image(struct helper_image *header, int fd) {
+	if (header->format != CAIRO_FORMAT_RGB24 &&
+			header->format != CAIRO_FORMAT_ARGB32) {
+		return false;
+	}
+	if (header->width <= 0 || header->height <= 0 ||
+			header->stride % 4 != 0 || header->stride / 4 < header->width) {
+		return false;
+	}
+	if (fd < 0) {
+		return true;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+			(uint64_t)st.st_size < (uint64_t)header->stride * header->height) {
+		return false;
+	}
+	int seals = fcntl(fd, F_GET_SEALS);
+	return seals >= 0 && (seals & F_SEAL_SHRINK);
+}
+
+// Takes ownership of 'fd'
+static cairo_surface_t *map_shared_image(int fd, cairo_format_t format,
+		int width, int height, int stride) {
+	size_t size = (size_t)stride * height;
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Failed to map effects image");
+		close(fd);
+		return NULL;
+	}
+
+	struct shared_image *shared = malloc(sizeof(*shared));
+	if (shared == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate effects image");
+		munmap(data, size);
+		close(fd);
+		return NULL;
+	}
+	shared->fd = fd;
+	shared->data = data;
+	shared->size = size;
+
+	cairo_surface_t *image = cairo_image_surface_create_for_data(
+			data, format, width, height, stride);
+	if (cairo_surface_set_user_data(image, &shared_image_key, shared,
+				shared_image_destroy) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to create effects image");
+		cairo_surface_destroy(image);
+		shared_image_destroy(shared);
+		return NULL;
+	}
+	return image;
+}
+
+// The memfd is sealed at its size, so the process on the other end can
+// rely on it staying mapped
+static int create_memfd(size_t size) {
+	int fd = memfd_create("swaylock-effects", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		swaylock_log_errno(LOG_ERROR, "memfd_create failed");
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		swaylock_log_errno(LOG_ERROR, "ftruncate failed");
+		close(fd);
+		return -1;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to seal effects image");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+cairo_surface_t *effects_helper_image_create(cairo_format_t format,
+		int width, int height) {
+	int stride = cairo_format_stride_for_width(format, width);
+	int fd = create_memfd((size_t)stride * height);
+	if (fd < 0) {
+		return cairo_image_surface_create(format, width, height);
+	}
+	return map_shared_image(fd, format, width, height, stride);
+}
+
+static bool send_image(int sock, struct helper_image *header, int fd) {
+	struct iovec iov = { .iov_base = header, .iov_len = sizeof(*header) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	if (fd >= 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	ssize_t amt;
+	do {
+		amt = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (amt < 0 && errno == EINTR);
+	return amt == sizeof(*header);
+}
+
+// Returns false once the other end is gone or sends garbage
+static bool recv_image(int sock, struct helper_image *header, int *fd) {
+	struct iovec iov = { .iov_base = header, .iov_len = sizeof(*header) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t amt;
+	do {
+		amt = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (amt < 0 && errno == EINTR);
+
+	*fd = -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (amt > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if (amt != sizeof(*header) || (msg.msg_flags & MSG_CTRUNC)) {
+		if (*fd >= 0) {
+			close(*fd);
+			*fd = -1;
+		}
+		return false;
+	}
+	return true;
+}
+
+// The helper doesn't get to keep anything swaylock had open, in particular
+// the Wayland connection and the pipes to the password checker
+static void close_other_fds(int keep) {
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		int fd = atoi(ent->d_name);
+		if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir)) {
+			close(fd);
+		}
+	}
+	closedir(dir);
+}
+
+#if defined(__linux__) && defined(__x86_64__)
+#define HELPER_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__linux__) && defined(__i386__)
+#define HELPER_AUDIT_ARCH AUDIT_ARCH_I386
+#elif defined(__linux__) && defined(__aarch64__)
+#define HELPER_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+#ifdef HELPER_AUDIT_ARCH
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SECCOMP_ARG0_LOW offsetof(struct seccomp_data, args[0])
+#else
+#define SECCOMP_ARG0_LOW (offsetof(struct seccomp_data, args[0]) + 4)
+#endif
+
+#define SECCOMP_DENY BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM)
+
+#define SECCOMP_LOAD_NR \
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr))
+
+#define SECCOMP_DENY_SYSCALL(nr) \
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), \
+	SECCOMP_DENY
+
+// Only lets a syscall through if its first argument is our own pid
+#define SECCOMP_SELF_ONLY(nr, pid) \
+	SECCOMP_LOAD_NR, \
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 4), \
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SECCOMP_ARG0_LOW), \
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (pid), 0, 1), \
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW), \
+	SECCOMP_DENY
+
+// Effects are arbitrary code, and the helper runs as the same user as
+// swaylock, so without this it could kill swaylock and unlock the session,
+// or read the password out of its memory. It can still open files, since
+// custom effects are loaded and compiled from the filesystem, but can't
+// signal or trace other processes, or open new sockets. swaylock makes
+// itself undumpable before forking, so its /proc/<pid>/mem can't be opened
+// either. The filter stays on for the compiler too.
+static bool restrict_syscalls(void) {
+	uint32_t pid = getpid();
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, HELPER_AUDIT_ARCH, 1, 0),
+		SECCOMP_DENY,
+		SECCOMP_LOAD_NR,
+#ifdef __x86_64__
+		// x32 syscalls, which have numbers of their own
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0x40000000, 0, 1),
+		SECCOMP_DENY,
+#endif
+		SECCOMP_DENY_SYSCALL(__NR_ptrace),
+		SECCOMP_DENY_SYSCALL(__NR_process_vm_readv),
+		SECCOMP_DENY_SYSCALL(__NR_process_vm_writev),
+		SECCOMP_DENY_SYSCALL(__NR_tkill),
+#ifdef __NR_socket
+		SECCOMP_DENY_SYSCALL(__NR_socket),
+#endif
+#ifdef __NR_pidfd_open
+		SECCOMP_DENY_SYSCALL(__NR_pidfd_open),
+#endif
+#ifdef __NR_pidfd_getfd
+		SECCOMP_DENY_SYSCALL(__NR_pidfd_getfd),
+#endif
+#ifdef __NR_pidfd_send_signal
+		SECCOMP_DENY_SYSCALL(__NR_pidfd_send_signal),
+#endif
+		SECCOMP_SELF_ONLY(__NR_kill, pid),
+		SECCOMP_SELF_ONLY(__NR_tgkill, pid),
+		SECCOMP_SELF_ONLY(__NR_rt_sigqueueinfo, pid),
+		SECCOMP_SELF_ONLY(__NR_rt_tgsigqueueinfo, pid),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(filter) / sizeof(*filter),
+		.filter = filter,
+	};
+	return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == 0;
+}
+
+#endif
+
+static void drop_privileges(int sock, pid_t parent) {
+#ifdef __linux__
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+#endif
+	if (getppid() != parent) {
+		exit(EXIT_FAILURE);
+	}
+	close_other_fds(sock);
+
+#ifdef HELPER_AUDIT_ARCH
+	if (!restrict_syscalls()) {
+		swaylock_log_errno(LOG_ERROR, "Failed to restrict effects helper syscalls");
+		exit(EXIT_FAILURE);
+	}
+#else
+	swaylock_log(LOG_DEBUG, "Can't restrict effects helper syscalls on this platform");
+#endif
+
+	// Effects should never make the lock screen itself stutter
+	errno = 0;
+	if (nice(10) == -1 && errno != 0) {
+		swaylock_log_errno(LOG_DEBUG, "Failed to lower effects priority");
+	}
+}
+
+static cairo_surface_t *run_effects(cairo_surface_t *image, int scale,
+		struct swaylock_args *args) {
+	if (args->time_effects || args->effects_plan) {
+		return swaylock_effects_run_timed(image, scale,
+				args->effects, args->effects_count, args->effects_plan);
+	}
+	return swaylock_effects_run(image, scale, args->effects, args->effects_count);
+}
+
+// Runs the effects for one request, and writes the reply
+static void handle_request(int sock, struct helper_image *request, int fd,
+		struct swaylock_args *args) {
+	struct helper_image reply = { 0 };
+	int reply_fd = -1;
+
+	cairo_surface_t *image = NULL;
+	if (check_image(request, fd)) {
+		image = map_shared_image(fd, request->format,
+				request->width, request->height, request->stride);
+	} else {
+		swaylock_log(LOG_ERROR, "Invalid image from swaylock");
+		close(fd);
+	}
+	cairo_surface_t *result = NULL;
+	unsigned char *data = NULL;
+	if (image != NULL) {
+		// Keep the mapping around to tell whether the effects ran in place
+		data = cairo_image_surface_get_data(image);
+		cairo_surface_reference(image);
+		result = run_effects(image, request->scale, args);
+	}
+
+	if (result != NULL && cairo_surface_status(result) == CAIRO_STATUS_SUCCESS) {
+		cairo_surface_flush(result);
+		reply.width = cairo_image_surface_get_width(result);
+		reply.height = cairo_image_surface_get_height(result);
+		reply.stride = cairo_image_surface_get_stride(result);
+		reply.format = cairo_image_surface_get_format(result);
+
+		unsigned char *result_data = cairo_image_surface_get_data(result);
+		int result_fd = swaylock_effects_image_fd(result);
+		bool in_place = result_data == data &&
+			reply.format == request->format && reply.stride == request->stride;
+		if (!in_place && result_fd >= 0) {
+			// The effects' buffers are memfds, so the result can be
+			// passed on as it is
+			reply_fd = fcntl(result_fd, F_DUPFD_CLOEXEC, 0);
+			if (reply_fd < 0) {
+				reply.width = 0;
+			}
+		} else if (!in_place) {
+			// Images cairo allocated itself have to be copied
+			size_t size = (size_t)reply.stride * reply.height;
+			reply_fd = create_memfd(size);
+			void *dest = reply_fd < 0 ? MAP_FAILED :
+				mmap(NULL, size, PROT_WRITE, MAP_SHARED, reply_fd, 0);
+			if (dest == MAP_FAILED) {
+				reply.width = 0;
+			} else {
+				memcpy(dest, result_data, size);
+				munmap(dest, size);
+			}
+		}
+	}
+
+	if (result != NULL) {
+		cairo_surface_destroy(result);
+	}
+	if (image != NULL) {
+		cairo_surface_destroy(image);
+	}
+
+	bool sent = send_image(sock, &reply, reply.width > 0 ? reply_fd : -1);
+	if (reply_fd >= 0) {
+		close(reply_fd);
+	}
+	if (!sent) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void run_effects_helper(int sock, pid_t parent, struct swaylock_args *args) {
+	drop_privileges(sock, parent);
+	swaylock_log(LOG_DEBUG, "Effects helper running");
+	swaylock_effects_set_buffer_fd(create_memfd);
+	swaylock_effects_compile(args->effects, args->effects_count);
+
+	while (true) {
+		struct helper_image request;
+		int fd;
+		if (!recv_image(sock, &request, &fd)) {
+			// swaylock is done with us
+			exit(EXIT_SUCCESS);
+		}
+		if (fd < 0) {
+			exit(EXIT_FAILURE);
+		}
+		handle_request(sock, &request, fd, args);
+	}
+}
+
+bool spawn_effects_helper(struct swaylock_args *args) {
+	int sock[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sock) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to create effects helper socket");
+		return false;
+	}
+
+#ifdef __linux__
+	// The helper keeps access to the user's files, so without this it could
+	// open /proc/<swaylock>/mem, which the syscall filter can't catch. The
+	// helper inherits it too.
+	if (prctl(PR_SET_DUMPABLE, 0, 0, 0, 0) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to protect swaylock's memory "
+				"from the effects helper");
+		close(sock[0]);
+		close(sock[1]);
+		return false;
+	}
+#endif
+
+	pid_t parent = getpid();
+	pid_t child = fork();
+	if (child < 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to fork effects helper");
+		close(sock[0]);
+		close(sock[1]);
+		return false;
+	} else if (child == 0) {
+		close(sock[0]);
+		run_effects_helper(sock[1], parent, args);
+	}
+
+	close(sock[1]);
+	helper_fd = sock[0];
+	helper_pid = child;
+	return true;
+}
+
+// Must be called with the lock held
+static void stop_helper(void) {
+	kill(helper_pid, SIGKILL);
+	waitpid(helper_pid, NULL, 0);
+	close(helper_fd);
+	helper_fd = -1;
+	helper_pid = -1;
+}
+
+static int ms_since(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Waits for the helper to reply until 'deadline' ms after 'start'
+static bool wait_reply(struct timespec *start, uint32_t deadline) {
+	struct pollfd pfd = { .fd = helper_fd, .events = POLLIN };
+	while (true) {
+		int timeout = -1;
+		if (deadline > 0) {
+			timeout = deadline - ms_since(start);
+			if (timeout < 0) {
+				timeout = 0;
+			}
+		}
+
+		int ret = poll(&pfd, 1, timeout);
+		if (ret > 0) {
+			return true;
+		} else if (ret == 0) {
+			return false;
+		} else if (errno != EINTR) {
+			swaylock_log_errno(LOG_ERROR, "Failed to wait for effects helper");
+			return false;
+		}
+	}
+}
+
+cairo_surface_t *effects_helper_run(cairo_surface_t *image, int scale,
+		uint32_t deadline) {
+	// Images from files aren't in shared memory yet
+	if (cairo_surface_get_user_data(image, &shared_image_key) == NULL) {
+		int width = cairo_image_surface_get_width(image);
+		int height = cairo_image_surface_get_height(image);
+		cairo_surface_t *copy = effects_helper_image_create(
+				cairo_image_surface_get_format(image), width, height);
+		if (copy != NULL) {
+			cairo_t *cairo = cairo_create(copy);
+			cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+			cairo_set_source_surface(cairo, image, 0, 0);
+			cairo_paint(cairo);
+			cairo_destroy(cairo);
+		}
+		cairo_surface_destroy(image);
+		image = copy;
+	}
+	struct shared_image *shared = NULL;
+	if (image != NULL) {
+		shared = cairo_surface_get_user_data(image, &shared_image_key);
+	}
+	if (shared == NULL) {
+		if (image != NULL) {
+			cairo_surface_destroy(image);
+		}
+		return NULL;
+	}
+
+	cairo_surface_t *result = NULL;
+	pthread_mutex_lock(&lock);
+	// Waiting for other outputs' effects doesn't count against the deadline
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (helper_fd < 0) {
+		swaylock_log(LOG_ERROR, "Effects helper isn't running, "
+				"using the fallback background");
+		goto out;
+	}
+
+	cairo_surface_flush(image);
+	struct helper_image request = {
+		.width = cairo_image_surface_get_width(image),
+		.height = cairo_image_surface_get_height(image),
+		.stride = cairo_image_surface_get_stride(image),
+		.format = cairo_image_surface_get_format(image),
+		.scale = scale,
+	};
+	if (!send_image(helper_fd, &request, shared->fd)) {
+		swaylock_log_errno(LOG_ERROR, "Failed to send image to effects helper");
+		stop_helper();
+		goto out;
+	}
+
+	if (!wait_reply(&start, deadline)) {
+		swaylock_log(LOG_ERROR, "Effects took longer than %u ms, "
+				"using the fallback background", deadline);
+		stop_helper();
+		goto out;
+	}
+
+	struct helper_image reply;
+	int fd;
+	if (!recv_image(helper_fd, &reply, &fd)) {
+		swaylock_log(LOG_ERROR, "Effects helper died, using the fallback background");
+		stop_helper();
+		goto out;
+	}
+
+	if (reply.width <= 0) {
+		swaylock_log(LOG_ERROR, "Effects failed, using the fallback background");
+		if (fd >= 0) {
+			close(fd);
+		}
+	} else if (!check_image(&reply, fd) || (fd < 0 &&
+			(reply.width != request.width || reply.height != request.height ||
+			reply.stride != request.stride || reply.format != request.format))) {
+		swaylock_log(LOG_ERROR, "Invalid image from effects helper, "
+				"using the fallback background");
+		if (fd >= 0) {
+			close(fd);
+		}
+	} else if (fd < 0) {
+		result = image;
+		image = NULL;
+		cairo_surface_mark_dirty(result);
+	} else {
+		result = map_shared_image(fd, reply.format,
+				reply.width, reply.height, reply.stride);
+	}
+
+out:
+	pthread_mutex_unlock(&lock);
+	if (image != NULL) {
+		cairo_surface_destroy(image);
+	}
+	return result;
+}
@@ -1,12 +1,18 @@
 #define _POSIX_C_SOURCE 200809
 #define _XOPEN_SOURCE 700
-#include <omp.h>
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and madvise
 #include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <string.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -14,8 +20,11 @@
 #include <spawn.h>
 #include <time.h>
 #include <stdio.h>
+#include "cpu.h"
 #include "effects.h"
+#include "expr.h"
 #include "log.h"
+#include "workers.h"
 
 // glib might or might not have already defined MIN,
 // depending on whether we have pixbuf or not...
@@ -23,6 +32,10 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifdef CPU_X86_SIMD
+#include <immintrin.h>
+#endif
+
 extern char **environ;
 
 static int screen_size_to_pix(struct swaylock_effect_screen_pos size, int screensize, int scale) {
@@ -53,12 +66,15 @@ static int screen_pos_to_pix(struct swaylock_effect_screen_pos pos, int screensi
 static const char *effect_name(struct swaylock_effect *effect) {
 	switch (effect->tag) {
 	case EFFECT_BLUR: return "blur";
+	case EFFECT_BLUR_FAST: return "blur-fast";
+	case EFFECT_BLUR_GAUSSIAN: return "blur-gaussian";
 	case EFFECT_PIXELATE: return "pixelate";
 	case EFFECT_SCALE: return "scale";
 	case EFFECT_GREYSCALE: return "greyscale";
 	case EFFECT_VIGNETTE: return "vignette";
 	case EFFECT_COMPOSE: return "compose";
 	case EFFECT_CUSTOM: return effect->e.custom;
+	case EFFECT_EXPR: return effect->e.expr.source;
 	}
 
 	abort();
@@ -113,29 +129,48 @@ static void screen_pos_pair_to_pix(
 	*outy = y;
 }
 
-static uint32_t blend_pixels(float alpha, uint32_t srcpix, uint32_t destpix) {
-	uint8_t srcr = (srcpix & 0x00ff0000) >> 16;
-	uint8_t destr = (destpix & 0x00ff0000) >> 16;
-	uint8_t srcg = (srcpix & 0x0000ff00) >> 8;
-	uint8_t destg = (destpix & 0x0000ff00) >> 8;
-	uint8_t srcb = (srcpix & 0x000000ff) >> 0;
-	uint8_t destb = (destpix & 0x000000ff) >> 0;
+// Blends one channel of a premultiplied source over the destination;
+// '(x * 0x8081) >> 23' is exactly 'x / 255' for any x <= 255 * 255.
+static uint32_t blend_channel(uint32_t src, uint32_t dest, uint32_t inv_alpha) {
+	uint32_t c = src + ((dest * inv_alpha * 0x8081) >> 23);
+	return c > 255 ? 255 : c;
+}
 
-	return (uint32_t)0 |
-		(uint32_t)255 << 24 |
-		(uint32_t)(srcr + destr * (1 - alpha)) << 16 |
-		(uint32_t)(srcg + destg * (1 - alpha)) << 8 |
-		(uint32_t)(srcb + destb * (1 - alpha)) << 0;
+static uint32_t blend_pixels(uint32_t srcpix, uint32_t destpix) {
+	uint32_t inv_alpha = 255 - (srcpix >> 24);
+	return (uint32_t)255 << 24 |
+		blend_channel(srcpix >> 16 & 0xff, destpix >> 16 & 0xff, inv_alpha) << 16 |
+		blend_channel(srcpix >> 8 & 0xff, destpix >> 8 & 0xff, inv_alpha) << 8 |
+		blend_channel(srcpix & 0xff, destpix & 0xff, inv_alpha);
 }
 
-static void blur_h(uint32_t *dest, uint32_t *src, int width, int height,
-		int radius) {
+// The blur passes take a table of fixed-point reciprocals, indexed by the
+// number of pixels in the window; '(acc * recip[n]) >> BLUR_RECIP_SHIFT'
+// is 'acc / n' to within 1 for any acc <= 255 * n. Since n is never larger
+// than an image dimension (at most 32767 in cairo), the product always fits
+// in 32 bits.
+#define BLUR_RECIP_SHIFT 24
+
+static uint32_t *blur_recip_table(int maxrange) {
+	uint32_t *recip = malloc((maxrange + 1) * sizeof(*recip));
+	if (recip == NULL) {
+		return NULL;
+	}
+
+	recip[0] = 0;
+	for (int n = 1; n <= maxrange; ++n) {
+		recip[n] = ((1u << BLUR_RECIP_SHIFT) + n - 1) / n;
+	}
+	return recip;
+}
+
+static void blur_h_rows_scalar(uint32_t *dest, uint32_t *src, int width, int nrows,
+		int radius, uint32_t *recip) {
 	const int minradius = radius < width ? radius : width;
 
-#pragma omp parallel for
-	for (int y = 0; y < height; ++y) {
-		uint32_t *srow = src + y * width;
-		uint32_t *drow = dest + y * width;
+	for (int y = 0; y < nrows; ++y) {
+		uint32_t *srow = src + (size_t)y * width;
+		uint32_t *drow = dest + (size_t)y * width;
 
 		// 'range' is float, because floating point division is usually faster
 		// than integer division.
@@ -175,517 +210,4075 @@ static void blur_h(uint32_t *dest, uint32_t *src, int width, int height,
 	}
 }
 
-static void blur_v(uint32_t *dest, uint32_t *src, int width, int height,
-		int radius) {
-	const int minradius = radius < height ? radius : height;
+// The vertical pass works on strips of adjacent columns, walking each strip
+// row by row, so that every step reads and writes whole cache lines instead
+// of a single pixel per row stride.
+#define BLUR_V_STRIP 16
 
-#pragma omp parallel for
-	for (int x = 0; x < width; ++x) {
-		uint32_t *scol = src + x;
-		uint32_t *dcol = dest + x;
+static void blur_v_cols_scalar(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int height, int ncols, int radius, uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
 
-		// 'range' is float, because floating point division is usually faster
-		// than integer division.
-		int r_acc = 0;
-		int g_acc = 0;
-		int b_acc = 0;
-		float range = minradius;
+	// 'range' is float, because floating point division is usually faster
+	// than integer division.
+	int r_acc[BLUR_V_STRIP] = { 0 };
+	int g_acc[BLUR_V_STRIP] = { 0 };
+	int b_acc[BLUR_V_STRIP] = { 0 };
+	float range = minradius;
 
-		// Accumulate the range (0..radius)
-		for (int y = 0; y < minradius; ++y) {
-			r_acc += (scol[y * width] & 0xff0000) >> 16;
-			g_acc += (scol[y * width] & 0x00ff00) >> 8;
-			b_acc += (scol[y * width] & 0x0000ff);
+	// Accumulate the range (0..radius)
+	for (int y = 0; y < minradius; ++y) {
+		uint32_t *srow = src + (size_t)y * sstride;
+		for (int x = 0; x < ncols; ++x) {
+			r_acc[x] += (srow[x] & 0xff0000) >> 16;
+			g_acc[x] += (srow[x] & 0x00ff00) >> 8;
+			b_acc[x] += (srow[x] & 0x0000ff);
 		}
+	}
 
-		// Deal with the main body
-		for (int y = 0; y < height; ++y) {
-			if (y >= minradius) {
-				r_acc -= (scol[(y - radius) * width] & 0xff0000) >> 16;
-				g_acc -= (scol[(y - radius) * width] & 0x00ff00) >> 8;
-				b_acc -= (scol[(y - radius) * width] & 0x0000ff);
-				range -= 1;
+	// Deal with the main body
+	for (int y = 0; y < height; ++y) {
+		if (y >= minradius) {
+			uint32_t *srow = src + (size_t)(y - radius) * sstride;
+			for (int x = 0; x < ncols; ++x) {
+				r_acc[x] -= (srow[x] & 0xff0000) >> 16;
+				g_acc[x] -= (srow[x] & 0x00ff00) >> 8;
+				b_acc[x] -= (srow[x] & 0x0000ff);
 			}
+			range -= 1;
+		}
 
-			if (y < height - minradius) {
-				r_acc += (scol[(y + radius) * width] & 0xff0000) >> 16;
-				g_acc += (scol[(y + radius) * width] & 0x00ff00) >> 8;
-				b_acc += (scol[(y + radius) * width] & 0x0000ff);
-				range += 1;
+		if (y < height - minradius) {
+			uint32_t *srow = src + (size_t)(y + radius) * sstride;
+			for (int x = 0; x < ncols; ++x) {
+				r_acc[x] += (srow[x] & 0xff0000) >> 16;
+				g_acc[x] += (srow[x] & 0x00ff00) >> 8;
+				b_acc[x] += (srow[x] & 0x0000ff);
 			}
+			range += 1;
+		}
 
-			dcol[y * width] = 0 |
-				(int)(r_acc / range) << 16 |
-				(int)(g_acc / range) << 8 |
-				(int)(b_acc / range);
+		uint32_t *drow = dest + (size_t)y * dstride;
+		for (int x = 0; x < ncols; ++x) {
+			drow[x] = 0 |
+				(int)(r_acc[x] / range) << 16 |
+				(int)(g_acc[x] / range) << 8 |
+				(int)(b_acc[x] / range);
 		}
 	}
 }
 
-static void blur_once(uint32_t *dest, uint32_t *src, uint32_t *scratch,
-		int width, int height, int radius) {
-	blur_h(scratch, src, width, height, radius);
-	blur_v(dest, scratch, width, height, radius);
+static void fill_pixels_scalar(uint32_t *dest, uint32_t pix, int n) {
+	for (int i = 0; i < n; ++i) {
+		dest[i] = pix;
+	}
 }
 
-// This effect_blur function, and the associated blur_* functions,
-// are my own adaptations of code in yvbbrjdr's i3lock-fancy-rapid:
-// https://github.com/yvbbrjdr/i3lock-fancy-rapid
-static void effect_blur(uint32_t *dest, uint32_t *src, int width, int height, int scale,
-		int radius, int times) {
-	uint32_t *origdest = dest;
+// Adds up 'taps' consecutive rows of 'n' bytes each, 'stride' bytes apart,
+// weighting the bytes of row k by weights[k] (15-bit fixed point). Each
+// product is truncated to 7 fractional bits, the same as a 16-bit mulhi.
+static void resample_v_row_scalar(uint16_t *dest, uint8_t *src, size_t stride,
+		uint16_t *weights, int taps, int n) {
+	for (int i = 0; i < n; ++i) {
+		uint32_t acc = 0;
+		for (int k = 0; k < taps; ++k) {
+			acc += ((uint32_t)src[k * stride + i] << 8) * weights[k] >> 16;
+		}
+		dest[i] = acc;
+	}
+}
 
-	uint32_t *scratch = malloc(width * height * sizeof(*scratch));
-	blur_once(dest, src, scratch, width, height, radius * scale);
-	for (int i = 0; i < times - 1; ++i) {
-		uint32_t *tmp = src;
-		src = dest;
-		dest = tmp;
-		blur_once(dest, src, scratch, width, height, radius * scale);
+// Makes 'n' pixels from a line of 16-bit channels with 7 fractional bits,
+// where pixel i is the weighted sum of the 'taps' pixels from start[i] on.
+// Like the vertical pass, each product is truncated to 6 fractional bits.
+static void resample_h_row_scalar(uint32_t *dest, uint16_t *line, int *start,
+		uint16_t *weights, int taps, int n) {
+	for (int i = 0; i < n; ++i) {
+		uint16_t *in = line + 4 * (size_t)start[i];
+		uint16_t *w = weights + (size_t)i * taps;
+		uint32_t r = 0, g = 0, b = 0;
+		for (int k = 0; k < taps; ++k) {
+			b += (uint32_t)in[4 * k] * w[k] >> 16;
+			g += (uint32_t)in[4 * k + 1] * w[k] >> 16;
+			r += (uint32_t)in[4 * k + 2] * w[k] >> 16;
+		}
+		dest[i] = (r + 32) >> 6 << 16 | (g + 32) >> 6 << 8 | (b + 32) >> 6;
 	}
-	free(scratch);
+}
 
-	// We're flipping between using dest and src;
-	// if the last buffer we used was src, copy that over to dest.
-	if (dest != origdest)
-		memcpy(origdest, dest, width * height * sizeof(*dest));
+// Composites a row of premultiplied ARGB pixels over 'dest'. Opaque pixels
+// are copied and fully transparent ones leave the destination untouched.
+static void compose_row_scalar(uint32_t *dest, uint32_t *src, int n) {
+	for (int i = 0; i < n; ++i) {
+		uint32_t alpha = src[i] >> 24;
+		if (alpha == 255) {
+			dest[i] = src[i];
+		} else if (alpha != 0) {
+			dest[i] = blend_pixels(src[i], dest[i]);
+		}
+	}
 }
 
-static void effect_pixelate(uint32_t *data, int width, int height, int scale, int factor) {
-	factor *= scale;
-#pragma omp parallel for
-	for (int y = 0; y < height / factor + 1; ++y) {
-		for (int x = 0; x < width / factor + 1; ++x) {
-			int total_r = 0, total_g = 0, total_b = 0;
-
-			int xstart = x * factor;
-			int ystart = y * factor;
-			int xlim = MIN(xstart + factor, width);
-			int ylim = MIN(ystart + factor, height);
-
-			// Average
-			for (int ry = ystart; ry < ylim; ++ry) {
-				for (int rx = xstart; rx < xlim; ++rx) {
-					int index = ry * width + rx;
-					total_r += (data[index] & 0xff0000) >> 16;
-					total_g += (data[index] & 0x00ff00) >> 8;
-					total_b += (data[index] & 0x0000ff);
-				}
-			}
+// Luma weights for greyscale, 0.2989, 0.5870 and 0.1140 in 15-bit fixed point,
+// small enough for the signed 16-bit multiplies in the SIMD kernels.
+#define GREY_WR 9794
+#define GREY_WG 19235
+#define GREY_WB 3736
 
-			int r = total_r / (factor * factor);
-			int g = total_g / (factor * factor);
-			int b = total_b / (factor * factor);
+static void greyscale_row_scalar(uint32_t *row, int n) {
+	for (int x = 0; x < n; ++x) {
+		uint32_t r = (row[x] & 0xff0000) >> 16;
+		uint32_t g = (row[x] & 0x00ff00) >> 8;
+		uint32_t b = (row[x] & 0x0000ff);
+		uint32_t luma = (GREY_WR * r + GREY_WG * g + GREY_WB * b) >> 15;
+		row[x] = luma << 16 | luma << 8 | luma;
+	}
+}
 
-			// Fill pixels
-			for (int ry = ystart; ry < ylim; ++ry) {
-				for (int rx = xstart; rx < xlim; ++rx) {
-					int index = ry * width + rx;
-					data[index] = r << 16 | g << 8 | b;
-				}
-			}
-		}
+// Scales each channel of a row by base + ((rowmul * colf[x]) >> 16), a 16-bit
+// fixed-point factor. Channels are widened to c * 257 (what unpacking a byte
+// with itself gives in SIMD) so that a factor of 65535 leaves 255 at 255.
+static void vignette_row_scalar(uint32_t *row, uint16_t *colf,
+		uint32_t base, uint32_t rowmul, int n) {
+	for (int x = 0; x < n; ++x) {
+		uint32_t f = base + ((rowmul * colf[x]) >> 16);
+		uint32_t r = ((row[x] >> 16 & 0xff) * 257 * f) >> 24;
+		uint32_t g = ((row[x] >> 8 & 0xff) * 257 * f) >> 24;
+		uint32_t b = ((row[x] & 0xff) * 257 * f) >> 24;
+		row[x] = r << 16 | g << 8 | b;
 	}
 }
 
-static void effect_scale(uint32_t *dest, uint32_t *src, int swidth, int sheight,
-		double scale) {
-	int dwidth = swidth * scale;
-	int dheight = sheight * scale;
-	double fact = 1.0 / scale;
+// Kernels for planar images (see struct planar_image), which keep each
+// channel in its own plane of bytes.
 
-#pragma omp parallel for
-	for (int dy = 0; dy < dheight; ++dy) {
-		int sy = dy * fact;
-		if (sy >= sheight) continue;
-		for (int dx = 0; dx < dwidth; ++dx) {
-			int sx = dx * fact;
-			if (sx >= swidth) continue;
-			dest[dy * dwidth + dx] = src[sy * swidth + sx];
-		}
+static void planar_split_row_scalar(uint8_t *r, uint8_t *g, uint8_t *b,
+		uint32_t *src, int n) {
+	for (int x = 0; x < n; ++x) {
+		r[x] = src[x] >> 16;
+		g[x] = src[x] >> 8;
+		b[x] = src[x];
 	}
 }
 
-static void effect_greyscale(uint32_t *data, int width, int height) {
-#pragma omp parallel for
+static void planar_merge_row_scalar(uint32_t *dest, uint8_t *r, uint8_t *g,
+		uint8_t *b, int n) {
+	for (int x = 0; x < n; ++x) {
+		dest[x] = (uint32_t)r[x] << 16 | (uint32_t)g[x] << 8 | b[x];
+	}
+}
+
+// One box blur pass down a strip of up to PLANAR_STRIP columns of a plane,
+// with the same window as blur_v_cols but using 'recip' on every path.
+#define PLANAR_STRIP 64
+
+static void planar_blur_cols_scalar(uint8_t *dest, size_t dstride,
+		uint8_t *src, size_t sstride,
+		int height, int ncols, int radius, uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
+
+	uint32_t acc[PLANAR_STRIP] = { 0 };
+	int range = minradius;
+	for (int y = 0; y < minradius; ++y) {
+		for (int x = 0; x < ncols; ++x) {
+			acc[x] += src[(size_t)y * sstride + x];
+		}
+	}
+
 	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			int index = y * width + x;
-			int r = (data[index] & 0xff0000) >> 16;
-			int g = (data[index] & 0x00ff00) >> 8;
-			int b = (data[index] & 0x0000ff);
-			int luma = 0.2989 * r + 0.5870 * g + 0.1140 * b;
-			if (luma < 0) luma = 0;
-			if (luma > 255) luma = 255;
-			luma &= 0xFF;
-			data[index] = luma << 16 | luma << 8 | luma;
+		if (y >= minradius) {
+			uint8_t *srow = src + (size_t)(y - radius) * sstride;
+			for (int x = 0; x < ncols; ++x) {
+				acc[x] -= srow[x];
+			}
+			range -= 1;
+		}
+		if (y < height - minradius) {
+			uint8_t *srow = src + (size_t)(y + radius) * sstride;
+			for (int x = 0; x < ncols; ++x) {
+				acc[x] += srow[x];
+			}
+			range += 1;
+		}
+
+		uint8_t *drow = dest + (size_t)y * dstride;
+		for (int x = 0; x < ncols; ++x) {
+			drow[x] = (acc[x] * recip[range]) >> BLUR_RECIP_SHIFT;
 		}
 	}
 }
 
-static void effect_vignette(uint32_t *data, int width, int height,
-		double base, double factor) {
-	base = fmin(1, fmax(0, base));
-	factor = fmin(1 - base, fmax(0, factor));
-#pragma omp parallel for
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
+// Running totals of a row, with prefix[x] the sum of the first x pixels
+static void planar_prefix_sums(uint32_t *prefix, uint8_t *src, int width) {
+	prefix[0] = 0;
+	for (int x = 0; x < width; ++x) {
+		prefix[x + 1] = prefix[x] + src[x];
+	}
+}
 
-			double xf = (x * 1.0) / width;
-			double yf = (y * 1.0) / height;
-			double vignette_factor = base + factor
-				* 16 * xf * yf * (1.0 - xf) * (1.0 - yf);
+static void planar_box_sums_scalar(uint8_t *dest, uint32_t *prefix, int width,
+		int radius, uint32_t *recip, int start, int end) {
+	for (int x = start; x < end; ++x) {
+		int lo = x - radius + 1 > 0 ? x - radius + 1 : 0;
+		int hi = MIN(x + radius, width - 1);
+		dest[x] = ((prefix[hi + 1] - prefix[lo]) * recip[hi - lo + 1]) >> BLUR_RECIP_SHIFT;
+	}
+}
 
-			int index = y * width + x;
-			int r = (data[index] & 0xff0000) >> 16;
-			int g = (data[index] & 0x00ff00) >> 8;
-			int b = (data[index] & 0x0000ff);
+// One horizontal box blur pass over a row, with the same window as
+// blur_h_rows, taking each window's sum from running totals of the row in
+// 'prefix' (width + 1 long). 'dest' may be 'src'.
+static void planar_blur_row_scalar(uint8_t *dest, uint8_t *src, uint32_t *prefix,
+		int width, int radius, uint32_t *recip) {
+	planar_prefix_sums(prefix, src, width);
+	planar_box_sums_scalar(dest, prefix, width, radius, recip, 0, width);
+}
 
-			r = (int)(r * vignette_factor) & 0xFF;
-			g = (int)(g * vignette_factor) & 0xFF;
-			b = (int)(b * vignette_factor) & 0xFF;
+static void planar_greyscale_row_scalar(uint8_t *r, uint8_t *g, uint8_t *b, int n) {
+	for (int x = 0; x < n; ++x) {
+		uint8_t luma = (GREY_WR * r[x] + GREY_WG * g[x] + GREY_WB * b[x]) >> 15;
+		r[x] = g[x] = b[x] = luma;
+	}
+}
 
-			data[index] = r << 16 | g << 8 | b;
-		}
+static void planar_vignette_row_scalar(uint8_t *r, uint8_t *g, uint8_t *b,
+		uint16_t *colf, uint32_t base, uint32_t rowmul, int n) {
+	for (int x = 0; x < n; ++x) {
+		uint32_t f = base + ((rowmul * colf[x]) >> 16);
+		r[x] = (r[x] * 257 * f) >> 24;
+		g[x] = (g[x] * 257 * f) >> 24;
+		b[x] = (b[x] * 257 * f) >> 24;
 	}
 }
 
-static void effect_compose(uint32_t *data, int width, int height, int scale,
-		struct swaylock_effect_screen_pos posx,
-		struct swaylock_effect_screen_pos posy,
-		struct swaylock_effect_screen_pos posw,
-		struct swaylock_effect_screen_pos posh,
-		int gravity, char *imgpath) {
-#if !HAVE_GDK_PIXBUF
-	(void)&blend_pixels;
-	(void)&screen_size_to_pix;
-	(void)&screen_pos_pair_to_pix;
-	swaylock_log(LOG_ERROR, "Compose effect: Compiled without gdk_pixbuf support.\n");
-	return;
-#else
-	int imgw = screen_size_to_pix(posw, width, scale);
-	int imgh = screen_size_to_pix(posh, height, scale);
-	bool preserve_aspect = imgw < 0 || imgh < 0;
+// Coefficients for the recursive Gaussian filter described in
+// "Recursive implementation of the Gaussian filter" (Young, van Vliet 1995).
+struct iir_coeffs {
+	float b, c1, c2, c3;
+};
 
-	GError *err = NULL;
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(
-			imgpath, imgw, imgh, preserve_aspect, &err);
-	if (!pixbuf) {
-		swaylock_log(LOG_ERROR, "Compose effect: Failed to load image file '%s' (%s).",
-				imgpath, err->message);
-		g_error_free(err);
-		return;
+// Runs the filter forwards and then backwards over 'n' samples of 'lanes'
+// independent floats each (for example, 4 rows of 4 channels), in place.
+// The image is treated as if its edge pixels were repeated forever.
+static void iir_lanes_scalar(float *buf, int n, int lanes, struct iir_coeffs *k) {
+	for (int l = 0; l < lanes; ++l) {
+		float *p = buf + l;
+		float w1 = p[0], w2 = w1, w3 = w1;
+		for (int i = 0; i < n; ++i) {
+			float w = k->b * p[(size_t)i * lanes] + k->c1 * w1 + k->c2 * w2 + k->c3 * w3;
+			p[(size_t)i * lanes] = w;
+			w3 = w2; w2 = w1; w1 = w;
+		}
+
+		w1 = w2 = w3 = p[(size_t)(n - 1) * lanes];
+		for (int i = n - 1; i >= 0; --i) {
+			float w = k->b * p[(size_t)i * lanes] + k->c1 * w1 + k->c2 * w2 + k->c3 * w3;
+			p[(size_t)i * lanes] = w;
+			w3 = w2; w2 = w1; w1 = w;
+		}
 	}
+}
 
-	cairo_surface_t *image = gdk_cairo_image_surface_create_from_pixbuf(pixbuf);
-	g_object_unref(pixbuf);
+#ifdef CPU_X86_SIMD
 
-	int bufw = cairo_image_surface_get_width(image);
-	int bufh = cairo_image_surface_get_height(image);
-	uint32_t *bufdata = (uint32_t *)cairo_image_surface_get_data(image);
-	int bufstride = cairo_image_surface_get_stride(image) / 4;
-	bool bufalpha = cairo_image_surface_get_format(image) == CAIRO_FORMAT_ARGB32;
+// The SIMD blur passes keep one 32-bit accumulator per channel (including
+// the unused X channel, which is masked off again when storing).
 
-	int imgx, imgy;
-	screen_pos_pair_to_pix(
-			posx, posy, bufw, bufh,
-			width, height, scale, gravity,
-			&imgx, &imgy);
+TARGET_SSE2 static inline __m128i sse2_unpack_px(uint32_t pix) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_cvtsi32_si128(pix);
+	v = _mm_unpacklo_epi8(v, zero);
+	return _mm_unpacklo_epi16(v, zero);
+}
 
-#pragma omp parallel for
-	for (int offy = 0; offy < bufh; ++offy) {
-		if (offy + imgy < 0 || offy + imgy > height)
-			continue;
+TARGET_SSE2 static inline uint32_t sse2_pack_px(__m128i v) {
+	v = _mm_packs_epi32(v, v);
+	v = _mm_packus_epi16(v, v);
+	return (uint32_t)_mm_cvtsi128_si32(v) & 0x00ffffff;
+}
 
-		for (int offx = 0; offx < bufw; ++offx) {
-			if (offx + imgx < 0 || offx + imgx > width)
-				continue;
+// SSE2 has no 32-bit mullo, so the even and odd lanes are multiplied
+// separately. 'recip' must hold the same value in every lane.
+TARGET_SSE2 static inline __m128i sse2_div(__m128i acc, __m128i recip) {
+	__m128i even = _mm_mul_epu32(acc, recip);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(acc, 32), recip);
+	even = _mm_srli_epi64(even, BLUR_RECIP_SHIFT);
+	odd = _mm_slli_epi64(_mm_srli_epi64(odd, BLUR_RECIP_SHIFT), 32);
+	return _mm_or_si128(even, odd);
+}
 
-			size_t idx = (size_t)(offy + imgy) * width + (offx + imgx);
-			size_t bufidx = (size_t)offy * bufstride + (offx);
+TARGET_SSE2 static void blur_h_rows_sse2(uint32_t *dest, uint32_t *src, int width, int nrows,
+		int radius, uint32_t *recip) {
+	const int minradius = radius < width ? radius : width;
 
-			if (!bufalpha) {
-				data[idx] = bufdata[bufidx];
-			} else {
-				uint8_t alpha = (bufdata[bufidx] & 0xff000000) >> 24;
-				if (alpha == 255) {
-					data[idx] = bufdata[bufidx];
-				} else if (alpha != 0) {
-					data[idx] = blend_pixels(alpha / 255.0, bufdata[bufidx], data[idx]);
-				}
+	for (int y = 0; y < nrows; ++y) {
+		uint32_t *srow = src + (size_t)y * width;
+		uint32_t *drow = dest + (size_t)y * width;
+
+		__m128i acc = _mm_setzero_si128();
+		int range = minradius;
+		for (int x = 0; x < minradius; ++x) {
+			acc = _mm_add_epi32(acc, sse2_unpack_px(srow[x]));
+		}
+
+		for (int x = 0; x < width; ++x) {
+			if (x >= minradius) {
+				acc = _mm_sub_epi32(acc, sse2_unpack_px(srow[x - radius]));
+				range -= 1;
+			}
+
+			if (x < width - minradius) {
+				acc = _mm_add_epi32(acc, sse2_unpack_px(srow[x + radius]));
+				range += 1;
 			}
+
+			drow[x] = sse2_pack_px(sse2_div(acc, _mm_set1_epi32(recip[range])));
 		}
 	}
+}
 
-	cairo_surface_destroy(image);
-#endif
+TARGET_SSE2 static inline void sse2_unpack_px4(uint32_t *pix, __m128i out[4]) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_loadu_si128((__m128i *)pix);
+	__m128i lo = _mm_unpacklo_epi8(v, zero);
+	__m128i hi = _mm_unpackhi_epi8(v, zero);
+	out[0] = _mm_unpacklo_epi16(lo, zero);
+	out[1] = _mm_unpackhi_epi16(lo, zero);
+	out[2] = _mm_unpacklo_epi16(hi, zero);
+	out[3] = _mm_unpackhi_epi16(hi, zero);
 }
 
-static void effect_custom_run(uint32_t *data, int width, int height, int scale,
-		char *path) {
-	void *dl = dlopen(path, RTLD_LAZY);
-	if (dl == NULL) {
-		swaylock_log(LOG_ERROR, "Custom effect: %s", dlerror());
-		return;
-	}
+TARGET_SSE2 static void blur_v_cols_sse2(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int height, int ncols, int radius, uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	const int groups = ncols / 4;
 
-	void (*effect_func)(uint32_t *data, int width, int height, int scale) =
-		dlsym(dl, "swaylock_effect");
-	if (effect_func != NULL) {
-		effect_func(data, width, height, scale);
-		dlclose(dl);
-		return;
+	__m128i acc[BLUR_V_STRIP], pix[4];
+	for (int i = 0; i < groups * 4; ++i) {
+		acc[i] = _mm_setzero_si128();
 	}
 
-	uint32_t (*pixel_func)(uint32_t pix, int x, int y, int width, int height) =
-		dlsym(dl, "swaylock_pixel");
-	if (pixel_func != NULL) {
-#pragma omp parallel for
-		for (int y = 0; y < height; ++y) {
-			for (int x = 0; x < width; ++x) {
-				data[y * width + x] =
-					pixel_func(data[y * width + x], x, y, width, height);
+	int range = minradius;
+	for (int y = 0; y < minradius; ++y) {
+		uint32_t *srow = src + (size_t)y * sstride;
+		for (int g = 0; g < groups; ++g) {
+			sse2_unpack_px4(srow + g * 4, pix);
+			for (int i = 0; i < 4; ++i) {
+				acc[g * 4 + i] = _mm_add_epi32(acc[g * 4 + i], pix[i]);
 			}
 		}
-
-		dlclose(dl);
-		return;
 	}
 
-	(void)dlsym(dl, "swaylock_effect"); // Change the result of dlerror()
-	swaylock_log(LOG_ERROR, "Custom effect: %s", dlerror());
-}
+	for (int y = 0; y < height; ++y) {
+		if (y >= minradius) {
+			uint32_t *srow = src + (size_t)(y - radius) * sstride;
+			for (int g = 0; g < groups; ++g) {
+				sse2_unpack_px4(srow + g * 4, pix);
+				for (int i = 0; i < 4; ++i) {
+					acc[g * 4 + i] = _mm_sub_epi32(acc[g * 4 + i], pix[i]);
+				}
+			}
+			range -= 1;
+		}
 
-static bool file_is_outdated(const char *input, const char *output) {
-	struct stat instat, outstat;
-	if (stat(input, &instat) < 0) {
-		return true;
-	}
+		if (y < height - minradius) {
+			uint32_t *srow = src + (size_t)(y + radius) * sstride;
+			for (int g = 0; g < groups; ++g) {
+				sse2_unpack_px4(srow + g * 4, pix);
+				for (int i = 0; i < 4; ++i) {
+					acc[g * 4 + i] = _mm_add_epi32(acc[g * 4 + i], pix[i]);
+				}
+			}
+			range += 1;
+		}
 
-	if (stat(output, &outstat) < 0) {
-		return true;
+		uint32_t *drow = dest + (size_t)y * dstride;
+		__m128i rcp = _mm_set1_epi32(recip[range]);
+		for (int g = 0; g < groups; ++g) {
+			__m128i *a = &acc[g * 4];
+			__m128i lo = _mm_packs_epi32(sse2_div(a[0], rcp), sse2_div(a[1], rcp));
+			__m128i hi = _mm_packs_epi32(sse2_div(a[2], rcp), sse2_div(a[3], rcp));
+			_mm_storeu_si128((__m128i *)(drow + g * 4),
+					_mm_and_si128(_mm_packus_epi16(lo, hi), mask));
+		}
 	}
 
-	if (instat.st_mtim.tv_sec > outstat.st_mtim.tv_sec) {
-		return true;
+	if (groups * 4 < ncols) {
+		blur_v_cols_scalar(dest + groups * 4, dstride, src + groups * 4, sstride,
+				height, ncols - groups * 4, radius, recip);
 	}
+}
 
-	if (
-			instat.st_mtim.tv_sec == outstat.st_mtim.tv_sec &&
-			instat.st_mtim.tv_nsec >= outstat.st_mtim.tv_nsec) {
-		return true;
-	}
+TARGET_AVX2 static inline __m256i avx2_unpack_px2(uint32_t a, uint32_t b) {
+	return _mm256_cvtepu8_epi32(_mm_set_epi32(0, 0, (int)b, (int)a));
+}
 
-	return false;
+TARGET_AVX2 static inline __m256i avx2_div(__m256i acc, __m256i recip) {
+	return _mm256_srli_epi32(_mm256_mullo_epi32(acc, recip), BLUR_RECIP_SHIFT);
 }
 
-static char *effect_custom_compile(const char *path) {
-	static char *cachepath = NULL;
-	static size_t cachelen;
-	if (!cachepath) {
-		char *xdgdir = getenv("XDG_DATA_HOME");
-		if (xdgdir) {
-			cachepath = malloc(strlen(xdgdir) + strlen("/swaylock") + 1);
-			cachelen = sprintf(cachepath, "%s/swaylock", xdgdir);
-		} else {
-			char *homedir = getenv("HOME");
-			if (homedir == NULL) {
-				swaylock_log(LOG_ERROR,
-						"Can't compile custom effect; neither $HOME nor $XDG_CONFIG_HOME "
-						"is defined.");
-				return NULL;
-			}
+// Blurs two rows at a time; the low 128 bits of each vector hold a pixel
+// from the first row, the high 128 bits the same pixel from the second row.
+TARGET_AVX2 static void blur_h_rows_avx2(uint32_t *dest, uint32_t *src, int width, int nrows,
+		int radius, uint32_t *recip) {
+	const int minradius = radius < width ? radius : width;
 
-			cachepath = malloc(strlen(homedir) + strlen("/.cache/swaylock") + 1);
-			cachelen = sprintf(cachepath, "%s/.cache/swaylock", homedir);
+	int y = 0;
+	for (; y + 2 <= nrows; y += 2) {
+		uint32_t *srow0 = src + (size_t)y * width;
+		uint32_t *srow1 = srow0 + width;
+		uint32_t *drow0 = dest + (size_t)y * width;
+		uint32_t *drow1 = drow0 + width;
+
+		__m256i acc = _mm256_setzero_si256();
+		int range = minradius;
+		for (int x = 0; x < minradius; ++x) {
+			acc = _mm256_add_epi32(acc, avx2_unpack_px2(srow0[x], srow1[x]));
 		}
 
-		if (mkdir(cachepath, 0777) < 0 && errno != EEXIST) {
-			swaylock_log(LOG_ERROR,
-					"Can't compile custom effect; mkdir %s failed: %s\n",
-					cachepath, strerror(errno));
-			free(cachepath);
-			cachepath = NULL;
-			return NULL;
+		for (int x = 0; x < width; ++x) {
+			if (x >= minradius) {
+				acc = _mm256_sub_epi32(acc,
+						avx2_unpack_px2(srow0[x - radius], srow1[x - radius]));
+				range -= 1;
+			}
+
+			if (x < width - minradius) {
+				acc = _mm256_add_epi32(acc,
+						avx2_unpack_px2(srow0[x + radius], srow1[x + radius]));
+				range += 1;
+			}
+
+			__m256i v = avx2_div(acc, _mm256_set1_epi32(recip[range]));
+			v = _mm256_packus_epi32(v, v);
+			v = _mm256_packus_epi16(v, v);
+			drow0[x] = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(v)) & 0x00ffffff;
+			drow1[x] = (uint32_t)_mm_cvtsi128_si32(_mm256_extracti128_si256(v, 1)) & 0x00ffffff;
 		}
 	}
 
-	// Find the true, absolute path of the input file
-	char *abspath = realpath(path, NULL);
-	size_t abspathlen = strlen(abspath);
+	if (y < nrows) {
+		blur_h_rows_sse2(dest + (size_t)y * width, src + (size_t)y * width,
+				width, nrows - y, radius, recip);
+	}
+}
 
-	char *outpath = malloc(cachelen + 1 + abspathlen + 3 + 1);
-	size_t outlen = sprintf(outpath, "%s/%s.so", cachepath, abspath);
+TARGET_AVX2 static inline void avx2_unpack_px8(uint32_t *pix, __m256i out[4]) {
+	for (int i = 0; i < 4; ++i) {
+		out[i] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(pix + i * 2)));
+	}
+}
 
-	// Sanitize
-	for (char *ch = outpath + cachelen + 1; ch < outpath + cachelen + 1 + abspathlen; ++ch) {
-		if (!(
-				(*ch >= 'a' && *ch <= 'z') ||
-				(*ch >= 'A' && *ch <= 'Z') ||
-				(*ch >= '0' && *ch <= '9') ||
-				(*ch == '.'))) {
-			*ch = '_';
-		}
+TARGET_AVX2 static void blur_v_cols_avx2(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int height, int ncols, int radius, uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
+	const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+	// After packing, the pixels are in the order 0 2 4 6 | 1 3 5 7
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	const int groups = ncols / 8;
+
+	__m256i acc[BLUR_V_STRIP / 2], pix[4];
+	for (int i = 0; i < groups * 4; ++i) {
+		acc[i] = _mm256_setzero_si256();
 	}
 
-	if (!file_is_outdated(path, outpath)) {
-		free(abspath);
-		return outpath;
+	int range = minradius;
+	for (int y = 0; y < minradius; ++y) {
+		uint32_t *srow = src + (size_t)y * sstride;
+		for (int g = 0; g < groups; ++g) {
+			avx2_unpack_px8(srow + g * 8, pix);
+			for (int i = 0; i < 4; ++i) {
+				acc[g * 4 + i] = _mm256_add_epi32(acc[g * 4 + i], pix[i]);
+			}
+		}
 	}
 
-	static const char *fmt = "cc -shared -g -O2 -march=native -fopenmp -o '%s' '%s' -lm";
-	char *cmd = malloc(strlen(fmt) + outlen - 2 + abspathlen - 2 + 1);
-	sprintf(cmd, fmt, outpath, abspath);
-	free(abspath);
-	fprintf(stderr, "Compiling custom effect: %s\n", cmd);
+	for (int y = 0; y < height; ++y) {
+		if (y >= minradius) {
+			uint32_t *srow = src + (size_t)(y - radius) * sstride;
+			for (int g = 0; g < groups; ++g) {
+				avx2_unpack_px8(srow + g * 8, pix);
+				for (int i = 0; i < 4; ++i) {
+					acc[g * 4 + i] = _mm256_sub_epi32(acc[g * 4 + i], pix[i]);
+				}
+			}
+			range -= 1;
+		}
 
-	// Finally, compile.
-	int ret = system(cmd);
-	free(cmd);
-	if (ret != 0) {
-		if (ret == -1) {
-			swaylock_log(LOG_ERROR, "Custom effect: system(): %s", strerror(errno));
-			free(outpath);
-			return NULL;
-		} else {
-			swaylock_log(LOG_ERROR, "Custom effect compilation failed\n");
-			free(outpath);
-			return NULL;
+		if (y < height - minradius) {
+			uint32_t *srow = src + (size_t)(y + radius) * sstride;
+			for (int g = 0; g < groups; ++g) {
+				avx2_unpack_px8(srow + g * 8, pix);
+				for (int i = 0; i < 4; ++i) {
+					acc[g * 4 + i] = _mm256_add_epi32(acc[g * 4 + i], pix[i]);
+				}
+			}
+			range += 1;
+		}
+
+		uint32_t *drow = dest + (size_t)y * dstride;
+		__m256i rcp = _mm256_set1_epi32(recip[range]);
+		for (int g = 0; g < groups; ++g) {
+			__m256i *a = &acc[g * 4];
+			__m256i lo = _mm256_packus_epi32(avx2_div(a[0], rcp), avx2_div(a[1], rcp));
+			__m256i hi = _mm256_packus_epi32(avx2_div(a[2], rcp), avx2_div(a[3], rcp));
+			__m256i v = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), order);
+			_mm256_storeu_si256((__m256i *)(drow + g * 8), _mm256_and_si256(v, mask));
 		}
 	}
 
-	return outpath;
+	if (groups * 8 < ncols) {
+		blur_v_cols_sse2(dest + groups * 8, dstride, src + groups * 8, sstride,
+				height, ncols - groups * 8, radius, recip);
+	}
 }
 
-static void effect_custom(uint32_t *data, int width, int height, int scale,
-		char *path) {
-	size_t pathlen = strlen(path);
-	if (pathlen > 3 && strcmp(path + pathlen - 3, ".so") == 0) {
-		effect_custom_run(data, width, height, scale, path);
-	} else if (pathlen > 2 && strcmp(path + pathlen - 2, ".c") == 0) {
-		char *compiled = effect_custom_compile(path);
-		if (compiled != NULL) {
-			effect_custom_run(data, width, height, scale, compiled);
-			free(compiled);
+TARGET_SSE2 static void fill_pixels_sse2(uint32_t *dest, uint32_t pix, int n) {
+	__m128i v = _mm_set1_epi32(pix);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128((__m128i *)(dest + i), v);
+	}
+	for (; i < n; ++i) {
+		dest[i] = pix;
+	}
+}
+
+TARGET_AVX2 static void fill_pixels_avx2(uint32_t *dest, uint32_t pix, int n) {
+	__m256i v = _mm256_set1_epi32(pix);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i *)(dest + i), v);
+	}
+	for (; i < n; ++i) {
+		dest[i] = pix;
+	}
+}
+
+TARGET_SSE2 static void greyscale_row_sse2(uint32_t *row, int n) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i w = _mm_setr_epi16(GREY_WB, GREY_WG, GREY_WR, 0, GREY_WB, GREY_WG, GREY_WR, 0);
+	int x = 0;
+	for (; x + 4 <= n; x += 4) {
+		__m128i px = _mm_loadu_si128((__m128i *)(row + x));
+		// b*wb + g*wg and r*wr for each pixel, then add the pairs together
+		__m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), w));
+		__m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), w));
+		__m128i luma = _mm_add_epi32(
+				_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+				_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+		luma = _mm_srli_epi32(luma, 15);
+		luma = _mm_or_si128(luma, _mm_slli_epi32(luma, 8));
+		luma = _mm_or_si128(luma, _mm_slli_epi32(luma, 8));
+		_mm_storeu_si128((__m128i *)(row + x), luma);
+	}
+	greyscale_row_scalar(row + x, n - x);
+}
+
+TARGET_AVX2 static void greyscale_row_avx2(uint32_t *row, int n) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i w = _mm256_setr_epi16(GREY_WB, GREY_WG, GREY_WR, 0, GREY_WB, GREY_WG, GREY_WR, 0,
+			GREY_WB, GREY_WG, GREY_WR, 0, GREY_WB, GREY_WG, GREY_WR, 0);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		__m256i px = _mm256_loadu_si256((__m256i *)(row + x));
+		__m256i luma = _mm256_hadd_epi32(
+				_mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), w),
+				_mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), w));
+		luma = _mm256_srli_epi32(luma, 15);
+		luma = _mm256_or_si256(luma, _mm256_slli_epi32(luma, 8));
+		luma = _mm256_or_si256(luma, _mm256_slli_epi32(luma, 8));
+		_mm256_storeu_si256((__m256i *)(row + x), luma);
+	}
+	greyscale_row_scalar(row + x, n - x);
+}
+
+// Blends 4 premultiplied pixels over 4 destination pixels; pixels with zero
+// alpha keep their destination value, as in the scalar version.
+TARGET_SSE2 static __m128i sse2_blend_px4(__m128i src, __m128i dest, __m128i alpha) {
+	__m128i zero = _mm_setzero_si128(), div255 = _mm_set1_epi16((short)0x8081);
+
+	// 255 - alpha, repeated over the 4 channels of each pixel
+	__m128i ia = _mm_sub_epi32(_mm_set1_epi32(255), _mm_srli_epi32(src, 24));
+	ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+	__m128i ialo = _mm_unpacklo_epi32(ia, ia), iahi = _mm_unpackhi_epi32(ia, ia);
+
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(dest, zero), ialo);
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(dest, zero), iahi);
+	lo = _mm_srli_epi16(_mm_mulhi_epu16(lo, div255), 7);
+	hi = _mm_srli_epi16(_mm_mulhi_epu16(hi, div255), 7);
+	__m128i out = _mm_or_si128(_mm_adds_epu8(src, _mm_packus_epi16(lo, hi)), alpha);
+
+	__m128i clear = _mm_cmpeq_epi32(_mm_and_si128(src, alpha), zero);
+	return _mm_or_si128(_mm_and_si128(clear, dest), _mm_andnot_si128(clear, out));
+}
+
+TARGET_SSE2 static void compose_row_sse2(uint32_t *dest, uint32_t *src, int n) {
+	__m128i alpha = _mm_set1_epi32(0xff000000), zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((__m128i *)(src + i));
+		__m128i a = _mm_and_si128(s, alpha);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alpha)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)(dest + i), s);
+		} else if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) != 0xffff) {
+			__m128i d = _mm_loadu_si128((__m128i *)(dest + i));
+			_mm_storeu_si128((__m128i *)(dest + i), sse2_blend_px4(s, d, alpha));
+		}
+	}
+	compose_row_scalar(dest + i, src + i, n - i);
+}
+
+TARGET_AVX2 static void compose_row_avx2(uint32_t *dest, uint32_t *src, int n) {
+	__m256i alpha = _mm256_set1_epi32(0xff000000), zero = _mm256_setzero_si256();
+	__m256i div255 = _mm256_set1_epi16((short)0x8081);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((__m256i *)(src + i));
+		__m256i a = _mm256_and_si256(s, alpha);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, alpha)) == -1) {
+			_mm256_storeu_si256((__m256i *)(dest + i), s);
+			continue;
+		}
+		__m256i clear = _mm256_cmpeq_epi32(a, zero);
+		if (_mm256_movemask_epi8(clear) == -1) {
+			continue;
+		}
+
+		// 255 - alpha, repeated over the 4 channels of each pixel
+		__m256i ia = _mm256_sub_epi32(_mm256_set1_epi32(255), _mm256_srli_epi32(s, 24));
+		ia = _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16));
+		__m256i ialo = _mm256_unpacklo_epi32(ia, ia), iahi = _mm256_unpackhi_epi32(ia, ia);
+
+		__m256i d = _mm256_loadu_si256((__m256i *)(dest + i));
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ialo);
+		__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), iahi);
+		lo = _mm256_srli_epi16(_mm256_mulhi_epu16(lo, div255), 7);
+		hi = _mm256_srli_epi16(_mm256_mulhi_epu16(hi, div255), 7);
+		__m256i out = _mm256_or_si256(_mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)), alpha);
+		_mm256_storeu_si256((__m256i *)(dest + i), _mm256_blendv_epi8(out, d, clear));
+	}
+	compose_row_scalar(dest + i, src + i, n - i);
+}
+
+TARGET_SSE2 static void vignette_row_sse2(uint32_t *row, uint16_t *colf,
+		uint32_t base, uint32_t rowmul, int n) {
+	__m128i vbase = _mm_set1_epi16(base), vrowmul = _mm_set1_epi16(rowmul);
+	__m128i rgb = _mm_set1_epi32(0xffffff);
+	int x = 0;
+	for (; x + 4 <= n; x += 4) {
+		__m128i f = _mm_loadl_epi64((__m128i *)(colf + x));
+		f = _mm_add_epi16(_mm_mulhi_epu16(f, vrowmul), vbase);
+		f = _mm_unpacklo_epi16(f, f);
+		__m128i flo = _mm_unpacklo_epi32(f, f), fhi = _mm_unpackhi_epi32(f, f);
+
+		__m128i px = _mm_loadu_si128((__m128i *)(row + x));
+		__m128i lo = _mm_srli_epi16(_mm_mulhi_epu16(_mm_unpacklo_epi8(px, px), flo), 8);
+		__m128i hi = _mm_srli_epi16(_mm_mulhi_epu16(_mm_unpackhi_epi8(px, px), fhi), 8);
+		_mm_storeu_si128((__m128i *)(row + x), _mm_and_si128(_mm_packus_epi16(lo, hi), rgb));
+	}
+	vignette_row_scalar(row + x, colf + x, base, rowmul, n - x);
+}
+
+TARGET_AVX2 static void vignette_row_avx2(uint32_t *row, uint16_t *colf,
+		uint32_t base, uint32_t rowmul, int n) {
+	__m128i vbase = _mm_set1_epi16(base), vrowmul = _mm_set1_epi16(rowmul);
+	__m256i rgb = _mm256_set1_epi32(0xffffff);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		__m128i f16 = _mm_loadu_si128((__m128i *)(colf + x));
+		f16 = _mm_add_epi16(_mm_mulhi_epu16(f16, vrowmul), vbase);
+		// One factor per 32-bit lane, copied into both halves, then
+		// interleaved to match the in-lane byte unpacking below
+		__m256i f = _mm256_cvtepu16_epi32(f16);
+		f = _mm256_or_si256(f, _mm256_slli_epi32(f, 16));
+		__m256i flo = _mm256_unpacklo_epi32(f, f), fhi = _mm256_unpackhi_epi32(f, f);
+
+		__m256i px = _mm256_loadu_si256((__m256i *)(row + x));
+		__m256i lo = _mm256_srli_epi16(
+				_mm256_mulhi_epu16(_mm256_unpacklo_epi8(px, px), flo), 8);
+		__m256i hi = _mm256_srli_epi16(
+				_mm256_mulhi_epu16(_mm256_unpackhi_epi8(px, px), fhi), 8);
+		_mm256_storeu_si256((__m256i *)(row + x),
+				_mm256_and_si256(_mm256_packus_epi16(lo, hi), rgb));
+	}
+	vignette_row_scalar(row + x, colf + x, base, rowmul, n - x);
+}
+
+TARGET_SSE2 static void resample_v_row_sse2(uint16_t *dest, uint8_t *src, size_t stride,
+		uint16_t *weights, int taps, int n) {
+	__m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i lo = zero, hi = zero;
+		for (int k = 0; k < taps; ++k) {
+			__m128i w = _mm_set1_epi16(weights[k]);
+			__m128i px = _mm_loadu_si128((__m128i *)(src + k * stride + i));
+			lo = _mm_add_epi16(lo, _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, px), w));
+			hi = _mm_add_epi16(hi, _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, px), w));
+		}
+		_mm_storeu_si128((__m128i *)(dest + i), lo);
+		_mm_storeu_si128((__m128i *)(dest + i + 8), hi);
+	}
+	resample_v_row_scalar(dest + i, src + i, stride, weights, taps, n - i);
+}
+
+// Two pixels at a time, one in each half of the vector. This is also used
+// on AVX2 machines, since the loads from two places in the line dominate.
+TARGET_SSE2 static void resample_h_row_sse2(uint32_t *dest, uint16_t *line, int *start,
+		uint16_t *weights, int taps, int n) {
+	__m128i half = _mm_set1_epi16(32);
+	__m128i rgb = _mm_set1_epi32(0xffffff);
+	int i = 0;
+	for (; i + 2 <= n; i += 2) {
+		uint16_t *in0 = line + 4 * (size_t)start[i];
+		uint16_t *in1 = line + 4 * (size_t)start[i + 1];
+		uint16_t *w0 = weights + (size_t)i * taps, *w1 = w0 + taps;
+		__m128i acc = _mm_setzero_si128();
+		for (int k = 0; k < taps; ++k) {
+			__m128i px = _mm_unpacklo_epi64(
+					_mm_loadl_epi64((__m128i *)(in0 + 4 * k)),
+					_mm_loadl_epi64((__m128i *)(in1 + 4 * k)));
+			__m128i w = _mm_unpacklo_epi64(
+					_mm_set1_epi16(w0[k]), _mm_set1_epi16(w1[k]));
+			acc = _mm_add_epi16(acc, _mm_mulhi_epu16(px, w));
+		}
+		acc = _mm_srli_epi16(_mm_add_epi16(acc, half), 6);
+		acc = _mm_and_si128(_mm_packus_epi16(acc, acc), rgb);
+		_mm_storel_epi64((__m128i *)(dest + i), acc);
+	}
+	resample_h_row_scalar(dest + i, line, start + i,
+			weights + (size_t)i * taps, taps, n - i);
+}
+
+TARGET_AVX2 static void resample_v_row_avx2(uint16_t *dest, uint8_t *src, size_t stride,
+		uint16_t *weights, int taps, int n) {
+	__m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i lo = zero, hi = zero;
+		for (int k = 0; k < taps; ++k) {
+			__m256i w = _mm256_set1_epi16(weights[k]);
+			__m256i px = _mm256_loadu_si256((__m256i *)(src + k * stride + i));
+			lo = _mm256_add_epi16(lo, _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, px), w));
+			hi = _mm256_add_epi16(hi, _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, px), w));
+		}
+		// The unpacks work within each 128-bit lane, so put the lanes back in order
+		_mm256_storeu_si256((__m256i *)(dest + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dest + i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	resample_v_row_scalar(dest + i, src + i, stride, weights, taps, n - i);
+}
+
+// 'lanes' must be a multiple of 4.
+TARGET_SSE2 static void iir_lanes_sse2(float *buf, int n, int lanes, struct iir_coeffs *k) {
+	__m128 b = _mm_set1_ps(k->b);
+	__m128 c1 = _mm_set1_ps(k->c1), c2 = _mm_set1_ps(k->c2), c3 = _mm_set1_ps(k->c3);
+
+	for (int l = 0; l < lanes; l += 4) {
+		float *p = buf + l;
+		__m128 w1 = _mm_loadu_ps(p), w2 = w1, w3 = w1;
+		for (int i = 0; i < n; ++i) {
+			float *x = p + (size_t)i * lanes;
+			__m128 w = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(b, _mm_loadu_ps(x)), _mm_mul_ps(c1, w1)),
+					_mm_add_ps(_mm_mul_ps(c2, w2), _mm_mul_ps(c3, w3)));
+			_mm_storeu_ps(x, w);
+			w3 = w2; w2 = w1; w1 = w;
+		}
+
+		w1 = w2 = w3 = _mm_loadu_ps(p + (size_t)(n - 1) * lanes);
+		for (int i = n - 1; i >= 0; --i) {
+			float *x = p + (size_t)i * lanes;
+			__m128 w = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(b, _mm_loadu_ps(x)), _mm_mul_ps(c1, w1)),
+					_mm_add_ps(_mm_mul_ps(c2, w2), _mm_mul_ps(c3, w3)));
+			_mm_storeu_ps(x, w);
+			w3 = w2; w2 = w1; w1 = w;
+		}
+	}
+}
+
+// 'lanes' must be a multiple of 8.
+TARGET_AVX2 static void iir_lanes_avx2(float *buf, int n, int lanes, struct iir_coeffs *k) {
+	__m256 b = _mm256_set1_ps(k->b);
+	__m256 c1 = _mm256_set1_ps(k->c1), c2 = _mm256_set1_ps(k->c2), c3 = _mm256_set1_ps(k->c3);
+
+	for (int l = 0; l < lanes; l += 8) {
+		float *p = buf + l;
+		__m256 w1 = _mm256_loadu_ps(p), w2 = w1, w3 = w1;
+		for (int i = 0; i < n; ++i) {
+			float *x = p + (size_t)i * lanes;
+			__m256 w = _mm256_add_ps(
+					_mm256_add_ps(_mm256_mul_ps(b, _mm256_loadu_ps(x)), _mm256_mul_ps(c1, w1)),
+					_mm256_add_ps(_mm256_mul_ps(c2, w2), _mm256_mul_ps(c3, w3)));
+			_mm256_storeu_ps(x, w);
+			w3 = w2; w2 = w1; w1 = w;
+		}
+
+		w1 = w2 = w3 = _mm256_loadu_ps(p + (size_t)(n - 1) * lanes);
+		for (int i = n - 1; i >= 0; --i) {
+			float *x = p + (size_t)i * lanes;
+			__m256 w = _mm256_add_ps(
+					_mm256_add_ps(_mm256_mul_ps(b, _mm256_loadu_ps(x)), _mm256_mul_ps(c1, w1)),
+					_mm256_add_ps(_mm256_mul_ps(c2, w2), _mm256_mul_ps(c3, w3)));
+			_mm256_storeu_ps(x, w);
+			w3 = w2; w2 = w1; w1 = w;
+		}
+	}
+}
+
+// The planar kernels work on 16 (SSE2) or 32 (AVX2) bytes of each plane at
+// a time, and leave the rest of the row to the scalar version.
+
+TARGET_SSE2 static void planar_split_row_sse2(uint8_t *r, uint8_t *g, uint8_t *b,
+		uint32_t *src, int n) {
+	__m128i mask = _mm_set1_epi32(0xff);
+	uint8_t *planes[3] = { b, g, r };
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i px[4];
+		for (int i = 0; i < 4; ++i) {
+			px[i] = _mm_loadu_si128((__m128i *)(src + x + 4 * i));
+		}
+		for (int c = 0; c < 3; ++c) {
+			__m128i shift = _mm_cvtsi32_si128(8 * c), v[4];
+			for (int i = 0; i < 4; ++i) {
+				v[i] = _mm_and_si128(_mm_srl_epi32(px[i], shift), mask);
+			}
+			_mm_storeu_si128((__m128i *)(planes[c] + x), _mm_packus_epi16(
+					_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3])));
+		}
+	}
+	planar_split_row_scalar(r + x, g + x, b + x, src + x, n - x);
+}
+
+TARGET_SSE2 static void planar_merge_row_sse2(uint32_t *dest, uint8_t *r, uint8_t *g,
+		uint8_t *b, int n) {
+	__m128i zero = _mm_setzero_si128();
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i rv = _mm_loadu_si128((__m128i *)(r + x));
+		__m128i gv = _mm_loadu_si128((__m128i *)(g + x));
+		__m128i bv = _mm_loadu_si128((__m128i *)(b + x));
+		__m128i bglo = _mm_unpacklo_epi8(bv, gv), bghi = _mm_unpackhi_epi8(bv, gv);
+		__m128i rlo = _mm_unpacklo_epi8(rv, zero), rhi = _mm_unpackhi_epi8(rv, zero);
+		_mm_storeu_si128((__m128i *)(dest + x), _mm_unpacklo_epi16(bglo, rlo));
+		_mm_storeu_si128((__m128i *)(dest + x + 4), _mm_unpackhi_epi16(bglo, rlo));
+		_mm_storeu_si128((__m128i *)(dest + x + 8), _mm_unpacklo_epi16(bghi, rhi));
+		_mm_storeu_si128((__m128i *)(dest + x + 12), _mm_unpackhi_epi16(bghi, rhi));
+	}
+	planar_merge_row_scalar(dest + x, r + x, g + x, b + x, n - x);
+}
+
+TARGET_SSE2 static inline __m128i sse2_load_u8x4(uint8_t *p) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_cvtsi32_si128(*(int32_t *)p);
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+}
+
+// Runs down 16 columns at a time, with the window sums kept in registers.
+TARGET_SSE2 static void planar_blur_cols_sse2(uint8_t *dest, size_t dstride,
+		uint8_t *src, size_t sstride,
+		int height, int ncols, int radius, uint32_t *recip) {
+	const int minradius = radius < height ? radius : height;
+
+	int x = 0;
+	for (; x + 16 <= ncols; x += 16) {
+		__m128i acc[4];
+		for (int i = 0; i < 4; ++i) {
+			acc[i] = _mm_setzero_si128();
+		}
+		int range = minradius;
+		for (int y = 0; y < minradius; ++y) {
+			for (int i = 0; i < 4; ++i) {
+				acc[i] = _mm_add_epi32(acc[i],
+						sse2_load_u8x4(src + (size_t)y * sstride + x + 4 * i));
+			}
+		}
+
+		for (int y = 0; y < height; ++y) {
+			if (y >= minradius) {
+				uint8_t *srow = src + (size_t)(y - radius) * sstride + x;
+				for (int i = 0; i < 4; ++i) {
+					acc[i] = _mm_sub_epi32(acc[i], sse2_load_u8x4(srow + 4 * i));
+				}
+				range -= 1;
+			}
+			if (y < height - minradius) {
+				uint8_t *srow = src + (size_t)(y + radius) * sstride + x;
+				for (int i = 0; i < 4; ++i) {
+					acc[i] = _mm_add_epi32(acc[i], sse2_load_u8x4(srow + 4 * i));
+				}
+				range += 1;
+			}
+
+			__m128i vrecip = _mm_set1_epi32(recip[range]), out[4];
+			for (int i = 0; i < 4; ++i) {
+				out[i] = sse2_div(acc[i], vrecip);
+			}
+			_mm_storeu_si128((__m128i *)(dest + (size_t)y * dstride + x), _mm_packus_epi16(
+					_mm_packs_epi32(out[0], out[1]), _mm_packs_epi32(out[2], out[3])));
+		}
+	}
+
+	if (x < ncols) {
+		planar_blur_cols_scalar(dest + x, dstride, src + x, sstride,
+				height, ncols - x, radius, recip);
+	}
+}
+
+// Running totals 4 at a time: each vector is summed with itself shifted by
+// one and then two lanes, and the total so far is added on.
+TARGET_SSE2 static void planar_prefix_sums_sse2(uint32_t *prefix, uint8_t *src, int width) {
+	__m128i total = _mm_setzero_si128();
+	prefix[0] = 0;
+	int x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = sse2_load_u8x4(src + x);
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi32(v, total);
+		_mm_storeu_si128((__m128i *)(prefix + x + 1), v);
+		total = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	for (; x < width; ++x) {
+		prefix[x + 1] = prefix[x] + src[x];
+	}
+}
+
+// Away from the ends of the row every window is 2 * radius pixels wide,
+// so the sums there are done 16 at a time.
+TARGET_SSE2 static void planar_blur_row_sse2(uint8_t *dest, uint8_t *src, uint32_t *prefix,
+		int width, int radius, uint32_t *recip) {
+	planar_prefix_sums_sse2(prefix, src, width);
+
+	int start = MIN(radius > 0 ? radius - 1 : 0, width);
+	int end = width - radius > start ? width - radius : start;
+	planar_box_sums_scalar(dest, prefix, width, radius, recip, 0, start);
+
+	__m128i vrecip = _mm_set1_epi32(recip[MIN(2 * radius, width)]);
+	int x = start;
+	for (; x + 16 <= end; x += 16) {
+		__m128i out[4];
+		for (int i = 0; i < 4; ++i) {
+			__m128i hi = _mm_loadu_si128((__m128i *)(prefix + x + 4 * i + radius + 1));
+			__m128i lo = _mm_loadu_si128((__m128i *)(prefix + x + 4 * i - radius + 1));
+			out[i] = sse2_div(_mm_sub_epi32(hi, lo), vrecip);
+		}
+		_mm_storeu_si128((__m128i *)(dest + x), _mm_packus_epi16(
+				_mm_packs_epi32(out[0], out[1]), _mm_packs_epi32(out[2], out[3])));
+	}
+	planar_box_sums_scalar(dest, prefix, width, radius, recip, x, width);
+}
+
+TARGET_SSE2 static void planar_greyscale_row_sse2(uint8_t *r, uint8_t *g, uint8_t *b, int n) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i wrg = _mm_set1_epi32(GREY_WG << 16 | GREY_WR), wb = _mm_set1_epi32(GREY_WB);
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		__m128i r16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(r + x)), zero);
+		__m128i g16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(g + x)), zero);
+		__m128i b16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(b + x)), zero);
+		__m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r16, g16), wrg),
+				_mm_madd_epi16(_mm_unpacklo_epi16(b16, zero), wb));
+		__m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r16, g16), wrg),
+				_mm_madd_epi16(_mm_unpackhi_epi16(b16, zero), wb));
+		__m128i luma = _mm_packs_epi32(_mm_srli_epi32(lo, 15), _mm_srli_epi32(hi, 15));
+		luma = _mm_packus_epi16(luma, luma);
+		_mm_storel_epi64((__m128i *)(r + x), luma);
+		_mm_storel_epi64((__m128i *)(g + x), luma);
+		_mm_storel_epi64((__m128i *)(b + x), luma);
+	}
+	planar_greyscale_row_scalar(r + x, g + x, b + x, n - x);
+}
+
+TARGET_SSE2 static void planar_vignette_row_sse2(uint8_t *r, uint8_t *g, uint8_t *b,
+		uint16_t *colf, uint32_t base, uint32_t rowmul, int n) {
+	__m128i vbase = _mm_set1_epi16(base), vrowmul = _mm_set1_epi16(rowmul);
+	uint8_t *planes[3] = { r, g, b };
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i flo = _mm_add_epi16(vbase, _mm_mulhi_epu16(
+					_mm_loadu_si128((__m128i *)(colf + x)), vrowmul));
+		__m128i fhi = _mm_add_epi16(vbase, _mm_mulhi_epu16(
+					_mm_loadu_si128((__m128i *)(colf + x + 8)), vrowmul));
+		for (int c = 0; c < 3; ++c) {
+			__m128i v = _mm_loadu_si128((__m128i *)(planes[c] + x));
+			__m128i lo = _mm_srli_epi16(_mm_mulhi_epu16(_mm_unpacklo_epi8(v, v), flo), 8);
+			__m128i hi = _mm_srli_epi16(_mm_mulhi_epu16(_mm_unpackhi_epi8(v, v), fhi), 8);
+			_mm_storeu_si128((__m128i *)(planes[c] + x), _mm_packus_epi16(lo, hi));
+		}
+	}
+	planar_vignette_row_scalar(r + x, g + x, b + x, colf + x, base, rowmul, n - x);
+}
+
+// Puts the 32-bit lanes of 'packus_epi16(packs_epi32(a, b), packs_epi32(c, d))'
+// back in the order of the pixels in a, b, c and d.
+#define AVX2_PACK_ORDER _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)
+
+TARGET_AVX2 static void planar_split_row_avx2(uint8_t *r, uint8_t *g, uint8_t *b,
+		uint32_t *src, int n) {
+	__m256i mask = _mm256_set1_epi32(0xff);
+	uint8_t *planes[3] = { b, g, r };
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m256i px[4];
+		for (int i = 0; i < 4; ++i) {
+			px[i] = _mm256_loadu_si256((__m256i *)(src + x + 8 * i));
+		}
+		for (int c = 0; c < 3; ++c) {
+			__m128i shift = _mm_cvtsi32_si128(8 * c);
+			__m256i v[4];
+			for (int i = 0; i < 4; ++i) {
+				v[i] = _mm256_and_si256(_mm256_srl_epi32(px[i], shift), mask);
+			}
+			__m256i out = _mm256_packus_epi16(
+					_mm256_packs_epi32(v[0], v[1]), _mm256_packs_epi32(v[2], v[3]));
+			_mm256_storeu_si256((__m256i *)(planes[c] + x),
+					_mm256_permutevar8x32_epi32(out, AVX2_PACK_ORDER));
+		}
+	}
+	planar_split_row_sse2(r + x, g + x, b + x, src + x, n - x);
+}
+
+TARGET_AVX2 static void planar_merge_row_avx2(uint32_t *dest, uint8_t *r, uint8_t *g,
+		uint8_t *b, int n) {
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		__m256i rv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(r + x)));
+		__m256i gv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(g + x)));
+		__m256i bv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(b + x)));
+		__m256i px = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(rv, 16),
+					_mm256_slli_epi32(gv, 8)), bv);
+		_mm256_storeu_si256((__m256i *)(dest + x), px);
+	}
+	planar_merge_row_scalar(dest + x, r + x, g + x, b + x, n - x);
+}
+
+TARGET_AVX2 static inline __m256i avx2_load_u8x8(uint8_t *p) {
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)p));
+}
+
+// Runs down the whole strip at once, so every row of it is one cache line.
+TARGET_AVX2 static void planar_blur_cols_avx2(uint8_t *dest, size_t dstride,
+		uint8_t *src, size_t sstride,
+		int height, int ncols, int radius, uint32_t *recip) {
+	if (ncols < PLANAR_STRIP) {
+		planar_blur_cols_sse2(dest, dstride, src, sstride, height, ncols, radius, recip);
+		return;
+	}
+
+	const int minradius = radius < height ? radius : height;
+
+	__m256i acc[8];
+	for (int i = 0; i < 8; ++i) {
+		acc[i] = _mm256_setzero_si256();
+	}
+	int range = minradius;
+	for (int y = 0; y < minradius; ++y) {
+		for (int i = 0; i < 8; ++i) {
+			acc[i] = _mm256_add_epi32(acc[i], avx2_load_u8x8(src + (size_t)y * sstride + 8 * i));
+		}
+	}
+
+	for (int y = 0; y < height; ++y) {
+		if (y >= minradius) {
+			uint8_t *srow = src + (size_t)(y - radius) * sstride;
+			for (int i = 0; i < 8; ++i) {
+				acc[i] = _mm256_sub_epi32(acc[i], avx2_load_u8x8(srow + 8 * i));
+			}
+			range -= 1;
+		}
+		if (y < height - minradius) {
+			uint8_t *srow = src + (size_t)(y + radius) * sstride;
+			for (int i = 0; i < 8; ++i) {
+				acc[i] = _mm256_add_epi32(acc[i], avx2_load_u8x8(srow + 8 * i));
+			}
+			range += 1;
+		}
+
+		__m256i vrecip = _mm256_set1_epi32(recip[range]);
+		for (int i = 0; i < 8; i += 4) {
+			__m256i out[4];
+			for (int k = 0; k < 4; ++k) {
+				out[k] = avx2_div(acc[i + k], vrecip);
+			}
+			__m256i v = _mm256_packus_epi16(
+					_mm256_packs_epi32(out[0], out[1]), _mm256_packs_epi32(out[2], out[3]));
+			_mm256_storeu_si256((__m256i *)(dest + (size_t)y * dstride + 8 * i),
+					_mm256_permutevar8x32_epi32(v, AVX2_PACK_ORDER));
+		}
+	}
+}
+
+TARGET_AVX2 static void planar_prefix_sums_avx2(uint32_t *prefix, uint8_t *src, int width) {
+	__m256i total = _mm256_setzero_si256(), last = _mm256_set1_epi32(7);
+	prefix[0] = 0;
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i v = avx2_load_u8x8(src + x);
+		v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+		v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+		// Carry the low half's total into the high half
+		v = _mm256_add_epi32(v, _mm256_shuffle_epi32(
+					_mm256_permute2x128_si256(v, v, 0x08), _MM_SHUFFLE(3, 3, 3, 3)));
+		v = _mm256_add_epi32(v, total);
+		_mm256_storeu_si256((__m256i *)(prefix + x + 1), v);
+		total = _mm256_permutevar8x32_epi32(v, last);
+	}
+	for (; x < width; ++x) {
+		prefix[x + 1] = prefix[x] + src[x];
+	}
+}
+
+TARGET_AVX2 static void planar_blur_row_avx2(uint8_t *dest, uint8_t *src, uint32_t *prefix,
+		int width, int radius, uint32_t *recip) {
+	planar_prefix_sums_avx2(prefix, src, width);
+
+	int start = MIN(radius > 0 ? radius - 1 : 0, width);
+	int end = width - radius > start ? width - radius : start;
+	planar_box_sums_scalar(dest, prefix, width, radius, recip, 0, start);
+
+	__m256i vrecip = _mm256_set1_epi32(recip[MIN(2 * radius, width)]);
+	int x = start;
+	for (; x + 32 <= end; x += 32) {
+		__m256i out[4];
+		for (int i = 0; i < 4; ++i) {
+			__m256i hi = _mm256_loadu_si256((__m256i *)(prefix + x + 8 * i + radius + 1));
+			__m256i lo = _mm256_loadu_si256((__m256i *)(prefix + x + 8 * i - radius + 1));
+			out[i] = avx2_div(_mm256_sub_epi32(hi, lo), vrecip);
+		}
+		__m256i v = _mm256_packus_epi16(
+				_mm256_packs_epi32(out[0], out[1]), _mm256_packs_epi32(out[2], out[3]));
+		_mm256_storeu_si256((__m256i *)(dest + x),
+				_mm256_permutevar8x32_epi32(v, AVX2_PACK_ORDER));
+	}
+	planar_box_sums_scalar(dest, prefix, width, radius, recip, x, width);
+}
+
+TARGET_AVX2 static void planar_greyscale_row_avx2(uint8_t *r, uint8_t *g, uint8_t *b, int n) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i wrg = _mm256_set1_epi32(GREY_WG << 16 | GREY_WR), wb = _mm256_set1_epi32(GREY_WB);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m256i r16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(r + x)));
+		__m256i g16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(g + x)));
+		__m256i b16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(b + x)));
+		__m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r16, g16), wrg),
+				_mm256_madd_epi16(_mm256_unpacklo_epi16(b16, zero), wb));
+		__m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r16, g16), wrg),
+				_mm256_madd_epi16(_mm256_unpackhi_epi16(b16, zero), wb));
+		__m256i luma = _mm256_packs_epi32(_mm256_srli_epi32(lo, 15), _mm256_srli_epi32(hi, 15));
+		luma = _mm256_permute4x64_epi64(_mm256_packus_epi16(luma, luma), _MM_SHUFFLE(3, 1, 2, 0));
+		__m128i out = _mm256_castsi256_si128(luma);
+		_mm_storeu_si128((__m128i *)(r + x), out);
+		_mm_storeu_si128((__m128i *)(g + x), out);
+		_mm_storeu_si128((__m128i *)(b + x), out);
+	}
+	planar_greyscale_row_sse2(r + x, g + x, b + x, n - x);
+}
+
+TARGET_AVX2 static void planar_vignette_row_avx2(uint8_t *r, uint8_t *g, uint8_t *b,
+		uint16_t *colf, uint32_t base, uint32_t rowmul, int n) {
+	__m256i vbase = _mm256_set1_epi16(base), vrowmul = _mm256_set1_epi16(rowmul);
+	uint8_t *planes[3] = { r, g, b };
+	int x = 0;
+	for (; x + 32 <= n; x += 32) {
+		__m256i f0 = _mm256_add_epi16(vbase, _mm256_mulhi_epu16(
+					_mm256_loadu_si256((__m256i *)(colf + x)), vrowmul));
+		__m256i f1 = _mm256_add_epi16(vbase, _mm256_mulhi_epu16(
+					_mm256_loadu_si256((__m256i *)(colf + x + 16)), vrowmul));
+		// Byte unpacking works within each 128-bit half, so match the factors to it
+		__m256i flo = _mm256_permute2x128_si256(f0, f1, 0x20);
+		__m256i fhi = _mm256_permute2x128_si256(f0, f1, 0x31);
+		for (int c = 0; c < 3; ++c) {
+			__m256i v = _mm256_loadu_si256((__m256i *)(planes[c] + x));
+			__m256i lo = _mm256_srli_epi16(
+					_mm256_mulhi_epu16(_mm256_unpacklo_epi8(v, v), flo), 8);
+			__m256i hi = _mm256_srli_epi16(
+					_mm256_mulhi_epu16(_mm256_unpackhi_epi8(v, v), fhi), 8);
+			_mm256_storeu_si256((__m256i *)(planes[c] + x), _mm256_packus_epi16(lo, hi));
+		}
+	}
+	planar_vignette_row_sse2(r + x, g + x, b + x, colf + x, base, rowmul, n - x);
+}
+
+#endif
+
+// Processes 'nrows' consecutive rows.
+static void (*blur_h_rows)(uint32_t *dest, uint32_t *src, int width, int nrows,
+		int radius, uint32_t *recip) = blur_h_rows_scalar;
+
+// Processes 'ncols' (at most BLUR_V_STRIP) adjacent columns.
+static void (*blur_v_cols)(uint32_t *dest, int dstride, uint32_t *src, int sstride,
+		int height, int ncols, int radius, uint32_t *recip) = blur_v_cols_scalar;
+
+static void (*fill_pixels)(uint32_t *dest, uint32_t pix, int n) = fill_pixels_scalar;
+static void (*resample_v_row)(uint16_t *dest, uint8_t *src, size_t stride,
+		uint16_t *weights, int taps, int n) = resample_v_row_scalar;
+static void (*resample_h_row)(uint32_t *dest, uint16_t *line, int *start,
+		uint16_t *weights, int taps, int n) = resample_h_row_scalar;
+static void (*compose_row)(uint32_t *dest, uint32_t *src, int n) = compose_row_scalar;
+static void (*greyscale_row)(uint32_t *row, int n) = greyscale_row_scalar;
+static void (*vignette_row)(uint32_t *row, uint16_t *colf,
+		uint32_t base, uint32_t rowmul, int n) = vignette_row_scalar;
+
+static void (*planar_split_row)(uint8_t *r, uint8_t *g, uint8_t *b,
+		uint32_t *src, int n) = planar_split_row_scalar;
+static void (*planar_merge_row)(uint32_t *dest, uint8_t *r, uint8_t *g,
+		uint8_t *b, int n) = planar_merge_row_scalar;
+static void (*planar_blur_cols)(uint8_t *dest, size_t dstride, uint8_t *src,
+		size_t sstride, int height, int ncols, int radius,
+		uint32_t *recip) = planar_blur_cols_scalar;
+static void (*planar_greyscale_row)(uint8_t *r, uint8_t *g, uint8_t *b,
+		int n) = planar_greyscale_row_scalar;
+static void (*planar_vignette_row)(uint8_t *r, uint8_t *g, uint8_t *b, uint16_t *colf,
+		uint32_t base, uint32_t rowmul, int n) = planar_vignette_row_scalar;
+static void (*planar_blur_row)(uint8_t *dest, uint8_t *src, uint32_t *prefix,
+		int width, int radius, uint32_t *recip) = planar_blur_row_scalar;
+
+// Runs the recursive Gaussian filter; 'lanes' is always a multiple of 16.
+static void (*iir_lanes)(float *buf, int n, int lanes,
+		struct iir_coeffs *k) = iir_lanes_scalar;
+
+static void pick_kernels(void) {
+#ifdef CPU_X86_SIMD
+	switch (cpu_level()) {
+	case CPU_LEVEL_AVX2:
+		swaylock_log(LOG_DEBUG, "Using AVX2 effect kernels");
+		blur_h_rows = blur_h_rows_avx2;
+		blur_v_cols = blur_v_cols_avx2;
+		iir_lanes = iir_lanes_avx2;
+		fill_pixels = fill_pixels_avx2;
+		resample_v_row = resample_v_row_avx2;
+		resample_h_row = resample_h_row_sse2;
+		compose_row = compose_row_avx2;
+		greyscale_row = greyscale_row_avx2;
+		vignette_row = vignette_row_avx2;
+		planar_split_row = planar_split_row_avx2;
+		planar_merge_row = planar_merge_row_avx2;
+		planar_blur_cols = planar_blur_cols_avx2;
+		planar_greyscale_row = planar_greyscale_row_avx2;
+		planar_vignette_row = planar_vignette_row_avx2;
+		planar_blur_row = planar_blur_row_avx2;
+		break;
+	case CPU_LEVEL_SSE2:
+		swaylock_log(LOG_DEBUG, "Using SSE2 effect kernels");
+		blur_h_rows = blur_h_rows_sse2;
+		blur_v_cols = blur_v_cols_sse2;
+		iir_lanes = iir_lanes_sse2;
+		fill_pixels = fill_pixels_sse2;
+		resample_v_row = resample_v_row_sse2;
+		resample_h_row = resample_h_row_sse2;
+		compose_row = compose_row_sse2;
+		greyscale_row = greyscale_row_sse2;
+		vignette_row = vignette_row_sse2;
+		planar_split_row = planar_split_row_sse2;
+		planar_merge_row = planar_merge_row_sse2;
+		planar_blur_cols = planar_blur_cols_sse2;
+		planar_greyscale_row = planar_greyscale_row_sse2;
+		planar_vignette_row = planar_vignette_row_sse2;
+		planar_blur_row = planar_blur_row_sse2;
+		break;
+	case CPU_LEVEL_SCALAR:
+		break;
+	}
+#endif
+}
+
+// Effects for several outputs can start at once on different threads
+static void select_kernels(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, pick_kernels);
+}
+
+// Frame-sized buffers are pooled for the length of one swaylock_effects_run,
+// so an effect which needs a new image or scratch space reuses one an
+// earlier effect is done with, instead of allocating and faulting in
+// another 30 MB. Buffers are mapped directly, so they go straight back to
+// the system when freed, and big ones ask for transparent huge pages. In
+// the effects helper they're memfds, so the final image can be handed to
+// swaylock as it is.
+#define EFFECT_POOL_SIZE 8
+#define EFFECT_POOL_HUGE_MIN (2 * 1024 * 1024)
+
+struct effect_pool;
+
+struct effect_buffer {
+	struct effect_pool *pool; // NULL once the buffer outlives its pool
+	void *data;
+	size_t size;
+	int fd;
+	bool in_use;
+};
+
+struct effect_pool {
+	struct effect_buffer *bufs[EFFECT_POOL_SIZE];
+	int count;
+};
+
+static int (*buffer_fd_create)(size_t size) = NULL;
+
+void swaylock_effects_set_buffer_fd(int (*create)(size_t size)) {
+	buffer_fd_create = create;
+}
+
+static void effect_buffer_unmap(struct effect_buffer *buf) {
+	munmap(buf->data, buf->size);
+	if (buf->fd >= 0) {
+		close(buf->fd);
+	}
+	free(buf);
+}
+
+static struct effect_buffer *effect_pool_get(struct effect_pool *pool, size_t size) {
+	// Use the smallest free buffer which is big enough
+	struct effect_buffer *best = NULL;
+	for (int i = 0; i < pool->count; ++i) {
+		struct effect_buffer *buf = pool->bufs[i];
+		if (!buf->in_use && buf->size >= size &&
+				(best == NULL || buf->size < best->size)) {
+			best = buf;
 		}
+	}
+	if (best != NULL) {
+		best->in_use = true;
+		return best;
+	}
+
+	struct effect_buffer *buf = calloc(1, sizeof(*buf));
+	if (buf == NULL) {
+		return NULL;
+	}
+	buf->size = size;
+	buf->fd = buffer_fd_create != NULL ? buffer_fd_create(size) : -1;
+	if (buf->fd >= 0) {
+		buf->data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, buf->fd, 0);
 	} else {
-		swaylock_log(
-			LOG_ERROR, "%s: Unknown file type for custom effect (expected .c or .so)",
-			path);
+		buf->data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (buf->data == MAP_FAILED) {
+		if (buf->fd >= 0) {
+			close(buf->fd);
+		}
+		free(buf);
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if (size >= EFFECT_POOL_HUGE_MIN) {
+		madvise(buf->data, size, MADV_HUGEPAGE);
+	}
+#endif
+
+	buf->in_use = true;
+	if (pool->count < EFFECT_POOL_SIZE) {
+		buf->pool = pool;
+		pool->bufs[pool->count++] = buf;
+	}
+	return buf;
+}
+
+static void effect_pool_put(struct effect_buffer *buf) {
+	if (buf->pool != NULL) {
+		buf->in_use = false;
+	} else {
+		effect_buffer_unmap(buf);
+	}
+}
+
+// Frees every buffer which isn't in use. The ones still in use, such as the
+// one behind the final image, are freed when they're put back.
+static void effect_pool_finish(struct effect_pool *pool) {
+	for (int i = 0; i < pool->count; ++i) {
+		struct effect_buffer *buf = pool->bufs[i];
+		if (buf->in_use) {
+			buf->pool = NULL;
+		} else {
+			effect_buffer_unmap(buf);
+		}
+	}
+	pool->count = 0;
+}
+
+static cairo_user_data_key_t effect_buffer_key;
+
+static void effect_buffer_surface_destroy(void *data) {
+	effect_pool_put(data);
+}
+
+// Creates an RGB24 surface backed by a pool buffer, which goes back to the
+// pool when the surface is destroyed. Falls back to letting cairo allocate
+// the surface if there's no buffer.
+static cairo_surface_t *effect_pool_surface(struct effect_pool *pool,
+		int width, int height) {
+	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+	struct effect_buffer *buf = NULL;
+	if (width > 0 && height > 0 && stride > 0) {
+		buf = effect_pool_get(pool, (size_t)stride * height);
+	}
+	if (buf == NULL) {
+		return cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	}
+
+	cairo_surface_t *surf = cairo_image_surface_create_for_data(
+			buf->data, CAIRO_FORMAT_RGB24, width, height, stride);
+	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS ||
+			cairo_surface_set_user_data(surf, &effect_buffer_key,
+				buf, effect_buffer_surface_destroy) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surf);
+		effect_pool_put(buf);
+		return cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	}
+	return surf;
+}
+
+int swaylock_effects_image_fd(cairo_surface_t *image) {
+	struct effect_buffer *buf =
+		cairo_surface_get_user_data(image, &effect_buffer_key);
+	if (buf == NULL || buf->data != cairo_image_surface_get_data(image)) {
+		return -1;
+	}
+	return buf->fd;
+}
+
+// Runs 'times' horizontal passes over up to two rows, keeping the
+// intermediate results in 'buf' (4 rows long).
+static void blur_h_pair(uint32_t *dest, uint32_t *src, int width, int nrows,
+		int radius, int times, uint32_t *recip, uint32_t *buf) {
+	uint32_t *in = src;
+	for (int i = 0; i < times; ++i) {
+		uint32_t *out = i == times - 1 ? dest : buf + (i % 2) * 2 * (size_t)width;
+		blur_h_rows(out, in, width, nrows, radius, recip);
+		in = out;
+	}
+}
+
+// Runs 'times' vertical passes over a strip of up to BLUR_V_STRIP columns in
+// place. The strip is copied into 'buf' (2 * height * BLUR_V_STRIP pixels),
+// blurred there, and the last pass writes the result back.
+static void blur_v_strip(uint32_t *data, int width, int height, int ncols,
+		int radius, int times, uint32_t *recip, uint32_t *buf) {
+	uint32_t *strips[2] = { buf, buf + (size_t)height * BLUR_V_STRIP };
+
+	for (int y = 0; y < height; ++y) {
+		memcpy(strips[0] + (size_t)y * BLUR_V_STRIP, data + (size_t)y * width,
+				ncols * sizeof(*data));
+	}
+
+	for (int i = 0; i < times; ++i) {
+		uint32_t *in = strips[i % 2];
+		if (i == times - 1) {
+			blur_v_cols(data, width, in, BLUR_V_STRIP,
+					height, ncols, radius, recip);
+		} else {
+			blur_v_cols(strips[(i + 1) % 2], BLUR_V_STRIP, in, BLUR_V_STRIP,
+					height, ncols, radius, recip);
+		}
+	}
+}
+
+struct blur_pass {
+	uint32_t *dest, *src;
+	int width, height;
+	int radius, times;
+	uint32_t *recip;
+	uint32_t *linebufs;
+	size_t linebufsize;
+};
+
+static void blur_h_chunk(void *data, int start, int end, int thread) {
+	struct blur_pass *pass = data;
+	for (int i = start; i < end; ++i) {
+		int y = i * 2;
+		blur_h_pair(pass->dest + (size_t)y * pass->width, pass->src + (size_t)y * pass->width,
+				pass->width, MIN(2, pass->height - y), pass->radius, pass->times,
+				pass->recip, pass->linebufs + thread * pass->linebufsize);
+	}
+}
+
+static void blur_v_chunk(void *data, int start, int end, int thread) {
+	struct blur_pass *pass = data;
+	for (int i = start; i < end; ++i) {
+		int x = i * BLUR_V_STRIP;
+		blur_v_strip(pass->dest + x, pass->width, pass->height,
+				MIN(BLUR_V_STRIP, pass->width - x), pass->radius, pass->times,
+				pass->recip, pass->linebufs + thread * pass->linebufsize);
+	}
+}
+
+// Runs 'times' horizontal passes over each pair of rows, keeping the
+// intermediate results in a small per-thread row buffer, so the frame is
+// only read and written once no matter how many times it's blurred.
+static void blur_h(uint32_t *dest, uint32_t *src, int width, int height,
+		int radius, int times, uint32_t *recip, uint32_t *linebufs, size_t linebufsize) {
+	struct blur_pass pass = {
+		dest, src, width, height, radius, times, recip, linebufs, linebufsize,
+	};
+	workers_parallel_for(0, (height + 1) / 2, 0, blur_h_chunk, &pass);
+}
+
+// Same as blur_h, but for the vertical direction: each strip is copied into
+// a per-thread strip buffer, blurred 'times' times there, and the last pass
+// writes the result back. This works in place.
+// Strips are handed out in contiguous chunks, so that threads only share
+// cache lines at the edges of their chunk rather than in every strip.
+static void blur_v(uint32_t *data, int width, int height,
+		int radius, int times, uint32_t *recip, uint32_t *linebufs, size_t linebufsize) {
+	struct blur_pass pass = {
+		data, data, width, height, radius, times, recip, linebufs, linebufsize,
+	};
+	workers_parallel_for(0, (width + BLUR_V_STRIP - 1) / BLUR_V_STRIP, 0,
+			blur_v_chunk, &pass);
+}
+
+// This effect_blur function, and the associated blur_* functions,
+// are my own adaptations of code in yvbbrjdr's i3lock-fancy-rapid:
+// https://github.com/yvbbrjdr/i3lock-fancy-rapid
+// All horizontal passes run before all vertical passes; since the two
+// commute, this only differs from alternating them by rounding.
+static void effect_blur(uint32_t *dest, uint32_t *src, int width, int height, int scale,
+		int radius, int times) {
+	if (times < 1) {
+		memcpy(dest, src, (size_t)width * height * sizeof(*dest));
+		return;
+	}
+
+	// Each thread needs two lines for blur_h and two strips for blur_v
+	size_t linebufsize = 4 * (size_t)width;
+	if (linebufsize < 2 * (size_t)height * BLUR_V_STRIP) {
+		linebufsize = 2 * (size_t)height * BLUR_V_STRIP;
+	}
+
+	uint32_t *linebufs = malloc(workers_count() * linebufsize * sizeof(*linebufs));
+	uint32_t *recip = blur_recip_table(width > height ? width : height);
+	if (linebufs == NULL || recip == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for blur effect");
+		free(linebufs);
+		free(recip);
+		memcpy(dest, src, (size_t)width * height * sizeof(*dest));
+		return;
+	}
+
+	blur_h(dest, src, width, height, radius * scale, times, recip, linebufs, linebufsize);
+	blur_v(dest, width, height, radius * scale, times, recip, linebufs, linebufsize);
+	free(linebufs);
+	free(recip);
+}
+
+struct resize_pass {
+	uint32_t *dest, *src;
+	int dwidth, dheight;
+	int swidth, sheight;
+	uint32_t *linebufs;
+};
+
+// Halves the resolution, averaging each 2x2 block. At the right and bottom
+// edges of odd-sized images, the last row/column is averaged with itself.
+// Red and blue are summed together in one 32-bit integer, since the sums
+// can't overflow into the neighbouring channel.
+static void downsample_half_chunk(void *data, int start, int end, int thread) {
+	struct resize_pass *pass = data;
+	uint32_t *src = pass->src, *dest = pass->dest;
+	int swidth = pass->swidth, sheight = pass->sheight, dwidth = pass->dwidth;
+	for (int dy = start; dy < end; ++dy) {
+		uint32_t *srow0 = src + (size_t)(dy * 2) * swidth;
+		uint32_t *srow1 = src + (size_t)MIN(dy * 2 + 1, sheight - 1) * swidth;
+		uint32_t *drow = dest + (size_t)dy * dwidth;
+		for (int dx = 0; dx < dwidth; ++dx) {
+			int sx0 = dx * 2;
+			int sx1 = MIN(sx0 + 1, swidth - 1);
+			uint32_t a = srow0[sx0], b = srow0[sx1], c = srow1[sx0], d = srow1[sx1];
+
+			uint32_t rb = (a & 0xff00ff) + (b & 0xff00ff) +
+				(c & 0xff00ff) + (d & 0xff00ff) + 0x020002;
+			uint32_t g = (a & 0x00ff00) + (b & 0x00ff00) +
+				(c & 0x00ff00) + (d & 0x00ff00) + 0x000200;
+			drow[dx] = ((rb >> 2) & 0xff00ff) | ((g >> 2) & 0x00ff00);
+		}
+	}
+}
+
+static void downsample_half(uint32_t *dest, uint32_t *src, int swidth, int sheight) {
+	struct resize_pass pass = {
+		.dest = dest, .src = src,
+		.dwidth = (swidth + 1) / 2, .dheight = (sheight + 1) / 2,
+		.swidth = swidth, .sheight = sheight,
+	};
+	workers_parallel_for(0, pass.dheight, 0, downsample_half_chunk, &pass);
+}
+
+// Doubles the resolution (to exactly dwidth x dheight, which must round up
+// to the source size when halved) with bilinear filtering. Every output
+// pixel sits a quarter pixel away from its nearest source pixel, so the
+// weights are always 3/4 and 1/4 in each direction. The vertical weights are
+// applied first, into a per-row buffer at the source width, with red and
+// blue packed into one integer like in downsample_half.
+static void upsample_double_chunk(void *data, int start, int end, int thread) {
+	struct resize_pass *pass = data;
+	uint32_t *src = pass->src, *dest = pass->dest;
+	int swidth = pass->swidth, sheight = pass->sheight, dwidth = pass->dwidth;
+	for (int dy = start; dy < end; ++dy) {
+		int sy = dy / 2;
+		int syn = dy % 2 == 0 ? sy - 1 : sy + 1;
+		syn = syn < 0 ? 0 : syn >= sheight ? sheight - 1 : syn;
+		uint32_t *srow = src + (size_t)sy * swidth;
+		uint32_t *srown = src + (size_t)syn * swidth;
+		uint32_t *drow = dest + (size_t)dy * dwidth;
+		uint32_t *rb = pass->linebufs + (size_t)thread * swidth * 2;
+		uint32_t *g = rb + swidth;
+
+		for (int sx = 0; sx < swidth; ++sx) {
+			rb[sx] = 3 * (srow[sx] & 0xff00ff) + (srown[sx] & 0xff00ff);
+			g[sx] = 3 * (srow[sx] & 0x00ff00) + (srown[sx] & 0x00ff00);
+		}
+
+		for (int dx = 0; dx < dwidth; ++dx) {
+			int sx = dx / 2;
+			int sxn = dx % 2 == 0 ? sx - 1 : sx + 1;
+			sxn = sxn < 0 ? 0 : sxn >= swidth ? swidth - 1 : sxn;
+			uint32_t prb = 3 * rb[sx] + rb[sxn] + 0x080008;
+			uint32_t pg = 3 * g[sx] + g[sxn] + 0x000800;
+			drow[dx] = ((prb >> 4) & 0xff00ff) | ((pg >> 4) & 0x00ff00);
+		}
+	}
+}
+
+static void upsample_double(uint32_t *dest, int dwidth, int dheight,
+		uint32_t *src, int swidth, int sheight, uint32_t *linebufs) {
+	struct resize_pass pass = {
+		dest, src, dwidth, dheight, swidth, sheight, linebufs,
+	};
+	workers_parallel_for(0, dheight, 0, upsample_double_chunk, &pass);
+}
+
+#define BLUR_FAST_MAX_LEVELS 6
+#define BLUR_FAST_MIN_RADIUS 4
+#define BLUR_FAST_MIN_SIZE 8
+
+// A cheap approximation of a large blur: halve the resolution until the
+// blur radius is small, do a box blur there, then double the resolution
+// back up one level at a time. The bilinear upsampling smooths out the
+// blockiness of the low resolution image. This looks close to
+// --effect-blur <radius>x3.
+static void effect_blur_fast(uint32_t *dest, uint32_t *src, int width, int height,
+		int scale, int radius, struct effect_pool *pool) {
+	radius *= scale;
+
+	int levels = 0;
+	while (levels < BLUR_FAST_MAX_LEVELS &&
+			(radius >> (levels + 1)) >= BLUR_FAST_MIN_RADIUS &&
+			(width >> (levels + 1)) >= BLUR_FAST_MIN_SIZE &&
+			(height >> (levels + 1)) >= BLUR_FAST_MIN_SIZE) {
+		levels += 1;
+	}
+
+	if (levels == 0) {
+		effect_blur(dest, src, width, height, 1, radius, 3);
+		return;
+	}
+
+	// bufs[0] is the source image, bufs[levels + 1] holds the blurred
+	// smallest level. The others all share one pool buffer.
+	uint32_t *bufs[BLUR_FAST_MAX_LEVELS + 2] = { src };
+	int widths[BLUR_FAST_MAX_LEVELS + 2] = { width };
+	int heights[BLUR_FAST_MAX_LEVELS + 2] = { height };
+	size_t offsets[BLUR_FAST_MAX_LEVELS + 2];
+	size_t total = 0;
+	for (int i = 1; i <= levels + 1; ++i) {
+		widths[i] = i <= levels ? (widths[i - 1] + 1) / 2 : widths[i - 1];
+		heights[i] = i <= levels ? (heights[i - 1] + 1) / 2 : heights[i - 1];
+		offsets[i] = total;
+		total += (size_t)widths[i] * heights[i];
+	}
+
+	struct effect_buffer *pyramid = effect_pool_get(pool, total * sizeof(*dest));
+	if (pyramid == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for blur-fast effect");
+		memcpy(dest, src, (size_t)width * height * sizeof(*dest));
+		return;
+	}
+	for (int i = 1; i <= levels + 1; ++i) {
+		bufs[i] = (uint32_t *)pyramid->data + offsets[i];
+	}
+
+	for (int i = 1; i <= levels; ++i) {
+		downsample_half(bufs[i], bufs[i - 1], widths[i - 1], heights[i - 1]);
+	}
+
+	int lowradius = (radius + (1 << (levels - 1))) >> levels;
+	effect_blur(bufs[levels + 1], bufs[levels], widths[levels], heights[levels],
+			1, lowradius, 3);
+
+	// Each level's downsampled image isn't needed anymore once the level
+	// below it exists, so the upsampled image can be written over it.
+	uint32_t *linebufs = malloc(
+			(size_t)workers_count() * widths[1] * 2 * sizeof(*linebufs));
+	uint32_t *low = bufs[levels + 1];
+	for (int i = levels - 1; i >= 0 && linebufs != NULL; --i) {
+		uint32_t *out = i == 0 ? dest : bufs[i];
+		upsample_double(out, widths[i], heights[i],
+				low, widths[i + 1], heights[i + 1], linebufs);
+		low = out;
+	}
+	if (linebufs == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for blur-fast effect");
+		memcpy(dest, src, (size_t)width * height * sizeof(*dest));
+	}
+	free(linebufs);
+	effect_pool_put(pyramid);
+}
+
+// The Gaussian blur filters 4 rows at a time horizontally, and strips of
+// 16 columns vertically. Samples are stored as 4 floats per pixel (including
+// the unused X channel), interleaved across the rows or columns, so the
+// filter can run on all of them with the same vector instructions.
+#define GAUSSIAN_H_ROWS 4
+#define GAUSSIAN_V_STRIP 16
+
+static void iir_load(float *dest, uint32_t *src, int npix) {
+	for (int i = 0; i < npix; ++i) {
+		dest[i * 4 + 0] = (src[i] & 0x0000ff);
+		dest[i * 4 + 1] = (src[i] & 0x00ff00) >> 8;
+		dest[i * 4 + 2] = (src[i] & 0xff0000) >> 16;
+		dest[i * 4 + 3] = 0;
+	}
+}
+
+static void iir_store(uint32_t *dest, float *src, int npix) {
+	for (int i = 0; i < npix; ++i) {
+		int b = src[i * 4 + 0] + 0.5f;
+		int g = src[i * 4 + 1] + 0.5f;
+		int r = src[i * 4 + 2] + 0.5f;
+		b = b < 0 ? 0 : b > 255 ? 255 : b;
+		g = g < 0 ? 0 : g > 255 ? 255 : g;
+		r = r < 0 ? 0 : r > 255 ? 255 : r;
+		dest[i] = r << 16 | g << 8 | b;
+	}
+}
+
+struct gaussian_pass {
+	uint32_t *data;
+	int width, height;
+	struct iir_coeffs *k;
+	float *bufs;
+	size_t bufsize;
+};
+
+static void gaussian_h_chunk(void *data, int start, int end, int thread) {
+	struct gaussian_pass *pass = data;
+	int width = pass->width, height = pass->height;
+	float *buf = pass->bufs + thread * pass->bufsize;
+	for (int i = start; i < end; ++i) {
+		int y = i * GAUSSIAN_H_ROWS;
+		int nrows = MIN(GAUSSIAN_H_ROWS, height - y);
+		for (int x = 0; x < width; ++x) {
+			for (int r = 0; r < nrows; ++r) {
+				iir_load(buf + ((size_t)x * GAUSSIAN_H_ROWS + r) * 4,
+						pass->data + (size_t)(y + r) * width + x, 1);
+			}
+		}
+
+		iir_lanes(buf, width, GAUSSIAN_H_ROWS * 4, pass->k);
+
+		for (int x = 0; x < width; ++x) {
+			for (int r = 0; r < nrows; ++r) {
+				iir_store(pass->data + (size_t)(y + r) * width + x,
+						buf + ((size_t)x * GAUSSIAN_H_ROWS + r) * 4, 1);
+			}
+		}
+	}
+}
+
+static void gaussian_v_chunk(void *data, int start, int end, int thread) {
+	struct gaussian_pass *pass = data;
+	int width = pass->width, height = pass->height;
+	const int vlanes = GAUSSIAN_V_STRIP * 4;
+	float *buf = pass->bufs + thread * pass->bufsize;
+	for (int i = start; i < end; ++i) {
+		int x = i * GAUSSIAN_V_STRIP;
+		int ncols = MIN(GAUSSIAN_V_STRIP, width - x);
+		for (int y = 0; y < height; ++y) {
+			iir_load(buf + (size_t)y * vlanes, pass->data + (size_t)y * width + x, ncols);
+		}
+
+		iir_lanes(buf, height, vlanes, pass->k);
+
+		for (int y = 0; y < height; ++y) {
+			iir_store(pass->data + (size_t)y * width + x, buf + (size_t)y * vlanes, ncols);
+		}
+	}
+}
+
+// A true Gaussian blur, using a recursive (IIR) filter whose cost doesn't
+// depend on sigma. Works in place.
+static void effect_blur_gaussian(uint32_t *data, int width, int height, int scale,
+		double sigma) {
+	sigma *= scale;
+	if (sigma < 0.5) {
+		return;
+	}
+
+	double q = sigma >= 2.5
+		? 0.98711 * sigma - 0.96330
+		: 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+	double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+	double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+	double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+	double b3 = 0.422205 * q * q * q;
+	struct iir_coeffs k = {
+		.b = 1 - (b1 + b2 + b3) / b0,
+		.c1 = b1 / b0, .c2 = b2 / b0, .c3 = b3 / b0,
+	};
+
+	const int hlanes = GAUSSIAN_H_ROWS * 4;
+	const int vlanes = GAUSSIAN_V_STRIP * 4;
+	size_t bufsize = (size_t)width * hlanes;
+	if (bufsize < (size_t)height * vlanes) {
+		bufsize = (size_t)height * vlanes;
+	}
+
+	float *bufs = calloc(workers_count() * bufsize, sizeof(*bufs));
+	if (bufs == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for gaussian blur effect");
+		return;
+	}
+
+	struct gaussian_pass pass = { data, width, height, &k, bufs, bufsize };
+	workers_parallel_for(0, (height + GAUSSIAN_H_ROWS - 1) / GAUSSIAN_H_ROWS, 0,
+			gaussian_h_chunk, &pass);
+	workers_parallel_for(0, (width + GAUSSIAN_V_STRIP - 1) / GAUSSIAN_V_STRIP, 0,
+			gaussian_v_chunk, &pass);
+
+	free(bufs);
+}
+
+// Pixelate works on chunks of blocks at least this many pixels wide. With
+// large factors that still gives every thread some work, and with small
+// factors it keeps each work item from being tiny.
+#define PIXELATE_CHUNK 256
+
+// Adds up the channels of a run of pixels. Red and blue are summed together
+// in one integer, at most 256 pixels at a time so they can't overflow into
+// each other.
+static void sum_pixels(uint32_t *pix, int n, uint64_t sums[3]) {
+	for (int i = 0; i < n; i += 256) {
+		int lim = MIN(i + 256, n);
+		uint32_t rb = 0, g = 0;
+		for (int j = i; j < lim; ++j) {
+			rb += pix[j] & 0xff00ff;
+			g += pix[j] & 0x00ff00;
+		}
+		sums[0] += rb >> 16;
+		sums[1] += g >> 8;
+		sums[2] += rb & 0xffff;
+	}
+}
+
+struct pixelate_pass {
+	uint32_t *data;
+	int width, height;
+	int factor;
+	int blocks, chunkblocks, chunks;
+};
+
+static void pixelate_band_chunk(struct pixelate_pass *pass, int band, int chunk) {
+	uint32_t *pixels = pass->data;
+	int width = pass->width, height = pass->height, factor = pass->factor;
+	int blocks = pass->blocks, chunkblocks = pass->chunkblocks;
+	int ystart = band * factor;
+	int ylim = MIN(ystart + factor, height);
+	int bstart = chunk * chunkblocks;
+	int blim = MIN(bstart + chunkblocks, blocks);
+	int xstart = bstart * factor;
+	int xlim = MIN(blim * factor, width);
+
+	// Sum up each block, streaming through the band row by row.
+	// With more than one block in the chunk, the band is less than
+	// 256 rows tall, so the column sums can be kept with red and blue
+	// packed together like in sum_pixels.
+	uint64_t sums[PIXELATE_CHUNK / 2][3];
+	memset(sums, 0, (blim - bstart) * sizeof(*sums));
+	if (chunkblocks > 1) {
+		uint32_t colrb[PIXELATE_CHUNK], colg[PIXELATE_CHUNK];
+		memset(colrb, 0, (xlim - xstart) * sizeof(*colrb));
+		memset(colg, 0, (xlim - xstart) * sizeof(*colg));
+		for (int y = ystart; y < ylim; ++y) {
+			uint32_t *row = pixels + (size_t)y * width + xstart;
+			for (int i = 0; i < xlim - xstart; ++i) {
+				colrb[i] += row[i] & 0xff00ff;
+				colg[i] += row[i] & 0x00ff00;
+			}
+		}
+		for (int b = bstart; b < blim; ++b) {
+			int bxlim = MIN((b + 1) * factor, width);
+			uint64_t *sum = sums[b - bstart];
+			for (int i = b * factor - xstart; i < bxlim - xstart; ++i) {
+				sum[0] += colrb[i] >> 16;
+				sum[1] += colg[i] >> 8;
+				sum[2] += colrb[i] & 0xffff;
+			}
+		}
+	} else {
+		for (int y = ystart; y < ylim; ++y) {
+			sum_pixels(pixels + (size_t)y * width + xstart, xlim - xstart, sums[0]);
+		}
+	}
+
+	// Average, dividing by the number of pixels actually in the block,
+	// which is less than factor * factor at the right and bottom edges.
+	// With more than one block in the chunk, build one row of the
+	// result, which is then copied into every row of the band.
+	uint32_t pattern[PIXELATE_CHUNK];
+	uint32_t pix = 0;
+	for (int b = bstart; b < blim; ++b) {
+		int bxlim = MIN((b + 1) * factor, width);
+		uint64_t count = (uint64_t)(bxlim - b * factor) * (ylim - ystart);
+		uint64_t *sum = sums[b - bstart];
+		if (count <= UINT32_MAX / 255) {
+			// Sums fit in 32 bits, so avoid the slower 64-bit divide
+			uint32_t c = count;
+			pix = (uint32_t)sum[0] / c << 16 |
+				(uint32_t)sum[1] / c << 8 | (uint32_t)sum[2] / c;
+		} else {
+			pix = sum[0] / count << 16 | sum[1] / count << 8 | sum[2] / count;
+		}
+		for (int x = b * factor; chunkblocks > 1 && x < bxlim; ++x) {
+			pattern[x - xstart] = pix;
+		}
+	}
+
+	// Fill pixels
+	for (int y = ystart; y < ylim; ++y) {
+		uint32_t *row = pixels + (size_t)y * width;
+		if (chunkblocks > 1) {
+			memcpy(row + xstart, pattern, (xlim - xstart) * sizeof(*row));
+		} else {
+			fill_pixels(row + xstart, pix, xlim - xstart);
+		}
+	}
+}
+
+static void pixelate_chunk(void *data, int start, int end, int thread) {
+	struct pixelate_pass *pass = data;
+	for (int i = start; i < end; ++i) {
+		pixelate_band_chunk(pass, i / pass->chunks, i % pass->chunks);
+	}
+}
+
+static void effect_pixelate(uint32_t *data, int width, int height, int scale, int factor) {
+	factor *= scale;
+	if (factor <= 1) {
+		return;
+	}
+
+	int bands = (height + factor - 1) / factor;
+	int blocks = (width + factor - 1) / factor;
+	int chunkblocks = factor < PIXELATE_CHUNK ? PIXELATE_CHUNK / factor : 1;
+	int chunks = (blocks + chunkblocks - 1) / chunkblocks;
+
+	struct pixelate_pass pass = {
+		data, width, height, factor, blocks, chunkblocks, chunks,
+	};
+	workers_parallel_for(0, bands * chunks, 1, pixelate_chunk, &pass);
+}
+
+struct scale_nearest_pass {
+	struct resize_pass resize;
+	double fact;
+};
+
+static void scale_nearest_chunk(void *data, int start, int end, int thread) {
+	struct scale_nearest_pass *scale = data;
+	struct resize_pass *pass = &scale->resize;
+	double fact = scale->fact;
+	for (int dy = start; dy < end; ++dy) {
+		int sy = dy * fact;
+		if (sy >= pass->sheight) continue;
+		for (int dx = 0; dx < pass->dwidth; ++dx) {
+			int sx = dx * fact;
+			if (sx >= pass->swidth) continue;
+			pass->dest[dy * pass->dwidth + dx] = pass->src[sy * pass->swidth + sx];
+		}
+	}
+}
+
+static void effect_scale(uint32_t *dest, uint32_t *src, int swidth, int sheight,
+		double scale) {
+	struct scale_nearest_pass pass = {
+		.resize = {
+			.dest = dest, .src = src,
+			.dwidth = swidth * scale, .dheight = sheight * scale,
+			.swidth = swidth, .sheight = sheight,
+		},
+		.fact = 1.0 / scale,
+	};
+	workers_parallel_for(0, pass.resize.dheight, 0, scale_nearest_chunk, &pass);
+}
+
+// Resampling table for one axis: output pixel i is made from the 'taps'
+// source pixels starting at start[i], with 15-bit fixed-point weights that
+// add up to 1 << 15. Downscaling averages the area each output pixel covers,
+// upscaling interpolates linearly between the two nearest source pixels.
+struct resample_axis {
+	int taps;
+	int *start;
+	uint16_t *weights;
+};
+
+static void resample_axis_finish(struct resample_axis *axis) {
+	free(axis->start);
+	free(axis->weights);
+}
+
+static bool resample_axis_init(struct resample_axis *axis, int ssize, int dsize) {
+	double fact = (double)ssize / dsize;
+	axis->taps = fact > 1 ? (int)ceil(fact) + 1 : 2;
+	if (axis->taps > ssize) {
+		axis->taps = ssize;
+	}
+
+	axis->start = malloc(dsize * sizeof(*axis->start));
+	axis->weights = calloc((size_t)dsize * axis->taps, sizeof(*axis->weights));
+	if (axis->start == NULL || axis->weights == NULL) {
+		resample_axis_finish(axis);
+		return false;
+	}
+
+	for (int i = 0; i < dsize; ++i) {
+		// The source range [lo, hi) and how to weight each pixel in it
+		double lo, hi, t = 0;
+		if (fact > 1) {
+			lo = i * fact;
+			hi = fmin((i + 1) * fact, ssize);
+		} else {
+			double center = fmax((i + 0.5) * fact - 0.5, 0);
+			lo = floor(center);
+			t = center - lo;
+			hi = t > 0 && lo + 1 < ssize ? lo + 2 : lo + 1;
+		}
+
+		int first = lo, last = ceil(hi);
+		int start = MIN(first, ssize - axis->taps);
+		uint16_t *weights = axis->weights + (size_t)i * axis->taps;
+		int sum = 0, biggest = first - start;
+		for (int j = first; j < last; ++j) {
+			double weight;
+			if (fact > 1) {
+				weight = (fmin(j + 1, hi) - fmax(j, lo)) / (hi - lo);
+			} else {
+				weight = j == first ? 1 - t : t;
+			}
+			int w = lround(weight * (1 << 15));
+			weights[j - start] = w;
+			sum += w;
+			if (w > weights[biggest]) {
+				biggest = j - start;
+			}
+		}
+
+		// Make up for rounding so that flat areas keep their exact colour
+		weights[biggest] += (1 << 15) - sum;
+		axis->start[i] = start;
+	}
+
+	return true;
+}
+
+struct scale_smooth_pass {
+	uint32_t *dest, *src;
+	int swidth, dwidth;
+	struct resample_axis *h, *v;
+	uint16_t *lines;
+	size_t linesize;
+};
+
+static void scale_smooth_chunk(void *data, int start, int end, int thread) {
+	struct scale_smooth_pass *pass = data;
+	struct resample_axis *h = pass->h, *v = pass->v;
+	uint16_t *line = pass->lines + thread * pass->linesize;
+	for (int dy = start; dy < end; ++dy) {
+		resample_v_row(line, (uint8_t *)(pass->src + (size_t)v->start[dy] * pass->swidth),
+				pass->linesize, v->weights + (size_t)dy * v->taps, v->taps, pass->linesize);
+		resample_h_row(pass->dest + (size_t)dy * pass->dwidth, line,
+				h->start, h->weights, h->taps, pass->dwidth);
+	}
+}
+
+// Scales with a box filter when downscaling and bilinear filtering when
+// upscaling. Rows are first combined vertically into a per-thread line of
+// 16-bit channels, which is then filtered horizontally.
+static void effect_scale_smooth(uint32_t *dest, uint32_t *src, int swidth, int sheight,
+		int dwidth, int dheight) {
+	if (dwidth <= 0 || dheight <= 0) {
+		return;
+	}
+
+	struct resample_axis h, v;
+	if (!resample_axis_init(&h, swidth, dwidth)) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for scale effect");
+		return;
+	}
+	if (!resample_axis_init(&v, sheight, dheight)) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for scale effect");
+		resample_axis_finish(&h);
+		return;
+	}
+
+	size_t linesize = 4 * (size_t)swidth;
+	uint16_t *lines = malloc(workers_count() * linesize * sizeof(*lines));
+	if (lines == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for scale effect");
+		resample_axis_finish(&h);
+		resample_axis_finish(&v);
+		return;
+	}
+
+	struct scale_smooth_pass pass = {
+		dest, src, swidth, dwidth, &h, &v, lines, linesize,
+	};
+	workers_parallel_for(0, dheight, 0, scale_smooth_chunk, &pass);
+
+	free(lines);
+	resample_axis_finish(&h);
+	resample_axis_finish(&v);
+}
+
+struct row_pass {
+	uint32_t *data;
+	int width, height;
+	void *arg;
+};
+
+static void greyscale_chunk(void *data, int start, int end, int thread) {
+	struct row_pass *pass = data;
+	for (int y = start; y < end; ++y) {
+		greyscale_row(pass->data + (size_t)y * pass->width, pass->width);
+	}
+}
+
+static void effect_greyscale(uint32_t *data, int width, int height) {
+	struct row_pass pass = { data, width, height, NULL };
+	workers_parallel_for(0, height, 0, greyscale_chunk, &pass);
+}
+
+// The vignette factor, base + factor * 16 * xf * yf * (1 - xf) * (1 - yf),
+// is split into 4 * xf * (1 - xf) per column and factor * 4 * yf * (1 - yf)
+// per row, both in 16-bit fixed point. Truncating each part keeps the
+// total at or below 65535.
+struct vignette {
+	uint16_t *colf;
+	uint32_t base;
+	double factor;
+};
+
+static bool vignette_init(struct vignette *vignette, int width,
+		double base, double factor) {
+	base = fmin(1, fmax(0, base));
+	factor = fmin(1 - base, fmax(0, factor));
+
+	vignette->colf = malloc(width * sizeof(*vignette->colf));
+	if (vignette->colf == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for vignette effect");
+		return false;
+	}
+	for (int x = 0; x < width; ++x) {
+		double xf = (x * 1.0) / width;
+		vignette->colf[x] = 65535 * 4 * xf * (1.0 - xf);
+	}
+	vignette->base = 65535 * base;
+	vignette->factor = factor;
+	return true;
+}
+
+static void vignette_apply_row(struct vignette *vignette, uint32_t *row,
+		int y, int width, int height) {
+	double yf = (y * 1.0) / height;
+	uint32_t rowmul = 65535 * vignette->factor * 4 * yf * (1.0 - yf);
+	vignette_row(row, vignette->colf, vignette->base, rowmul, width);
+}
+
+static void vignette_chunk(void *data, int start, int end, int thread) {
+	struct row_pass *pass = data;
+	for (int y = start; y < end; ++y) {
+		vignette_apply_row(pass->arg, pass->data + (size_t)y * pass->width,
+				y, pass->width, pass->height);
+	}
+}
+
+static void effect_vignette(uint32_t *data, int width, int height,
+		double base, double factor) {
+	struct vignette vignette;
+	if (!vignette_init(&vignette, width, base, factor)) {
+		return;
+	}
+
+	struct row_pass pass = { data, width, height, &vignette };
+	workers_parallel_for(0, height, 0, vignette_chunk, &pass);
+	free(vignette.colf);
+}
+
+#if HAVE_GDK_PIXBUF
+struct compose_pass {
+	uint32_t *data;
+	int width;
+	uint32_t *bufdata;
+	int bufstride;
+	bool bufalpha;
+	int imgx, imgy;
+	int x0, x1;
+};
+
+static void compose_chunk(void *data, int start, int end, int thread) {
+	struct compose_pass *pass = data;
+	int x0 = pass->x0, x1 = pass->x1;
+	for (int offy = start; offy < end; ++offy) {
+		uint32_t *dest = pass->data + (size_t)(offy + pass->imgy) * pass->width +
+			(x0 + pass->imgx);
+		uint32_t *src = pass->bufdata + (size_t)offy * pass->bufstride + x0;
+		if (!pass->bufalpha) {
+			memcpy(dest, src, (x1 - x0) * sizeof(*dest));
+		} else {
+			compose_row(dest, src, x1 - x0);
+		}
+	}
+}
+#endif
+
+static void effect_compose(uint32_t *data, int width, int height, int scale,
+		struct swaylock_effect_screen_pos posx,
+		struct swaylock_effect_screen_pos posy,
+		struct swaylock_effect_screen_pos posw,
+		struct swaylock_effect_screen_pos posh,
+		int gravity, char *imgpath) {
+#if !HAVE_GDK_PIXBUF
+	(void)&compose_row;
+	(void)&screen_size_to_pix;
+	(void)&screen_pos_pair_to_pix;
+	swaylock_log(LOG_ERROR, "Compose effect: Compiled without gdk_pixbuf support.\n");
+	return;
+#else
+	int imgw = screen_size_to_pix(posw, width, scale);
+	int imgh = screen_size_to_pix(posh, height, scale);
+	bool preserve_aspect = imgw < 0 || imgh < 0;
+
+	GError *err = NULL;
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(
+			imgpath, imgw, imgh, preserve_aspect, &err);
+	if (!pixbuf) {
+		swaylock_log(LOG_ERROR, "Compose effect: Failed to load image file '%s' (%s).",
+				imgpath, err->message);
+		g_error_free(err);
+		return;
+	}
+
+	cairo_surface_t *image = gdk_cairo_image_surface_create_from_pixbuf(pixbuf);
+	g_object_unref(pixbuf);
+
+	int bufw = cairo_image_surface_get_width(image);
+	int bufh = cairo_image_surface_get_height(image);
+	uint32_t *bufdata = (uint32_t *)cairo_image_surface_get_data(image);
+	int bufstride = cairo_image_surface_get_stride(image) / 4;
+	bool bufalpha = cairo_image_surface_get_format(image) == CAIRO_FORMAT_ARGB32;
+
+	int imgx, imgy;
+	screen_pos_pair_to_pix(
+			posx, posy, bufw, bufh,
+			width, height, scale, gravity,
+			&imgx, &imgy);
+
+	// Clip the image to the destination once, so each row is one span
+	int x0 = imgx < 0 ? -imgx : 0;
+	int y0 = imgy < 0 ? -imgy : 0;
+	int x1 = MIN(bufw, width - imgx);
+	int y1 = MIN(bufh, height - imgy);
+	if (x1 <= x0) {
+		y1 = y0;
+	}
+
+	struct compose_pass pass = {
+		data, width, bufdata, bufstride, bufalpha, imgx, imgy, x0, x1,
+	};
+	workers_parallel_for(y0, y1, 0, compose_chunk, &pass);
+
+	cairo_surface_destroy(image);
+#endif
+}
+
+typedef uint32_t (*custom_pixel_func)(uint32_t pix, int x, int y, int width, int height);
+
+typedef void (*custom_effect_func)(uint32_t *data, int width, int height, int scale);
+
+// Version 2 of the custom effect ABI: the effect exports 'swaylock_rows',
+// which does rows [y0, y1) of the image, with 'rows' pointing at row y0 and
+// 'stride' in pixels, and optionally 'swaylock_rows_info' to describe it.
+// Pointwise effects only look at the pixel they produce and its position,
+// so they can be run on any rows from any thread, and fused with other
+// effects. Others are given the whole image at once.
+typedef void (*custom_rows_func)(uint32_t *rows, int stride, int y0, int y1,
+		int width, int height, int scale);
+
+#define CUSTOM_ABI_VERSION 2
+#define CUSTOM_ROWS_POINTWISE (1 << 0)
+
+struct custom_rows_info {
+	uint32_t version;
+	uint32_t flags;
+};
+
+// A custom effect, loaded once and kept for the life of the process, since
+// it runs again for every output on every lock. Failed loads are kept too,
+// with no functions, so they aren't retried.
+struct custom_effect {
+	char *arg; // path as given in the arguments
+	char *path; // resolved path
+	custom_rows_func rows_func;
+	bool rows_pointwise;
+	custom_effect_func effect_func;
+	custom_pixel_func pixel_func;
+	struct custom_effect *next;
+};
+
+static void custom_pixel_row(custom_pixel_func pixel_func, uint32_t *row,
+		int y, int width, int height) {
+	for (int x = 0; x < width; ++x) {
+		row[x] = pixel_func(row[x], x, y, width, height);
+	}
+}
+
+static void custom_pixel_chunk(void *data, int start, int end, int thread) {
+	struct row_pass *pass = data;
+	custom_pixel_func pixel_func = *(custom_pixel_func *)pass->arg;
+	for (int y = start; y < end; ++y) {
+		custom_pixel_row(pixel_func, pass->data + (size_t)y * pass->width,
+				y, pass->width, pass->height);
+	}
+}
+
+struct custom_rows_pass {
+	custom_rows_func rows_func;
+	uint32_t *data;
+	int width, height, scale;
+};
+
+static void custom_rows_chunk(void *data, int start, int end, int thread) {
+	struct custom_rows_pass *pass = data;
+	pass->rows_func(pass->data + (size_t)start * pass->width, pass->width,
+			start, end, pass->width, pass->height, pass->scale);
+}
+
+static void effect_custom_run(uint32_t *data, int width, int height, int scale,
+		const struct custom_effect *effect) {
+	if (effect->rows_func != NULL && effect->rows_pointwise) {
+		struct custom_rows_pass pass = {
+			effect->rows_func, data, width, height, scale,
+		};
+		workers_parallel_for(0, height, 0, custom_rows_chunk, &pass);
+		return;
+	} else if (effect->rows_func != NULL) {
+		effect->rows_func(data, width, 0, height, width, height, scale);
+		return;
+	}
+
+	if (effect->effect_func != NULL) {
+		effect->effect_func(data, width, height, scale);
+		return;
+	}
+
+	custom_pixel_func pixel_func = effect->pixel_func;
+	struct row_pass pass = { data, width, height, &pixel_func };
+	workers_parallel_for(0, height, 0, custom_pixel_chunk, &pass);
+}
+
+// Outputs run their effects in parallel, and mustn't load the same effect,
+// or compile it into the same file, at the same time.
+static pthread_mutex_t custom_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct custom_effect *custom_effects;
+
+// Compiled custom effects are cached under a hash of everything that goes
+// into them: the source file's path and contents, the compiler and its
+// flags, and the CPU, since they're built with -march=native. Each .so has
+// a .deps file next to it with the hashes of the headers it was built
+// from, so it's only used while those are the same too.
+static const char *custom_cflags[] = {
+	"-shared", "-g", "-O2", "-march=native", "-fopenmp",
+};
+
+#define HASH_INIT 0xcbf29ce484222325
+
+// 64-bit FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+static uint64_t hash_string(uint64_t hash, const char *str) {
+	return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+static bool hash_file(uint64_t *hash, const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return false;
+	}
+	char buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		*hash = hash_bytes(*hash, buf, len);
+	}
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+static char *path_with_suffix(const char *path, const char *suffix) {
+	char *result = malloc(strlen(path) + strlen(suffix) + 1);
+	if (result != NULL) {
+		sprintf(result, "%s%s", path, suffix);
+	}
+	return result;
+}
+
+// Finds 'cc' in $PATH. Must be called with custom_lock held.
+static const char *custom_compiler(void) {
+	static char *compiler = NULL;
+	if (compiler != NULL) {
+		return compiler;
+	}
+
+	const char *path = getenv("PATH");
+	if (path == NULL) {
+		path = "/usr/local/bin:/usr/bin:/bin";
+	}
+	while (*path != '\0' && compiler == NULL) {
+		size_t len = strcspn(path, ":");
+		char *candidate = malloc(len + strlen("/cc") + 1);
+		if (candidate == NULL) {
+			break;
+		}
+		sprintf(candidate, "%.*s/cc", (int)len, path);
+		if (len > 0 && access(candidate, X_OK) == 0) {
+			compiler = candidate;
+		} else {
+			free(candidate);
+		}
+		path += path[len] == ':' ? len + 1 : len;
+	}
+
+	if (compiler == NULL) {
+		swaylock_log(LOG_ERROR, "Can't compile custom effect; cc isn't in $PATH");
+	}
+	return compiler;
+}
+
+// Hashes the compiler, its flags and the CPU. Must be called with
+// custom_lock held.
+static bool custom_toolchain_hash(uint64_t *out) {
+	static uint64_t hash;
+	static bool hashed = false;
+	if (hashed) {
+		*out = hash;
+		return true;
+	}
+
+	const char *compiler = custom_compiler();
+	char *realcompiler = compiler ? realpath(compiler, NULL) : NULL;
+	struct stat st;
+	if (realcompiler == NULL || stat(realcompiler, &st) < 0) {
+		free(realcompiler);
+		return false;
+	}
+	hash = hash_string(HASH_INIT, realcompiler);
+	hash = hash_bytes(hash, &st.st_size, sizeof(st.st_size));
+	hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+	free(realcompiler);
+
+	for (size_t i = 0; i < sizeof(custom_cflags) / sizeof(*custom_cflags); ++i) {
+		hash = hash_string(hash, custom_cflags[i]);
+	}
+
+	// The lines of the first CPU which say what -march=native picks, on
+	// x86 and arm respectively
+	static const char *cpu_keys[] = {
+		"vendor_id", "cpu family", "model", "stepping", "flags",
+		"CPU implementer", "CPU architecture", "CPU variant", "CPU part", "Features",
+	};
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	char *line = NULL;
+	size_t linesize = 0;
+	while (f != NULL && getline(&line, &linesize, f) > 1) {
+		for (size_t i = 0; i < sizeof(cpu_keys) / sizeof(*cpu_keys); ++i) {
+			if (strncmp(line, cpu_keys[i], strlen(cpu_keys[i])) == 0) {
+				hash = hash_string(hash, line);
+				break;
+			}
+		}
+	}
+	free(line);
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	hashed = true;
+	*out = hash;
+	return true;
+}
+
+// Returns where the compiled copy of a source file is cached, without the
+// extension. Must be called with custom_lock held.
+static char *effect_custom_cache_path(const char *abspath) {
+	static char *cachepath = NULL;
+	static size_t cachelen;
+	if (!cachepath) {
+		char *xdgdir = getenv("XDG_DATA_HOME");
+		if (xdgdir) {
+			cachepath = malloc(strlen(xdgdir) + strlen("/swaylock") + 1);
+			cachelen = sprintf(cachepath, "%s/swaylock", xdgdir);
+		} else {
+			char *homedir = getenv("HOME");
+			if (homedir == NULL) {
+				swaylock_log(LOG_ERROR,
+						"Can't compile custom effect; neither $HOME nor $XDG_CONFIG_HOME "
+						"is defined.");
+				return NULL;
+			}
+
+			cachepath = malloc(strlen(homedir) + strlen("/.cache/swaylock") + 1);
+			cachelen = sprintf(cachepath, "%s/.cache/swaylock", homedir);
+		}
+
+		if (mkdir(cachepath, 0777) < 0 && errno != EEXIST) {
+			swaylock_log(LOG_ERROR,
+					"Can't compile custom effect; mkdir %s failed: %s\n",
+					cachepath, strerror(errno));
+			free(cachepath);
+			cachepath = NULL;
+			return NULL;
+		}
+	}
+
+	uint64_t hash;
+	if (!custom_toolchain_hash(&hash)) {
+		return NULL;
+	}
+	hash = hash_string(hash, abspath);
+	if (!hash_file(&hash, abspath)) {
+		swaylock_log_errno(LOG_ERROR, "Can't compile custom effect %s", abspath);
+		return NULL;
+	}
+
+	// Different paths can sanitize to the same name, so the name has a hash
+	// of the path itself as well, which the cache can be pruned by
+	size_t abspathlen = strlen(abspath);
+	char *outpath = malloc(cachelen + 1 + abspathlen + 2 * (1 + 16) + 1);
+	sprintf(outpath, "%s/%s-%016" PRIx64 "-%016" PRIx64, cachepath, abspath,
+			hash_string(HASH_INIT, abspath), hash);
+
+	// Sanitize
+	for (char *ch = outpath + cachelen + 1; ch < outpath + cachelen + 1 + abspathlen; ++ch) {
+		if (!(
+				(*ch >= 'a' && *ch <= 'z') ||
+				(*ch >= 'A' && *ch <= 'Z') ||
+				(*ch >= '0' && *ch <= '9') ||
+				(*ch == '.'))) {
+			*ch = '_';
+		}
+	}
+
+	return outpath;
+}
+
+// Whether the .so at 'base' exists and the headers listed in its .deps
+// file haven't changed.
+static bool custom_cache_valid(const char *base) {
+	char *sopath = path_with_suffix(base, ".so");
+	char *depspath = path_with_suffix(base, ".deps");
+	FILE *f = NULL;
+	bool valid = sopath != NULL && depspath != NULL &&
+		access(sopath, R_OK) == 0 && (f = fopen(depspath, "r")) != NULL;
+
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+	while (valid && (len = getline(&line, &linesize, f)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		uint64_t expected, hash = HASH_INIT;
+		int pathstart = 0;
+		valid = sscanf(line, "%" SCNx64 " %n", &expected, &pathstart) == 1 &&
+			pathstart > 0 && hash_file(&hash, line + pathstart) && hash == expected;
+	}
+
+	free(line);
+	if (f != NULL) {
+		fclose(f);
+	}
+	free(sopath);
+	free(depspath);
+	return valid;
+}
+
+// Writes the files in a make rule from -MD, with their hashes, to 'out'
+static bool write_deps(FILE *out, const char *rulepath) {
+	FILE *f = fopen(rulepath, "r");
+	if (f == NULL) {
+		return false;
+	}
+	char *rule = NULL;
+	size_t rulesize = 0;
+	ssize_t rulelen = getdelim(&rule, &rulesize, '\0', f);
+	fclose(f);
+	char *ch = rulelen > 0 ? strchr(rule, ':') : NULL;
+	if (ch == NULL) {
+		free(rule);
+		return false;
+	}
+
+	// Paths are separated by whitespace and escaped line breaks. Spaces
+	// and '#' in them are escaped with '\', and '$' is doubled.
+	char *path = malloc(rulelen + 1);
+	size_t pathlen = 0;
+	bool ok = path != NULL;
+	for (++ch; ok; ++ch) {
+		if ((ch[0] == '\\' && (ch[1] == ' ' || ch[1] == '#')) ||
+				(ch[0] == '$' && ch[1] == '$')) {
+			path[pathlen++] = *++ch;
+			continue;
+		} else if (ch[0] == '\\' && ch[1] == '\n') {
+			++ch;
+		} else if (*ch != '\0' && *ch != ' ' && *ch != '\t' && *ch != '\n') {
+			path[pathlen++] = *ch;
+			continue;
+		}
+
+		if (pathlen > 0) {
+			path[pathlen] = '\0';
+			pathlen = 0;
+			uint64_t hash = HASH_INIT;
+			ok = hash_file(&hash, path) &&
+				fprintf(out, "%016" PRIx64 " %s\n", hash, path) > 0;
+		}
+		if (*ch == '\0') {
+			break;
+		}
+	}
+
+	free(path);
+	free(rule);
+	return ok;
+}
+
+// A custom effect being compiled in the background. The compiler holds
+// the write end of a pipe open until it exits, so its process doesn't have
+// to be a child of the one waiting for it, which it isn't after --daemonize.
+// It writes to temporary files, which are renamed into the cache once
+// they're complete, so other swaylock processes never see half of them.
+struct custom_compile {
+	char *base;
+	char *tmp_so, *tmp_rule, *tmp_deps;
+	pid_t pid;
+	int done_fd;
+	FILE *log; // What the compiler printed
+	struct custom_compile *next;
+};
+
+static struct custom_compile *custom_compiles; // protected by custom_lock
+
+// Must be called with custom_lock held
+static struct custom_compile *custom_compile_find(const char *base) {
+	struct custom_compile *compile = custom_compiles;
+	while (compile != NULL && strcmp(compile->base, base) != 0) {
+		compile = compile->next;
+	}
+	return compile;
+}
+
+static void custom_compile_free(struct custom_compile *compile) {
+	if (compile->done_fd >= 0) {
+		close(compile->done_fd);
+	}
+	if (compile->log != NULL) {
+		fclose(compile->log);
+	}
+	free(compile->base);
+	free(compile->tmp_so);
+	free(compile->tmp_rule);
+	free(compile->tmp_deps);
+	free(compile);
+}
+
+// Starts compiling 'abspath' into the cache at 'base'. Must be called with
+// custom_lock held.
+static struct custom_compile *custom_compile_start(const char *abspath,
+		const char *base) {
+	const char *compiler = custom_compiler();
+	struct custom_compile *compile = calloc(1, sizeof(*compile));
+	if (compiler == NULL || compile == NULL) {
+		free(compile);
+		return NULL;
+	}
+	compile->done_fd = -1;
+
+	// Several processes could be compiling the same effect
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+	compile->base = strdup(base);
+	compile->tmp_so = path_with_suffix(base, suffix);
+	if (compile->tmp_so != NULL) {
+		compile->tmp_rule = path_with_suffix(compile->tmp_so, ".d");
+		compile->tmp_deps = path_with_suffix(compile->tmp_so, ".deps");
+	}
+	compile->log = tmpfile();
+	int fds[2];
+	if (compile->base == NULL || compile->tmp_so == NULL ||
+			compile->tmp_rule == NULL || compile->tmp_deps == NULL ||
+			compile->log == NULL || pipe(fds) < 0) {
+		swaylock_log_errno(LOG_ERROR, "Can't compile custom effect");
+		custom_compile_free(compile);
+		return NULL;
+	}
+	compile->done_fd = fds[0];
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	const char *argv[32];
+	int argc = 0;
+	argv[argc++] = "cc";
+	for (size_t i = 0; i < sizeof(custom_cflags) / sizeof(*custom_cflags); ++i) {
+		argv[argc++] = custom_cflags[i];
+	}
+	argv[argc++] = "-MD";
+	argv[argc++] = "-MF";
+	argv[argc++] = compile->tmp_rule;
+	argv[argc++] = "-o";
+	argv[argc++] = compile->tmp_so;
+	argv[argc++] = abspath;
+	argv[argc++] = "-lm";
+	argv[argc] = NULL;
+
+	fprintf(stderr, "Compiling custom effect:");
+	for (int i = 0; i < argc; ++i) {
+		fprintf(stderr, " %s", argv[i]);
+	}
+	fprintf(stderr, "\n");
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fileno(compile->log), STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fileno(compile->log), STDERR_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], 3);
+	int ret = posix_spawn(&compile->pid, compiler, &actions, NULL,
+			(char **)argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+	if (ret != 0) {
+		swaylock_log(LOG_ERROR, "Custom effect: posix_spawn(): %s", strerror(ret));
+		custom_compile_free(compile);
+		return NULL;
+	}
+
+	compile->next = custom_compiles;
+	custom_compiles = compile;
+	return compile;
+}
+
+// Removes the cached .so and .deps files for the same source as 'base'
+// other than 'base' itself, which were compiled from older versions of it,
+// with another compiler or for another CPU. Names are the sanitized path,
+// which has no '-', then '-' and the path's hash, and then '-' and the hash
+// of everything else, both 16 hex digits.
+static void custom_cache_prune(const char *base) {
+	const char *slash = strrchr(base, '/');
+	size_t baselen = strlen(base);
+	if (slash == NULL || baselen < (size_t)(slash - base) + 1 + 2 * 17) {
+		return;
+	}
+	const char *name = slash + 1;
+	size_t prefixlen = strlen(name) - 16;
+
+	char *dirpath = strndup(base, slash - base);
+	DIR *dir = dirpath != NULL ? opendir(dirpath) : NULL;
+	if (dir == NULL) {
+		free(dirpath);
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		const char *entname = ent->d_name;
+		if (strncmp(entname, name, prefixlen) != 0 ||
+				strncmp(entname + prefixlen, name + prefixlen, 16) == 0) {
+			continue;
+		}
+		size_t hexlen = strspn(entname + prefixlen, "0123456789abcdef");
+		const char *suffix = entname + prefixlen + hexlen;
+		if (hexlen != 16 || (strcmp(suffix, ".so") != 0 &&
+				strcmp(suffix, ".deps") != 0)) {
+			continue;
+		}
+		if (unlinkat(dirfd(dir), entname, 0) == 0) {
+			swaylock_log(LOG_DEBUG, "Removed stale custom effect %s/%s",
+					dirpath, entname);
+		}
+	}
+	closedir(dir);
+	free(dirpath);
+}
+
+// Moves a finished compile's files into the cache
+static bool custom_compile_store(struct custom_compile *compile) {
+	FILE *deps = fopen(compile->tmp_deps, "w");
+	if (deps == NULL) {
+		return false;
+	}
+	bool ok = write_deps(deps, compile->tmp_rule);
+	ok = fclose(deps) == 0 && ok;
+
+	char *sopath = path_with_suffix(compile->base, ".so");
+	char *depspath = path_with_suffix(compile->base, ".deps");
+	// The .deps file goes last, so nothing uses the .so before it's there
+	ok = ok && sopath != NULL && depspath != NULL &&
+		rename(compile->tmp_so, sopath) == 0 &&
+		rename(compile->tmp_deps, depspath) == 0;
+	if (ok) {
+		custom_cache_prune(compile->base);
+	} else {
+		swaylock_log_errno(LOG_ERROR, "Failed to store compiled custom effect");
+	}
+	free(sopath);
+	free(depspath);
+	return ok;
+}
+
+// Waits for a compile to finish, reports what the compiler printed, and
+// stores the result in the cache. Must be called with custom_lock held.
+static bool custom_compile_finish(struct custom_compile *compile) {
+	struct custom_compile **link = &custom_compiles;
+	while (*link != compile) {
+		link = &(*link)->next;
+	}
+	*link = compile->next;
+
+	char c;
+	while (read(compile->done_fd, &c, 1) < 0 && errno == EINTR) {
+		// Nothing is written, the pipe just closes
+	}
+	// Fails harmlessly if another process started the compiler
+	waitpid(compile->pid, NULL, 0);
+
+	// The compiler removes its output if it fails
+	bool compiled = access(compile->tmp_so, F_OK) == 0;
+	rewind(compile->log);
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+	while ((len = getline(&line, &linesize, compile->log)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		swaylock_log(compiled ? LOG_INFO : LOG_ERROR, "%s", line);
+	}
+	free(line);
+
+	bool ok = compiled && custom_compile_store(compile);
+	if (!compiled) {
+		swaylock_log(LOG_ERROR, "Custom effect compilation failed");
+	}
+	unlink(compile->tmp_so);
+	unlink(compile->tmp_rule);
+	unlink(compile->tmp_deps);
+	custom_compile_free(compile);
+	return ok;
+}
+
+// Returns the compiled copy of a source file, compiling it if it isn't
+// already being compiled or cached. Must be called with custom_lock held.
+static char *effect_custom_compile(const char *abspath) {
+	char *base = effect_custom_cache_path(abspath);
+	if (base == NULL) {
+		return NULL;
+	}
+
+	struct custom_compile *compile = custom_compile_find(base);
+	if (compile == NULL && !custom_cache_valid(base)) {
+		compile = custom_compile_start(abspath, base);
+		if (compile == NULL) {
+			free(base);
+			return NULL;
+		}
+	}
+
+	char *sopath = NULL;
+	if (compile == NULL || custom_compile_finish(compile)) {
+		sopath = path_with_suffix(base, ".so");
+	}
+	free(base);
+	return sopath;
+}
+
+static bool is_custom_source(struct swaylock_effect *effect) {
+	if (effect->tag != EFFECT_CUSTOM) {
+		return false;
+	}
+	size_t pathlen = strlen(effect->e.custom);
+	return pathlen > 2 && strcmp(effect->e.custom + pathlen - 2, ".c") == 0;
+}
+
+void swaylock_effects_compile(struct swaylock_effect *effects, int count) {
+	pthread_mutex_lock(&custom_lock);
+	for (int i = 0; i < count; ++i) {
+		if (!is_custom_source(&effects[i])) {
+			continue;
+		}
+
+		// Errors are left for when the effect is loaded
+		char *abspath = realpath(effects[i].e.custom, NULL);
+		char *base = abspath ? effect_custom_cache_path(abspath) : NULL;
+		if (base != NULL && custom_compile_find(base) == NULL &&
+				!custom_cache_valid(base)) {
+			custom_compile_start(abspath, base);
+		}
+		free(base);
+		free(abspath);
+	}
+	pthread_mutex_unlock(&custom_lock);
+}
+
+bool swaylock_effects_precompile(struct swaylock_effect *effects, int count) {
+	swaylock_effects_compile(effects, count);
+
+	bool ok = true;
+	pthread_mutex_lock(&custom_lock);
+	for (int i = 0; i < count; ++i) {
+		if (!is_custom_source(&effects[i])) {
+			continue;
+		}
+
+		char *abspath = realpath(effects[i].e.custom, NULL);
+		char *sopath = abspath ? effect_custom_compile(abspath) : NULL;
+		if (abspath == NULL) {
+			swaylock_log_errno(LOG_ERROR, "Custom effect: %s", effects[i].e.custom);
+		}
+		ok = ok && sopath != NULL;
+		free(sopath);
+		free(abspath);
+	}
+	pthread_mutex_unlock(&custom_lock);
+	return ok;
+}
+
+// Loads a custom effect, compiling it first if it's a C source file. Must
+// be called with custom_lock held.
+static void effect_custom_open(struct custom_effect *effect) {
+	const char *path = effect->path;
+	size_t pathlen = strlen(path);
+	char *sopath;
+	if (pathlen > 3 && strcmp(path + pathlen - 3, ".so") == 0) {
+		sopath = strdup(path);
+	} else if (pathlen > 2 && strcmp(path + pathlen - 2, ".c") == 0) {
+		sopath = effect_custom_compile(path);
+	} else {
+		swaylock_log(
+			LOG_ERROR, "%s: Unknown file type for custom effect (expected .c or .so)",
+			effect->arg);
+		return;
+	}
+
+	if (sopath == NULL) {
+		return;
+	}
+
+	void *dl = dlopen(sopath, RTLD_LAZY);
+	free(sopath);
+	if (dl == NULL) {
+		swaylock_log(LOG_ERROR, "Custom effect: %s", dlerror());
+		return;
+	}
+
+	effect->rows_func = (custom_rows_func)dlsym(dl, "swaylock_rows");
+	const struct custom_rows_info *info = dlsym(dl, "swaylock_rows_info");
+	if (effect->rows_func != NULL && info != NULL) {
+		if (info->version == CUSTOM_ABI_VERSION) {
+			effect->rows_pointwise = info->flags & CUSTOM_ROWS_POINTWISE;
+		} else {
+			// Effects may export the older functions as well
+			swaylock_log(LOG_ERROR, "%s: Unsupported custom effect version %u",
+					effect->arg, info->version);
+			effect->rows_func = NULL;
+		}
+	}
+
+	effect->effect_func = (custom_effect_func)dlsym(dl, "swaylock_effect");
+	effect->pixel_func = (custom_pixel_func)dlsym(dl, "swaylock_pixel");
+	if (effect->rows_func == NULL && effect->effect_func == NULL &&
+			effect->pixel_func == NULL) {
+		(void)dlsym(dl, "swaylock_effect"); // Change the result of dlerror()
+		swaylock_log(LOG_ERROR, "Custom effect: %s", dlerror());
+		dlclose(dl);
+	}
+	// The handle is never closed; the effect runs again on new outputs
+}
+
+// Finds the loaded custom effect for a path, loading it the first time.
+// Returns NULL if it can't be loaded.
+static const struct custom_effect *effect_custom_get(const char *arg) {
+	pthread_mutex_lock(&custom_lock);
+	struct custom_effect *effect = custom_effects;
+	while (effect != NULL && strcmp(effect->arg, arg) != 0) {
+		effect = effect->next;
+	}
+
+	if (effect == NULL) {
+		effect = calloc(1, sizeof(*effect));
+		if (effect == NULL || (effect->arg = strdup(arg)) == NULL) {
+			free(effect);
+			pthread_mutex_unlock(&custom_lock);
+			return NULL;
+		}
+
+		// Find the true, absolute path of the file, so one effect given by
+		// different paths is only loaded once
+		effect->path = realpath(arg, NULL);
+		struct custom_effect *same = NULL;
+		if (effect->path != NULL) {
+			same = custom_effects;
+			while (same != NULL &&
+					(same->path == NULL || strcmp(same->path, effect->path) != 0)) {
+				same = same->next;
+			}
+		}
+
+		if (effect->path == NULL) {
+			swaylock_log_errno(LOG_ERROR, "Custom effect: %s", arg);
+		} else if (same != NULL) {
+			effect->rows_func = same->rows_func;
+			effect->rows_pointwise = same->rows_pointwise;
+			effect->effect_func = same->effect_func;
+			effect->pixel_func = same->pixel_func;
+		} else {
+			effect_custom_open(effect);
+		}
+		effect->next = custom_effects;
+		custom_effects = effect;
+	}
+	pthread_mutex_unlock(&custom_lock);
+
+	if (effect->rows_func == NULL && effect->effect_func == NULL &&
+			effect->pixel_func == NULL) {
+		return NULL;
+	}
+	return effect;
+}
+
+static void effect_custom(uint32_t *data, int width, int height, int scale,
+		const char *path) {
+	const struct custom_effect *effect = effect_custom_get(path);
+	if (effect != NULL) {
+		effect_custom_run(data, width, height, scale, effect);
+	}
+}
+
+struct expr_pass {
+	struct expr *expr;
+	uint32_t *data;
+	int width, height;
+};
+
+static void expr_chunk(void *data, int start, int end, int thread) {
+	struct expr_pass *pass = data;
+	expr_run_rows(pass->expr, pass->data + (size_t)start * pass->width,
+			pass->width, start, end, pass->width, pass->height);
+}
+
+static void effect_expr(uint32_t *data, int width, int height,
+		struct expr *expr) {
+	struct expr_pass pass = { expr, data, width, height };
+	workers_parallel_for(0, height, 0, expr_chunk, &pass);
+}
+
+// Scales to the given size. Nearest-neighbour scaling uses the effect's
+// factor, so the size must be the one the factor gives.
+static cairo_surface_t *scale_surface(cairo_surface_t *surface,
+		int dwidth, int dheight, struct swaylock_effect *effect,
+		struct effect_pool *pool) {
+	cairo_surface_t *surf = effect_pool_surface(pool, dwidth, dheight);
+
+	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to create surface for scale effect");
+		cairo_surface_destroy(surf);
+		return surface;
+	}
+
+	if (effect->e.scale.filter == EFFECT_SCALE_FILTER_NEAREST) {
+		effect_scale(
+				(uint32_t *)cairo_image_surface_get_data(surf),
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				effect->e.scale.factor);
+	} else {
+		effect_scale_smooth(
+				(uint32_t *)cairo_image_surface_get_data(surf),
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				dwidth, dheight);
+	}
+	cairo_surface_flush(surf);
+	cairo_surface_destroy(surface);
+	return surf;
+}
+
+static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
+		struct swaylock_effect *effect, struct effect_pool *pool) {
+	switch (effect->tag) {
+	case EFFECT_BLUR: {
+		cairo_surface_t *surf = effect_pool_surface(pool,
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface));
+
+		if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+			swaylock_log(LOG_ERROR, "Failed to create surface for blur effect");
+			cairo_surface_destroy(surf);
+			break;
+		}
+
+		effect_blur(
+				(uint32_t *)cairo_image_surface_get_data(surf),
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				scale,
+				effect->e.blur.radius, effect->e.blur.times);
+		cairo_surface_flush(surf);
+		cairo_surface_destroy(surface);
+		surface = surf;
+		break;
+	}
+
+	case EFFECT_BLUR_FAST: {
+		cairo_surface_t *surf = effect_pool_surface(pool,
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface));
+
+		if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+			swaylock_log(LOG_ERROR, "Failed to create surface for blur-fast effect");
+			cairo_surface_destroy(surf);
+			break;
+		}
+
+		effect_blur_fast(
+				(uint32_t *)cairo_image_surface_get_data(surf),
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				scale,
+				effect->e.blur_fast.radius, pool);
+		cairo_surface_flush(surf);
+		cairo_surface_destroy(surface);
+		surface = surf;
+		break;
+	}
+
+	case EFFECT_BLUR_GAUSSIAN: {
+		effect_blur_gaussian(
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				scale,
+				effect->e.blur_gaussian.sigma);
+		cairo_surface_flush(surface);
+		break;
+	}
+
+	case EFFECT_PIXELATE: {
+		effect_pixelate(
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				scale,
+				effect->e.pixelate.factor);
+		cairo_surface_flush(surface);
+		break;
+	}
+
+	case EFFECT_SCALE: {
+		surface = scale_surface(surface,
+				cairo_image_surface_get_width(surface) * effect->e.scale.factor,
+				cairo_image_surface_get_height(surface) * effect->e.scale.factor,
+				effect, pool);
+		break;
+	}
+
+	case EFFECT_GREYSCALE: {
+		effect_greyscale(
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface));
+		cairo_surface_flush(surface);
+		break;
+	}
+
+	case EFFECT_VIGNETTE: {
+		effect_vignette(
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				effect->e.vignette.base,
+				effect->e.vignette.factor);
+		cairo_surface_flush(surface);
+		break;
+	}
+
+	case EFFECT_COMPOSE: {
+		effect_compose(
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				scale,
+				effect->e.compose.x, effect->e.compose.y,
+				effect->e.compose.w, effect->e.compose.h,
+				effect->e.compose.gravity, effect->e.compose.imgpath);
+		cairo_surface_flush(surface);
+		break;
+	}
+
+	case EFFECT_CUSTOM: {
+		effect_custom(
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				scale,
+				effect->e.custom);
+		cairo_surface_flush(surface);
+		break;
+	}
+
+	case EFFECT_EXPR: {
+		effect_expr(
+				(uint32_t *)cairo_image_surface_get_data(surface),
+				cairo_image_surface_get_width(surface),
+				cairo_image_surface_get_height(surface),
+				effect->e.expr.expr);
+		cairo_surface_flush(surface);
+		break;
+	} }
+
+	return surface;
+}
+
+// One step of the plan which swaylock_effects_run executes. Scale steps
+// always have an explicit output size, since the planner may move or merge
+// them, and the final image must still be exactly the size the effect chain
+// as written would give.
+struct effect_step {
+	struct swaylock_effect effect;
+	int width, height;
+	int out_width, out_height;
+	const char *note; // Why the planner changed the step, if it did
+};
+
+// Greyscale, vignette, expression, 'swaylock_pixel' and pointwise
+// 'swaylock_rows' custom effects only look at one pixel at a time, so a run
+// of them can be applied row by row in a single pass over the image. Each
+// stage does exactly what its effect would do.
+struct pointwise_stage {
+	enum {
+		POINTWISE_GREYSCALE,
+		POINTWISE_VIGNETTE,
+		POINTWISE_CUSTOM,
+		POINTWISE_CUSTOM_ROWS,
+		POINTWISE_EXPR,
+	} type;
+	struct vignette vignette;
+	struct expr *expr;
+	custom_pixel_func pixel_func;
+	custom_rows_func rows_func;
+	int scale;
+};
+
+// Runs a stage on rows [y0, y1), which start at 'rows'.
+static void pointwise_stage_rows(struct pointwise_stage *stage, uint32_t *rows,
+		int y0, int y1, int width, int height) {
+	if (stage->type == POINTWISE_CUSTOM_ROWS) {
+		stage->rows_func(rows, width, y0, y1, width, height, stage->scale);
+		return;
+	} else if (stage->type == POINTWISE_EXPR) {
+		expr_run_rows(stage->expr, rows, width, y0, y1, width, height);
+		return;
+	}
+
+	for (int y = y0; y < y1; ++y) {
+		uint32_t *row = rows + (size_t)(y - y0) * width;
+		switch (stage->type) {
+		case POINTWISE_GREYSCALE:
+			greyscale_row(row, width);
+			break;
+		case POINTWISE_VIGNETTE:
+			vignette_apply_row(&stage->vignette, row, y, width, height);
+			break;
+		case POINTWISE_CUSTOM:
+			custom_pixel_row(stage->pixel_func, row, y, width, height);
+			break;
+		case POINTWISE_CUSTOM_ROWS:
+		case POINTWISE_EXPR:
+			break;
+		}
+	}
+}
+
+static bool pointwise_stage_init(struct pointwise_stage *stage,
+		struct swaylock_effect *effect, int width, int scale) {
+	switch (effect->tag) {
+	case EFFECT_GREYSCALE:
+		stage->type = POINTWISE_GREYSCALE;
+		return true;
+
+	case EFFECT_VIGNETTE:
+		stage->type = POINTWISE_VIGNETTE;
+		return vignette_init(&stage->vignette, width,
+				effect->e.vignette.base, effect->e.vignette.factor);
+
+	case EFFECT_EXPR:
+		stage->type = POINTWISE_EXPR;
+		stage->expr = effect->e.expr.expr;
+		return true;
+
+	case EFFECT_CUSTOM: {
+		// Custom effects which take the whole image are run on their own
+		const struct custom_effect *custom = effect_custom_get(effect->e.custom);
+		if (custom != NULL && custom->rows_func != NULL) {
+			stage->type = POINTWISE_CUSTOM_ROWS;
+			stage->rows_func = custom->rows_func;
+			stage->scale = scale;
+			return custom->rows_pointwise;
+		} else if (custom == NULL || custom->effect_func != NULL) {
+			return false;
+		}
+		stage->type = POINTWISE_CUSTOM;
+		stage->pixel_func = custom->pixel_func;
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+static void pointwise_stage_finish(struct pointwise_stage *stage) {
+	if (stage->type == POINTWISE_VIGNETTE) {
+		free(stage->vignette.colf);
+	}
+}
+
+struct pointwise_pass {
+	struct pointwise_stage *stages;
+	int nstages;
+	uint32_t *data;
+	int width, height;
+};
+
+// Each stage gets a strip of rows at a time, small enough to stay in cache
+// until the last stage is done with it, so 'swaylock_rows' effects aren't
+// called once per row
+#define POINTWISE_STRIP_BYTES (64 * 1024)
+
+static void pointwise_chunk(void *data, int start, int end, int thread) {
+	struct pointwise_pass *pass = data;
+	int width = pass->width, height = pass->height;
+	int strip = POINTWISE_STRIP_BYTES / (width * 4);
+	if (strip < 1) {
+		strip = 1;
+	}
+	for (int y0 = start; y0 < end; y0 += strip) {
+		int y1 = MIN(y0 + strip, end);
+		uint32_t *rows = pass->data + (size_t)y0 * width;
+		for (int i = 0; i < pass->nstages; ++i) {
+			pointwise_stage_rows(&pass->stages[i], rows, y0, y1, width, height);
+		}
+	}
+}
+
+// Runs the per-pixel effects at the start of 'steps' as one fused pass,
+// and returns how many steps it ran. Returns 0 if there are fewer than
+// two of them, since there would be nothing to gain.
+static int run_pointwise_effects(cairo_surface_t *surface, int scale,
+		struct effect_step *steps, int count) {
+	int candidates = 0;
+	while (candidates < count && (steps[candidates].effect.tag == EFFECT_GREYSCALE ||
+			steps[candidates].effect.tag == EFFECT_VIGNETTE ||
+			steps[candidates].effect.tag == EFFECT_CUSTOM ||
+			steps[candidates].effect.tag == EFFECT_EXPR)) {
+		candidates += 1;
+	}
+	if (candidates < 2) {
+		return 0;
+	}
+
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	uint32_t *data = (uint32_t *)cairo_image_surface_get_data(surface);
+
+	struct pointwise_stage *stages = malloc(candidates * sizeof(*stages));
+	if (stages == NULL) {
+		return 0;
+	}
+
+	int nstages = 0;
+	while (nstages < candidates &&
+			pointwise_stage_init(&stages[nstages], &steps[nstages].effect, width, scale)) {
+		nstages += 1;
+	}
+
+	if (nstages >= 2) {
+		struct pointwise_pass pass = { stages, nstages, data, width, height };
+		workers_parallel_for(0, height, 0, pointwise_chunk, &pass);
+		cairo_surface_flush(surface);
+	}
+
+	for (int i = 0; i < nstages; ++i) {
+		pointwise_stage_finish(&stages[i]);
+	}
+	free(stages);
+	return nstages >= 2 ? nstages : 0;
+}
+
+// Chains of box blur, pixelate and per-pixel effects can also be run band
+// by band: each thread takes a band of rows, plus the halo of extra rows its
+// blurs and pixelates need, pushes it through the whole chain while it's
+// still in cache, and writes the finished rows to a new image. Halo rows
+// are computed by more than one band, so chains are only banded if the
+// halo is at most half of a band which fits in BAND_CACHE_BYTES.
+#define BAND_CACHE_BYTES (1024 * 1024)
+#define BAND_MIN_ROWS 16
+#define BAND_MAX_STAGES 16
+
+struct band_stage {
+	struct effect_step *step;
+	struct pointwise_stage pointwise;
+};
+
+static bool band_stage_init(struct band_stage *stage, struct effect_step *step,
+		int width, int scale) {
+	stage->step = step;
+	switch (step->effect.tag) {
+	case EFFECT_BLUR:
+	case EFFECT_PIXELATE:
+		return true;
+	default:
+		return pointwise_stage_init(&stage->pointwise, &step->effect, width, scale);
+	}
+}
+
+static void band_stage_finish(struct band_stage *stage) {
+	if (stage->step->effect.tag != EFFECT_BLUR &&
+			stage->step->effect.tag != EFFECT_PIXELATE) {
+		pointwise_stage_finish(&stage->pointwise);
+	}
+}
+
+// Widens the rows [*y0, *y1) a stage has to produce to the rows it reads.
+static void band_stage_rows(struct band_stage *stage, int scale, int height,
+		int *y0, int *y1) {
+	struct swaylock_effect *effect = &stage->step->effect;
+	if (effect->tag == EFFECT_BLUR && effect->e.blur.times > 0) {
+		int halo = effect->e.blur.radius * scale * effect->e.blur.times;
+		*y0 = *y0 - halo < 0 ? 0 : *y0 - halo;
+		*y1 = MIN(height, *y1 + halo);
+	} else if (effect->tag == EFFECT_PIXELATE && effect->e.pixelate.factor * scale > 1) {
+		// Blocks have to be whole
+		int factor = effect->e.pixelate.factor * scale;
+		*y0 = *y0 / factor * factor;
+		*y1 = MIN(height, (*y1 + factor - 1) / factor * factor);
+	}
+}
+
+// Upper bound on how many rows a band of 'rows' rows needs in the first stage
+static int band_rows_needed(struct band_stage *stages, int nstages, int scale, int rows) {
+	int y0 = INT_MAX / 4, y1 = INT_MAX / 4 + rows;
+	for (int i = nstages - 1; i >= 0; --i) {
+		band_stage_rows(&stages[i], scale, INT_MAX, &y0, &y1);
+		// Pixelate blocks can straddle the band either way
+		if (stages[i].step->effect.tag == EFFECT_PIXELATE) {
+			y1 += stages[i].step->effect.e.pixelate.factor * scale;
+		}
+	}
+	return y1 - y0;
+}
+
+struct band_scratch {
+	uint32_t *bufs[2];
+	uint32_t *linebuf, *stripbuf;
+};
+
+// Computes rows [y0, y1) of the chain's output into 'dest'. Blurs go from one
+// scratch buffer to the other, everything else works in place.
+static void run_band(struct band_stage *stages, int nstages, uint32_t *dest,
+		uint32_t *src, int width, int height, int scale, int y0, int y1,
+		uint32_t *recip, struct band_scratch *scratch) {
+	int rows[BAND_MAX_STAGES + 1][2];
+	rows[nstages][0] = y0;
+	rows[nstages][1] = y1;
+	for (int i = nstages - 1; i >= 0; --i) {
+		rows[i][0] = rows[i + 1][0];
+		rows[i][1] = rows[i + 1][1];
+		band_stage_rows(&stages[i], scale, height, &rows[i][0], &rows[i][1]);
+	}
+
+	int base = rows[0][0];
+	uint32_t *cur = scratch->bufs[0], *other = scratch->bufs[1];
+	memcpy(cur, src + (size_t)base * width,
+			(size_t)(rows[0][1] - base) * width * sizeof(*src));
+
+	for (int i = 0; i < nstages; ++i) {
+		struct swaylock_effect *effect = &stages[i].step->effect;
+		int r0 = rows[i][0], r1 = rows[i][1];
+		uint32_t *in = cur + (size_t)(r0 - base) * width;
+
+		if (effect->tag == EFFECT_BLUR) {
+			if (effect->e.blur.times < 1) {
+				continue;
+			}
+			int radius = effect->e.blur.radius * scale;
+			uint32_t *out = other + (size_t)(r0 - base) * width;
+			for (int y = 0; y < r1 - r0; y += 2) {
+				blur_h_pair(out + (size_t)y * width, in + (size_t)y * width,
+						width, MIN(2, r1 - r0 - y), radius, effect->e.blur.times,
+						recip, scratch->linebuf);
+			}
+			for (int x = 0; x < width; x += BLUR_V_STRIP) {
+				blur_v_strip(out + x, width, r1 - r0, MIN(BLUR_V_STRIP, width - x),
+						radius, effect->e.blur.times, recip, scratch->stripbuf);
+			}
+			other = cur;
+			cur = out - (size_t)(r0 - base) * width;
+		} else if (effect->tag == EFFECT_PIXELATE) {
+			effect_pixelate(in, width, r1 - r0, scale, effect->e.pixelate.factor);
+		} else {
+			pointwise_stage_rows(&stages[i].pointwise, in, r0, r1, width, height);
+		}
+	}
+
+	memcpy(dest + (size_t)y0 * width, cur + (size_t)(y0 - base) * width,
+			(size_t)(y1 - y0) * width * sizeof(*dest));
+}
+
+struct band_pass {
+	struct band_stage *stages;
+	int nstages;
+	uint32_t *dest, *src;
+	int width, height, scale;
+	int band;
+	uint32_t *recip;
+	uint32_t *mem;
+	size_t memsize;
+	size_t bufrows;
+};
+
+static void band_chunk(void *data, int start, int end, int thread) {
+	struct band_pass *pass = data;
+	uint32_t *mem = pass->mem + thread * pass->memsize;
+	struct band_scratch scratch = {
+		.bufs = { mem, mem + pass->bufrows * pass->width },
+		.linebuf = mem + 2 * pass->bufrows * pass->width,
+		.stripbuf = mem + 2 * pass->bufrows * pass->width + 4 * (size_t)pass->width,
+	};
+	for (int i = start; i < end; ++i) {
+		int y = i * pass->band;
+		run_band(pass->stages, pass->nstages, pass->dest, pass->src,
+				pass->width, pass->height, pass->scale,
+				y, MIN(y + pass->band, pass->height), pass->recip, &scratch);
+	}
+}
+
+// Runs the steps at the start of 'steps' band by band, if there are at least
+// two which can be and one of them is a blur. Pixelate and per-pixel effects
+// only make one pass over the image anyway, so banding them on their own
+// would just add copying. Returns how many steps it ran, or 0.
+static int run_band_effects(cairo_surface_t **surface, int scale,
+		struct effect_step *steps, int count, struct effect_pool *pool) {
+	int candidates = 0;
+	while (candidates < count && candidates < BAND_MAX_STAGES) {
+		int tag = steps[candidates].effect.tag;
+		if (tag != EFFECT_BLUR && tag != EFFECT_PIXELATE && tag != EFFECT_GREYSCALE &&
+				tag != EFFECT_VIGNETTE && tag != EFFECT_CUSTOM && tag != EFFECT_EXPR) {
+			break;
+		}
+		candidates += 1;
+	}
+	if (candidates < 2) {
+		return 0;
+	}
+
+	int width = cairo_image_surface_get_width(*surface);
+	int height = cairo_image_surface_get_height(*surface);
+
+	struct band_stage stages[BAND_MAX_STAGES];
+	int nstages = 0;
+	bool has_blur = false;
+	while (nstages < candidates &&
+			band_stage_init(&stages[nstages], &steps[nstages], width, scale)) {
+		has_blur = has_blur || steps[nstages].effect.tag == EFFECT_BLUR;
+		nstages += 1;
+	}
+
+	// Make bands as tall as fit in the cache next to their halo, and give up
+	// if that leaves them less than twice as tall as the halo
+	int halo = band_rows_needed(stages, nstages, scale, 0);
+	int fit = BAND_CACHE_BYTES / (2 * 4 * width);
+	int band = fit - halo;
+	if (band < BAND_MIN_ROWS) {
+		band = BAND_MIN_ROWS;
+	}
+	if (nstages < 2 || !has_blur || band < 2 * halo) {
+		for (int i = 0; i < nstages; ++i) {
+			band_stage_finish(&stages[i]);
+		}
+		return 0;
+	}
+
+	// The output is written to a new image, since neighbouring bands still
+	// read the rows of the input under it
+	cairo_surface_t *surf = effect_pool_surface(pool, width, height);
+	uint32_t *recip = blur_recip_table(width > height ? width : height);
+	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS || recip == NULL) {
+		cairo_surface_destroy(surf);
+		free(recip);
+		for (int i = 0; i < nstages; ++i) {
+			band_stage_finish(&stages[i]);
+		}
+		return 0;
+	}
+
+	size_t bufrows = band_rows_needed(stages, nstages, scale, band);
+	size_t memsize = 2 * bufrows * width + 4 * (size_t)width + 2 * bufrows * BLUR_V_STRIP;
+	uint32_t *mem = malloc(workers_count() * memsize * sizeof(*mem));
+	bool failed = mem == NULL;
+	if (!failed) {
+		struct band_pass pass = {
+			.stages = stages,
+			.nstages = nstages,
+			.dest = (uint32_t *)cairo_image_surface_get_data(surf),
+			.src = (uint32_t *)cairo_image_surface_get_data(*surface),
+			.width = width,
+			.height = height,
+			.scale = scale,
+			.band = band,
+			.recip = recip,
+			.mem = mem,
+			.memsize = memsize,
+			.bufrows = bufrows,
+		};
+		workers_parallel_for(0, (height + band - 1) / band, 1, band_chunk, &pass);
+	}
+
+	free(mem);
+	free(recip);
+	for (int i = 0; i < nstages; ++i) {
+		band_stage_finish(&stages[i]);
+	}
+
+	if (failed) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for effect bands");
+		cairo_surface_destroy(surf);
+		return 0;
+	}
+
+	cairo_surface_flush(surf);
+	cairo_surface_destroy(*surface);
+	*surface = surf;
+	return nstages;
+}
+
+// A planar image keeps the red, green and blue channels of an image in
+// separate planes of bytes. Runs of effects which have planar versions
+// convert the image once at the start, and back once at the end, and in
+// between every kernel is plain byte arithmetic on whole vectors instead of
+// unpacking and repacking pixels. Box blurs run their vertical passes over
+// blocks of columns at once, and their horizontal passes a row at a time,
+// taking each window's sum from running totals of the row.
+#define PLANAR_ALIGN 32
+#define PLANAR_COLS 256 // widest blocks pixelate sums through column sums
+
+struct planar_image {
+	int width, height;
+	size_t stride;
+	uint8_t *planes[3]; // red, green, blue
+	struct effect_buffer *buf;
+};
+
+static size_t planar_stride(int width) {
+	return ((size_t)width + PLANAR_ALIGN - 1) / PLANAR_ALIGN * PLANAR_ALIGN;
+}
+
+static bool planar_image_init(struct planar_image *img, int width, int height,
+		struct effect_pool *pool) {
+	img->width = width;
+	img->height = height;
+	img->stride = planar_stride(width);
+	img->buf = effect_pool_get(pool, 3 * img->stride * height);
+	if (img->buf == NULL) {
+		return false;
+	}
+	for (int i = 0; i < 3; ++i) {
+		img->planes[i] = (uint8_t *)img->buf->data + i * img->stride * height;
+	}
+	return true;
+}
+
+static uint8_t *planar_row(struct planar_image *img, int plane, int y) {
+	return img->planes[plane] + (size_t)y * img->stride;
+}
+
+struct planar_pass {
+	struct planar_image *img;
+	uint32_t *data;
+	void *arg;
+};
+
+static void planar_split_chunk(void *data, int start, int end, int thread) {
+	struct planar_pass *pass = data;
+	struct planar_image *img = pass->img;
+	for (int y = start; y < end; ++y) {
+		planar_split_row(planar_row(img, 0, y), planar_row(img, 1, y),
+				planar_row(img, 2, y), pass->data + (size_t)y * img->width, img->width);
+	}
+}
+
+static void planar_merge_chunk(void *data, int start, int end, int thread) {
+	struct planar_pass *pass = data;
+	struct planar_image *img = pass->img;
+	for (int y = start; y < end; ++y) {
+		planar_merge_row(pass->data + (size_t)y * img->width, planar_row(img, 0, y),
+				planar_row(img, 1, y), planar_row(img, 2, y), img->width);
+	}
+}
+
+static void planar_image_split(struct planar_image *img, uint32_t *data) {
+	struct planar_pass pass = { img, data, NULL };
+	workers_parallel_for(0, img->height, 0, planar_split_chunk, &pass);
+}
+
+static void planar_image_merge(struct planar_image *img, uint32_t *data) {
+	struct planar_pass pass = { img, data, NULL };
+	workers_parallel_for(0, img->height, 0, planar_merge_chunk, &pass);
+}
+
+// Runs 'times' vertical passes over a strip of a plane in place, like
+// blur_v_strip; 'buf' holds two strips of 'height' rows.
+static void planar_blur_strip(uint8_t *data, size_t stride, int height, int ncols,
+		int radius, int times, uint32_t *recip, uint8_t *buf) {
+	uint8_t *strips[2] = { buf, buf + (size_t)height * PLANAR_STRIP };
+
+	for (int y = 0; y < height; ++y) {
+		memcpy(strips[0] + (size_t)y * PLANAR_STRIP, data + (size_t)y * stride, ncols);
+	}
+
+	for (int t = 0; t < times; ++t) {
+		uint8_t *in = strips[t % 2];
+		if (t == times - 1) {
+			planar_blur_cols(data, stride, in, PLANAR_STRIP, height, ncols, radius, recip);
+		} else {
+			planar_blur_cols(strips[(t + 1) % 2], PLANAR_STRIP, in, PLANAR_STRIP,
+					height, ncols, radius, recip);
+		}
+	}
+}
+
+struct planar_blur_pass {
+	struct planar_image *img;
+	int radius, times;
+	int strips;
+	uint32_t *recip;
+	uint32_t *prefixes;
+	uint8_t *stripbufs;
+};
+
+static void planar_blur_rows_chunk(void *data, int start, int end, int thread) {
+	struct planar_blur_pass *pass = data;
+	struct planar_image *img = pass->img;
+	uint32_t *prefix = pass->prefixes + thread * ((size_t)img->width + 1);
+	for (int i = start; i < end; ++i) {
+		uint8_t *row = planar_row(img, i / img->height, i % img->height);
+		for (int t = 0; t < pass->times; ++t) {
+			planar_blur_row(row, row, prefix, img->width, pass->radius, pass->recip);
+		}
+	}
+}
+
+static void planar_blur_strips_chunk(void *data, int start, int end, int thread) {
+	struct planar_blur_pass *pass = data;
+	struct planar_image *img = pass->img;
+	uint8_t *stripbuf = pass->stripbufs + thread * 2 * (size_t)img->height * PLANAR_STRIP;
+	for (int i = start; i < end; ++i) {
+		int x = i % pass->strips * PLANAR_STRIP;
+		planar_blur_strip(img->planes[i / pass->strips] + x, img->stride, img->height,
+				MIN(PLANAR_STRIP, img->width - x), pass->radius, pass->times,
+				pass->recip, stripbuf);
+	}
+}
+
+// Box blur, giving what effect_blur's SIMD kernels give. All the passes over
+// a row, and then all the passes over a strip of columns, are done while it
+// is in cache.
+static bool planar_blur(struct planar_image *img, int radius, int times) {
+	if (times < 1) {
+		return true;
+	}
+
+	int width = img->width, height = img->height;
+	int strips = (width + PLANAR_STRIP - 1) / PLANAR_STRIP;
+	uint32_t *recip = blur_recip_table(width > height ? width : height);
+	if (recip == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for blur effect");
+		return false;
+	}
+
+	int nthreads = workers_count();
+	uint32_t *prefixes = malloc(nthreads * ((size_t)width + 1) * sizeof(*prefixes));
+	uint8_t *stripbufs = malloc(nthreads * 2 * (size_t)height * PLANAR_STRIP);
+	bool failed = prefixes == NULL || stripbufs == NULL;
+	if (!failed) {
+		struct planar_blur_pass pass = {
+			img, radius, times, strips, recip, prefixes, stripbufs,
+		};
+		workers_parallel_for(0, 3 * height, 0, planar_blur_rows_chunk, &pass);
+		workers_parallel_for(0, 3 * strips, 0, planar_blur_strips_chunk, &pass);
+	}
+
+	free(prefixes);
+	free(stripbufs);
+	free(recip);
+	if (failed) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for blur effect");
 	}
+	return !failed;
 }
 
-static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
-		struct swaylock_effect *effect) {
-	switch (effect->tag) {
-	case EFFECT_BLUR: {
-		cairo_surface_t *surf = cairo_image_surface_create(
-				CAIRO_FORMAT_RGB24,
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface));
+static void planar_greyscale_chunk(void *data, int start, int end, int thread) {
+	struct planar_pass *pass = data;
+	struct planar_image *img = pass->img;
+	for (int y = start; y < end; ++y) {
+		planar_greyscale_row(planar_row(img, 0, y), planar_row(img, 1, y),
+				planar_row(img, 2, y), img->width);
+	}
+}
 
-		if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
-			swaylock_log(LOG_ERROR, "Failed to create surface for blur effect");
-			cairo_surface_destroy(surf);
-			break;
-		}
+static void planar_greyscale(struct planar_image *img) {
+	struct planar_pass pass = { img, NULL, NULL };
+	workers_parallel_for(0, img->height, 0, planar_greyscale_chunk, &pass);
+}
 
-		effect_blur(
-				(uint32_t *)cairo_image_surface_get_data(surf),
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
-				effect->e.blur.radius, effect->e.blur.times);
-		cairo_surface_flush(surf);
-		cairo_surface_destroy(surface);
-		surface = surf;
-		break;
+static void planar_vignette_chunk(void *data, int start, int end, int thread) {
+	struct planar_pass *pass = data;
+	struct planar_image *img = pass->img;
+	struct vignette *vignette = pass->arg;
+	for (int y = start; y < end; ++y) {
+		double yf = (y * 1.0) / img->height;
+		uint32_t rowmul = 65535 * vignette->factor * 4 * yf * (1.0 - yf);
+		planar_vignette_row(planar_row(img, 0, y), planar_row(img, 1, y),
+				planar_row(img, 2, y), vignette->colf, vignette->base, rowmul, img->width);
 	}
+}
 
-	case EFFECT_PIXELATE: {
-		effect_pixelate(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
-				effect->e.pixelate.factor);
-		cairo_surface_flush(surface);
-		break;
+static bool planar_vignette(struct planar_image *img, double base, double factor) {
+	struct vignette vignette;
+	if (!vignette_init(&vignette, img->width, base, factor)) {
+		return false;
 	}
 
-	case EFFECT_SCALE: {
-		cairo_surface_t *surf = cairo_image_surface_create(
-				CAIRO_FORMAT_RGB24,
-				cairo_image_surface_get_width(surface) * effect->e.scale,
-				cairo_image_surface_get_height(surface) * effect->e.scale);
+	struct planar_pass pass = { img, NULL, &vignette };
+	workers_parallel_for(0, img->height, 0, planar_vignette_chunk, &pass);
 
-		if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
-			swaylock_log(LOG_ERROR, "Failed to create surface for scale effect");
-			cairo_surface_destroy(surf);
-			break;
+	free(vignette.colf);
+	return true;
+}
+
+struct planar_pixelate_pass {
+	struct planar_image *img;
+	int factor;
+	int bands, chunks;
+	int chunkblocks, chunkwidth;
+};
+
+// Same blocks and rounding as effect_pixelate. Blocks up to PLANAR_COLS wide
+// are summed through per-column sums, streaming down the band of rows.
+static void planar_pixelate_band_chunk(struct planar_pixelate_pass *pass,
+		int i, int band, int chunk) {
+	struct planar_image *img = pass->img;
+	int width = img->width, height = img->height, factor = pass->factor;
+	int chunkblocks = pass->chunkblocks, chunkwidth = pass->chunkwidth;
+	int ystart = band * factor;
+	int ylim = MIN(ystart + factor, height);
+	int xstart = chunk * chunkwidth;
+	int xlim = MIN(xstart + chunkwidth, width);
+
+	uint32_t colsum[PLANAR_COLS];
+	if (chunkblocks > 1) {
+		memset(colsum, 0, (xlim - xstart) * sizeof(*colsum));
+		for (int y = ystart; y < ylim; ++y) {
+			uint8_t *row = planar_row(img, i, y) + xstart;
+			for (int x = 0; x < xlim - xstart; ++x) {
+				colsum[x] += row[x];
+			}
 		}
+	}
 
-		effect_scale(
-				(uint32_t *)cairo_image_surface_get_data(surf),
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				effect->e.scale);
-		cairo_surface_flush(surf);
-		cairo_surface_destroy(surface);
-		surface = surf;
-		break;
+	for (int bx = xstart; bx < xlim; bx += factor) {
+		int bxlim = MIN(bx + factor, width);
+		uint64_t sum = 0;
+		if (chunkblocks > 1) {
+			for (int x = bx; x < bxlim; ++x) {
+				sum += colsum[x - xstart];
+			}
+		} else {
+			for (int y = ystart; y < ylim; ++y) {
+				uint8_t *row = planar_row(img, i, y);
+				for (int x = bx; x < bxlim; ++x) {
+					sum += row[x];
+				}
+			}
+		}
+		uint8_t avg = sum / ((uint64_t)(bxlim - bx) * (ylim - ystart));
+		for (int y = ystart; y < ylim; ++y) {
+			memset(planar_row(img, i, y) + bx, avg, bxlim - bx);
+		}
 	}
+}
 
-	case EFFECT_GREYSCALE: {
-		effect_greyscale(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface));
-		cairo_surface_flush(surface);
-		break;
+static void planar_pixelate_chunk(void *data, int start, int end, int thread) {
+	struct planar_pixelate_pass *pass = data;
+	int perplane = pass->bands * pass->chunks;
+	for (int item = start; item < end; ++item) {
+		int i = item / perplane;
+		planar_pixelate_band_chunk(pass, i, item % perplane / pass->chunks,
+				item % pass->chunks);
 	}
+}
 
-	case EFFECT_VIGNETTE: {
-		effect_vignette(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				effect->e.vignette.base,
-				effect->e.vignette.factor);
-		cairo_surface_flush(surface);
-		break;
+static void planar_pixelate(struct planar_image *img, int factor) {
+	if (factor <= 1) {
+		return;
 	}
 
-	case EFFECT_COMPOSE: {
-		effect_compose(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
-				effect->e.compose.x, effect->e.compose.y,
-				effect->e.compose.w, effect->e.compose.h,
-				effect->e.compose.gravity, effect->e.compose.imgpath);
-		cairo_surface_flush(surface);
-		break;
+	int width = img->width, height = img->height;
+	int bands = (height + factor - 1) / factor;
+	int chunkblocks = factor < PLANAR_COLS ? PLANAR_COLS / factor : 1;
+	int chunkwidth = chunkblocks * factor;
+	int chunks = (width + chunkwidth - 1) / chunkwidth;
+
+	struct planar_pixelate_pass pass = {
+		img, factor, bands, chunks, chunkblocks, chunkwidth,
+	};
+	workers_parallel_for(0, 3 * bands * chunks, 1, planar_pixelate_chunk, &pass);
+}
+
+static bool planar_step_supported(struct effect_step *step) {
+	switch (step->effect.tag) {
+	case EFFECT_BLUR:
+	case EFFECT_GREYSCALE:
+	case EFFECT_VIGNETTE:
+	case EFFECT_PIXELATE:
+		return true;
+	default:
+		return false;
 	}
+}
 
-	case EFFECT_CUSTOM: {
-		effect_custom(
-				(uint32_t *)cairo_image_surface_get_data(surface),
-				cairo_image_surface_get_width(surface),
-				cairo_image_surface_get_height(surface),
-				scale,
-				effect->e.custom);
-		cairo_surface_flush(surface);
-		break;
-	} }
+// Runs the steps at the start of 'steps' which have planar versions on a
+// planar copy of the image, if one of them is a blur. Converting to and from
+// planar costs about as much as two greyscale passes, which the planar blur
+// makes back even on its own, but the others don't. Returns how many steps
+// it ran, or 0.
+static int run_planar_effects(cairo_surface_t *surface, int scale,
+		struct effect_step *steps, int count, struct effect_pool *pool) {
+	int nsteps = 0;
+	bool has_blur = false;
+	while (nsteps < count && planar_step_supported(&steps[nsteps])) {
+		has_blur = has_blur || steps[nsteps].effect.tag == EFFECT_BLUR;
+		nsteps += 1;
+	}
+	if (!has_blur) {
+		return 0;
+	}
 
-	return surface;
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	uint32_t *data = (uint32_t *)cairo_image_surface_get_data(surface);
+
+	struct planar_image img;
+	if (!planar_image_init(&img, width, height, pool)) {
+		return 0;
+	}
+	planar_image_split(&img, data);
+
+	// If a step fails, the ones before it have still been applied
+	int done = 0;
+	for (; done < nsteps; ++done) {
+		struct swaylock_effect *effect = &steps[done].effect;
+		bool ok = true;
+		switch (effect->tag) {
+		case EFFECT_BLUR:
+			ok = planar_blur(&img, effect->e.blur.radius * scale, effect->e.blur.times);
+			break;
+		case EFFECT_GREYSCALE:
+			planar_greyscale(&img);
+			break;
+		case EFFECT_VIGNETTE:
+			ok = planar_vignette(&img, effect->e.vignette.base, effect->e.vignette.factor);
+			break;
+		case EFFECT_PIXELATE:
+			planar_pixelate(&img, effect->e.pixelate.factor * scale);
+			break;
+		default:
+			break;
+		}
+		if (!ok) {
+			break;
+		}
+	}
+
+	planar_image_merge(&img, data);
+	effect_pool_put(img.buf);
+	cairo_surface_flush(surface);
+	return done;
+}
+
+static bool use_planar = false;
+
+void swaylock_effects_set_planar(bool planar) {
+	use_planar = planar;
 }
 
-static cairo_surface_t *ensure_format(cairo_surface_t *surface) {
+// Runs the steps at the start of 'steps' which can be fused into one pass,
+// and returns how many it ran, or 0. Runs with a blur go to the planar
+// engine if it's turned on, and are banded otherwise; either way runs of
+// per-pixel effects alone are fused row by row.
+static int run_fused_effects(cairo_surface_t **surface, int scale,
+		struct effect_step *steps, int count, struct effect_pool *pool) {
+	int fused = 0;
+	if (use_planar) {
+		fused = run_planar_effects(*surface, scale, steps, count, pool);
+	}
+	if (fused == 0) {
+		fused = run_band_effects(surface, scale, steps, count, pool);
+	}
+	if (fused == 0) {
+		fused = run_pointwise_effects(*surface, scale, steps, count);
+	}
+	return fused;
+}
+
+static cairo_user_data_key_t source_surface_key;
+
+static cairo_surface_t *ensure_format(cairo_surface_t *surface,
+		struct effect_pool *pool) {
 	if (cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24) {
 		return surface;
 	}
@@ -693,10 +4286,28 @@ static cairo_surface_t *ensure_format(cairo_surface_t *surface) {
 	swaylock_log(LOG_DEBUG, "Have to convert surface to CAIRO_FORMAT_RGB24 from %i.",
 			(int)cairo_image_surface_get_format(surface));
 
-	cairo_surface_t *surf = cairo_image_surface_create(
-			CAIRO_FORMAT_RGB24,
-			cairo_image_surface_get_width(surface),
-			cairo_image_surface_get_height(surface));
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+
+	// ARGB32 has the same layout as RGB24 with the alpha byte unused, so the
+	// pixels can be used where they are. The new surface keeps the old one
+	// alive until it's destroyed itself.
+	if (cairo_image_surface_get_format(surface) == CAIRO_FORMAT_ARGB32 &&
+			stride == cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width)) {
+		cairo_surface_flush(surface);
+		cairo_surface_t *surf = cairo_image_surface_create_for_data(
+				cairo_image_surface_get_data(surface),
+				CAIRO_FORMAT_RGB24, width, height, stride);
+		if (cairo_surface_status(surf) == CAIRO_STATUS_SUCCESS &&
+				cairo_surface_set_user_data(surf, &source_surface_key, surface,
+					(cairo_destroy_func_t)cairo_surface_destroy) == CAIRO_STATUS_SUCCESS) {
+			return surf;
+		}
+		cairo_surface_destroy(surf);
+	}
+
+	cairo_surface_t *surf = effect_pool_surface(pool, width, height);
 	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
 		swaylock_log(LOG_ERROR, "Failed to create surface for scale effect");
 		cairo_surface_destroy(surf);
@@ -706,21 +4317,384 @@ static cairo_surface_t *ensure_format(cairo_surface_t *surface) {
 	memcpy(
 			cairo_image_surface_get_data(surf),
 			cairo_image_surface_get_data(surface),
-			cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface));
+			stride * height);
 	cairo_surface_destroy(surface);
 	return surf;
 }
 
+// Rough cost of each step in milliseconds, from the time each kernel takes
+// per pixel on a 4K image on one thread, spread over the pool's threads.
+// Only the relative costs matter to the planner.
+static double step_cost(struct effect_step *step) {
+	double pixels = (double)step->width * step->height;
+	double ns = 0;
+	switch (step->effect.tag) {
+	case EFFECT_BLUR: ns = 1.6 + 2.2 * step->effect.e.blur.times; break;
+	case EFFECT_BLUR_FAST: ns = 8; break;
+	case EFFECT_BLUR_GAUSSIAN: ns = 18; break;
+	case EFFECT_PIXELATE: ns = 1.2; break;
+	case EFFECT_SCALE:
+		ns = 1.2 + 3.3 * step->out_width * step->out_height / fmax(pixels, 1);
+		break;
+	case EFFECT_GREYSCALE: ns = 0.6; break;
+	case EFFECT_VIGNETTE: ns = 0.6; break;
+	case EFFECT_COMPOSE: ns = 1; break;
+	case EFFECT_CUSTOM: ns = 2.5; break;
+	case EFFECT_EXPR: ns = 1; break;
+	}
+	return pixels * ns / 1000000.0 / workers_count();
+}
+
+static double plan_cost(struct effect_step *steps, int count) {
+	double cost = 0;
+	for (int i = 0; i < count; ++i) {
+		cost += step_cost(&steps[i]);
+	}
+	return cost;
+}
+
+static void plan_update_sizes(struct effect_step *steps, int count, int width, int height) {
+	for (int i = 0; i < count; ++i) {
+		steps[i].width = width;
+		steps[i].height = height;
+		if (steps[i].effect.tag == EFFECT_SCALE) {
+			width = steps[i].out_width;
+			height = steps[i].out_height;
+		} else {
+			steps[i].out_width = width;
+			steps[i].out_height = height;
+		}
+	}
+}
+
+// By default the planner only moves downscales ahead of greyscale and
+// vignette steps, which only changes the result by rounding. With
+// --effects-approximate it also merges smooth downscales by whole
+// numbers, moves blurs past downscales to no less than PLAN_MIN_DOWNSCALE,
+// and runs wide blurs at half resolution. A blur is only resized when its
+// radius stays a whole number of pixels, and when its standard deviation at
+// the lower resolution is at least PLAN_MIN_SIGMA or PLAN_LOWRES_SIGMA
+// pixels, so the image is smooth enough that resampling it first or last
+// makes little difference. On test images that keeps the mean difference
+// under one level.
+#define PLAN_MIN_SIGMA 6
+#define PLAN_MIN_DOWNSCALE 0.5
+#define PLAN_LOWRES_SIGMA 12
+#define PLAN_LOWRES_MAX_FACTOR 2
+#define PLAN_LOWRES_MIN_SIZE 64
+// The recursive Gaussian loses precision in single-precision floats when
+// it's wider than this, so halving it changes the result too much
+#define PLAN_LOWRES_MAX_GAUSSIAN 64
+
+static bool plan_approximate = false;
+
+void swaylock_effects_set_approximate(bool approximate) {
+	plan_approximate = approximate;
+}
+
+// Standard deviation of a blur step in pixels, or 0 if it isn't a blur.
+// 'times' box blurs of radius r are close to a Gaussian with
+// sigma = r * sqrt(times / 3).
+static double step_blur_sigma(struct effect_step *step, int scale) {
+	switch (step->effect.tag) {
+	case EFFECT_BLUR:
+		return step->effect.e.blur.radius * scale * sqrt(step->effect.e.blur.times / 3.0);
+	case EFFECT_BLUR_FAST:
+		return step->effect.e.blur_fast.radius * scale;
+	case EFFECT_BLUR_GAUSSIAN:
+		return step->effect.e.blur_gaussian.sigma * scale;
+	default:
+		return 0;
+	}
+}
+
+// Whether 'radius' times 'factor' is a whole number, so a box blur scaled
+// by 'factor' covers exactly the same area of the image
+static bool radius_scales_exactly(int radius, double factor) {
+	double scaled = radius * factor;
+	return fabs(scaled - round(scaled)) < 1e-9;
+}
+
+// Scales a blur step's size by 'factor', if the result is still at least
+// 'min_sigma' pixels wide. Box blur radii are whole numbers of logical
+// pixels, so they're only scaled when that's exact.
+static bool step_scale_blur(struct effect_step *step, int scale,
+		double factor, double min_sigma) {
+	if (step_blur_sigma(step, scale) * factor < min_sigma) {
+		return false;
+	}
+
+	switch (step->effect.tag) {
+	case EFFECT_BLUR:
+		if (!radius_scales_exactly(step->effect.e.blur.radius, factor)) {
+			return false;
+		}
+		step->effect.e.blur.radius = lround(step->effect.e.blur.radius * factor);
+		return true;
+	case EFFECT_BLUR_FAST:
+		if (!radius_scales_exactly(step->effect.e.blur_fast.radius, factor)) {
+			return false;
+		}
+		step->effect.e.blur_fast.radius = lround(step->effect.e.blur_fast.radius * factor);
+		return true;
+	case EFFECT_BLUR_GAUSSIAN:
+		step->effect.e.blur_gaussian.sigma *= factor;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// A scale to nothing isn't worth moving, and would divide by zero below
+static bool step_is_downscale(struct effect_step *step) {
+	return step->effect.tag == EFFECT_SCALE &&
+		step->out_width > 0 && step->out_height > 0 &&
+		step->out_width <= step->width && step->out_height <= step->height &&
+		(step->out_width < step->width || step->out_height < step->height);
+}
+
+// Whether a step downscales by a whole number, the same in both directions
+static bool step_is_whole_downscale(struct effect_step *step) {
+	return step_is_downscale(step) &&
+		step->width % step->out_width == 0 &&
+		step->height % step->out_height == 0 &&
+		step->width / step->out_width == step->height / step->out_height;
+}
+
+static struct swaylock_effect smooth_scale_effect(int swidth, int dwidth) {
+	struct swaylock_effect effect = { .tag = EFFECT_SCALE };
+	effect.e.scale.factor = (double)dwidth / swidth;
+	effect.e.scale.filter = EFFECT_SCALE_FILTER_SMOOTH;
+	return effect;
+}
+
+// Turns the effect chain into a list of steps, with downscales moved as
+// early as possible and, if allowed to approximate, adjacent smooth
+// downscales merged and big blurs run at half the resolution. 'steps'
+// needs room for 3 * count steps,
+// and 'unplanned_cost' gets the estimated cost of the chain as written.
+static int plan_effects(struct effect_step *steps, struct swaylock_effect *effects,
+		int count, int width, int height, int scale, double *unplanned_cost) {
+	int w = width, h = height;
+	for (int i = 0; i < count; ++i) {
+		steps[i] = (struct effect_step){ .effect = effects[i] };
+		if (effects[i].tag == EFFECT_SCALE) {
+			steps[i].out_width = w = w * effects[i].e.scale.factor;
+			steps[i].out_height = h = h * effects[i].e.scale.factor;
+		}
+	}
+	int n = count;
+	plan_update_sizes(steps, n, width, height);
+	*unplanned_cost = plan_cost(steps, n);
+
+	// Move downscales up past greyscale, vignette and blur steps. Blurs get
+	// a proportionally smaller radius, and the downscale then has to be
+	// smooth, since it now sees the sharp image.
+	bool moved = true;
+	while (moved) {
+		moved = false;
+		for (int i = 1; i < n; ++i) {
+			struct effect_step *prev = &steps[i - 1], *down = &steps[i];
+			if (!step_is_downscale(down)) {
+				continue;
+			}
+
+			struct effect_step step = *prev;
+			double factor = (double)down->out_width / down->width;
+			bool blur = step_blur_sigma(&step, scale) > 0;
+			if (blur && (!plan_approximate || factor < PLAN_MIN_DOWNSCALE ||
+					!step_scale_blur(&step, scale, factor, PLAN_MIN_SIGMA))) {
+				continue;
+			} else if (!blur && step.effect.tag != EFFECT_GREYSCALE &&
+					step.effect.tag != EFFECT_VIGNETTE) {
+				continue;
+			}
+
+			struct effect_step newdown = *down;
+			if (blur) {
+				newdown.effect = smooth_scale_effect(down->width, down->out_width);
+			}
+			newdown.note = "moved earlier";
+			step.note = step.note ? step.note : "runs after downscale";
+			*prev = newdown;
+			*down = step;
+			plan_update_sizes(steps, n, width, height);
+			moved = true;
+		}
+	}
+
+	// Merge adjacent smooth downscales
+	for (int i = 1; plan_approximate && i < n; ++i) {
+		if (step_is_whole_downscale(&steps[i - 1]) &&
+				step_is_whole_downscale(&steps[i]) &&
+				steps[i - 1].effect.e.scale.filter == EFFECT_SCALE_FILTER_SMOOTH &&
+				steps[i].effect.e.scale.filter == EFFECT_SCALE_FILTER_SMOOTH) {
+			steps[i - 1].out_width = steps[i].out_width;
+			steps[i - 1].out_height = steps[i].out_height;
+			steps[i - 1].effect = smooth_scale_effect(steps[i - 1].width, steps[i].out_width);
+			steps[i - 1].note = "merged";
+			memmove(&steps[i], &steps[i + 1], (n - i - 1) * sizeof(*steps));
+			n -= 1;
+			i -= 1;
+			plan_update_sizes(steps, n, width, height);
+		}
+	}
+
+	// Run blurs which are wide enough at a lower resolution, between a smooth
+	// downscale and an upscale back to the original size. Since the box and
+	// recursive blurs take the same time for any radius, this saves almost
+	// all of their cost.
+	for (int i = 0; plan_approximate && i < n; ++i) {
+		struct effect_step *step = &steps[i];
+		if (step->effect.tag != EFFECT_BLUR && step->effect.tag != EFFECT_BLUR_GAUSSIAN) {
+			continue;
+		}
+		if (i + 1 < n && steps[i + 1].effect.tag == EFFECT_SCALE) {
+			continue;
+		}
+		if (step->effect.tag == EFFECT_BLUR_GAUSSIAN &&
+				step_blur_sigma(step, scale) > PLAN_LOWRES_MAX_GAUSSIAN) {
+			continue;
+		}
+
+		int factor = 1;
+		struct effect_step blur = *step;
+		while (factor < PLAN_LOWRES_MAX_FACTOR &&
+				step->width / (factor * 2) >= PLAN_LOWRES_MIN_SIZE &&
+				step->height / (factor * 2) >= PLAN_LOWRES_MIN_SIZE) {
+			struct effect_step smaller = *step;
+			if (!step_scale_blur(&smaller, scale, 1.0 / (factor * 2),
+					PLAN_LOWRES_SIGMA)) {
+				break;
+			}
+			blur = smaller;
+			factor *= 2;
+		}
+		if (factor == 1) {
+			continue;
+		}
+
+		blur.note = "at reduced resolution";
+
+		int lw = (step->width + factor - 1) / factor;
+		int lh = (step->height + factor - 1) / factor;
+		struct effect_step down = {
+			.effect = smooth_scale_effect(step->width, lw),
+			.out_width = lw, .out_height = lh,
+			.note = "for reduced resolution blur",
+		};
+		struct effect_step up = {
+			.effect = smooth_scale_effect(lw, step->width),
+			.out_width = step->width, .out_height = step->height,
+			.note = "back from reduced resolution blur",
+		};
+
+		memmove(&steps[i + 3], &steps[i + 1], (n - i - 1) * sizeof(*steps));
+		steps[i] = down;
+		steps[i + 1] = blur;
+		steps[i + 2] = up;
+		n += 2;
+		i += 2;
+		plan_update_sizes(steps, n, width, height);
+	}
+
+	return n;
+}
+
+static void describe_step(struct effect_step *step, char *buf, size_t size) {
+	struct swaylock_effect *effect = &step->effect;
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+		snprintf(buf, size, "blur %dx%d", effect->e.blur.radius, effect->e.blur.times);
+		break;
+	case EFFECT_BLUR_FAST:
+		snprintf(buf, size, "blur-fast %d", effect->e.blur_fast.radius);
+		break;
+	case EFFECT_BLUR_GAUSSIAN:
+		snprintf(buf, size, "blur-gaussian %g", effect->e.blur_gaussian.sigma);
+		break;
+	case EFFECT_PIXELATE:
+		snprintf(buf, size, "pixelate %d", effect->e.pixelate.factor);
+		break;
+	case EFFECT_SCALE:
+		snprintf(buf, size, "scale to %dx%d (%s)", step->out_width, step->out_height,
+				effect->e.scale.filter == EFFECT_SCALE_FILTER_NEAREST ? "nearest" : "smooth");
+		break;
+	case EFFECT_VIGNETTE:
+		snprintf(buf, size, "vignette %g:%g", effect->e.vignette.base, effect->e.vignette.factor);
+		break;
+	default:
+		snprintf(buf, size, "%s", effect_name(effect));
+		break;
+	}
+}
+
+static void print_plan(struct effect_step *steps, int count, double unplanned_cost) {
+	fprintf(stderr, "Effects plan for %ix%i:\n", steps[0].width, steps[0].height);
+	for (int i = 0; i < count; ++i) {
+		char desc[128];
+		describe_step(&steps[i], desc, sizeof(desc));
+		fprintf(stderr, "    %s at %ix%i: ~%.1fms%s%s%s\n", desc,
+				steps[i].width, steps[i].height, step_cost(&steps[i]),
+				steps[i].note ? " (" : "", steps[i].note ? steps[i].note : "",
+				steps[i].note ? ")" : "");
+	}
+	fprintf(stderr, "Estimated %.1fms, against %.1fms for the effects as written.\n",
+			plan_cost(steps, count), unplanned_cost);
+}
+
+static cairo_surface_t *run_step(cairo_surface_t *surface, int scale,
+		struct effect_step *step, struct effect_pool *pool) {
+	if (step->effect.tag == EFFECT_SCALE) {
+		return scale_surface(surface, step->out_width, step->out_height,
+				&step->effect, pool);
+	}
+	return run_effect(surface, scale, &step->effect, pool);
+}
+
+static struct effect_step *plan_for_surface(cairo_surface_t *surface, int scale,
+		struct swaylock_effect *effects, int count, int *nsteps, double *unplanned_cost) {
+	struct effect_step *steps = malloc(3 * count * sizeof(*steps));
+	if (steps == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate memory for effects plan");
+		return NULL;
+	}
+
+	*nsteps = plan_effects(steps, effects, count,
+			cairo_image_surface_get_width(surface),
+			cairo_image_surface_get_height(surface),
+			scale, unplanned_cost);
+	return steps;
+}
+
 cairo_surface_t *swaylock_effects_run(cairo_surface_t *surface, int scale,
 		struct swaylock_effect *effects, int count) {
-	surface = ensure_format(surface);
-	if (surface == NULL) return NULL;
+	select_kernels();
+	struct effect_pool pool = { 0 };
+	surface = ensure_format(surface, &pool);
+	int nsteps = 0;
+	double unplanned_cost = 0;
+	struct effect_step *steps = NULL;
+	if (surface != NULL) {
+		steps = plan_for_surface(surface, scale, effects, count, &nsteps, &unplanned_cost);
+	}
+	if (steps == NULL) {
+		effect_pool_finish(&pool);
+		return surface;
+	}
 
-	for (int i = 0; i < count; ++i) {
-		struct swaylock_effect *effect = &effects[i];
-		surface = run_effect(surface, scale, effect);
+	for (int i = 0; i < nsteps;) {
+		int fused = run_fused_effects(&surface, scale, &steps[i], nsteps - i, &pool);
+		if (fused > 0) {
+			i += fused;
+			continue;
+		}
+
+		surface = run_step(surface, scale, &steps[i++], &pool);
 	}
 
+	free(steps);
+	effect_pool_finish(&pool);
 	return surface;
 }
 
@@ -728,30 +4702,61 @@ cairo_surface_t *swaylock_effects_run(cairo_surface_t *surface, int scale,
 #define TIME_DELTA(first, last) (TIME_MSEC(last) - TIME_MSEC(first))
 
 cairo_surface_t *swaylock_effects_run_timed(cairo_surface_t *surface, int scale,
-		struct swaylock_effect *effects, int count) {
+		struct swaylock_effect *effects, int count, bool show_plan) {
 	struct timespec start_tv;
 	clock_gettime(CLOCK_MONOTONIC, &start_tv);
 
-	surface = ensure_format(surface);
-	if (surface == NULL) return NULL;
+	select_kernels();
+	struct effect_pool pool = { 0 };
+	surface = ensure_format(surface, &pool);
+	int nsteps = 0;
+	double unplanned_cost = 0;
+	struct effect_step *steps = NULL;
+	if (surface != NULL) {
+		steps = plan_for_surface(surface, scale, effects, count, &nsteps, &unplanned_cost);
+	}
+	if (steps == NULL) {
+		effect_pool_finish(&pool);
+		return surface;
+	}
+	if (show_plan) {
+		print_plan(steps, nsteps, unplanned_cost);
+	}
 
-	fprintf(stderr, "Running %i effects:\n", count);
-	for (int i = 0; i < count; ++i) {
+	fprintf(stderr, "Running %i effects:\n", nsteps);
+	for (int i = 0; i < nsteps;) {
 		struct timespec effect_start_tv;
 		clock_gettime(CLOCK_MONOTONIC, &effect_start_tv);
 
-		struct swaylock_effect *effect = &effects[i];
-		surface = run_effect(surface, scale, effect);
+		int fused = run_fused_effects(&surface, scale, &steps[i], nsteps - i, &pool);
+		if (fused == 0) {
+			surface = run_step(surface, scale, &steps[i], &pool);
+			fused = 1;
+		}
 
 		struct timespec effect_end_tv;
 		clock_gettime(CLOCK_MONOTONIC, &effect_end_tv);
-		fprintf(stderr, "    %s: %fms\n", effect_name(effect),
-				TIME_DELTA(effect_start_tv, effect_end_tv));
+		fprintf(stderr, "    ");
+		double estimate = 0;
+		for (int j = i; j < i + fused; ++j) {
+			char desc[128];
+			describe_step(&steps[j], desc, sizeof(desc));
+			fprintf(stderr, "%s%s", j > i ? "+" : "", desc);
+			estimate += step_cost(&steps[j]);
+		}
+		fprintf(stderr, ": %fms", TIME_DELTA(effect_start_tv, effect_end_tv));
+		if (show_plan) {
+			fprintf(stderr, " (estimated %.1fms)", estimate);
+		}
+		fprintf(stderr, "\n");
+		i += fused;
 	}
 
 	struct timespec end_tv;
 	clock_gettime(CLOCK_MONOTONIC, &end_tv);
 	fprintf(stderr, "Effects took %fms.\n", TIME_DELTA(start_tv, end_tv));
 
+	free(steps);
+	effect_pool_finish(&pool);
 	return surface;
 }
@@ -0,0 +1,757 @@
+#define _POSIX_C_SOURCE 200809
+#include <ctype.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "expr.h"
+#include "log.h"
+
+#ifdef CPU_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Expressions are compiled to instructions on registers which each hold the
+// values for a block of EXPR_BLOCK pixels. The interpreter dispatches once
+// per instruction per block, and each instruction is a short loop the SIMD
+// kernels run 4 or 8 pixels at a time. Constants are folded while parsing.
+#define EXPR_BLOCK 64
+#define EXPR_MAX_REGS 64
+#define EXPR_MAX_INSNS 256
+
+// Registers the interpreter fills in, followed by constants and temporaries
+enum {
+	REG_R,
+	REG_G,
+	REG_B,
+	REG_X,
+	REG_Y,
+	REG_W,
+	REG_H,
+	REG_FIRST_FREE,
+};
+
+enum expr_op {
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MIN,
+	OP_MAX,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+	OP_EQ,
+	OP_NE,
+	OP_NEG,
+	OP_ABS,
+	OP_SQRT,
+	OP_FLOOR,
+	OP_SELECT, // a != 0 ? b : c
+	OP_MIX, // a + (b - a) * c
+};
+
+struct expr_insn {
+	uint8_t op, dst, a, b, c;
+};
+
+struct expr {
+	struct expr_insn insns[EXPR_MAX_INSNS];
+	int ninsns;
+	uint8_t out[3];
+	int nconsts;
+	uint8_t const_regs[EXPR_MAX_REGS];
+	float const_values[EXPR_MAX_REGS];
+};
+
+typedef float expr_regs[EXPR_MAX_REGS][EXPR_BLOCK];
+
+// What every kernel computes for one pixel. The SIMD versions give the same
+// results, including for NaN, so min() and max() aren't fminf() and fmaxf().
+static inline float eval_op(enum expr_op op, float a, float b, float c) {
+	switch (op) {
+	case OP_ADD: return a + b;
+	case OP_SUB: return a - b;
+	case OP_MUL: return a * b;
+	case OP_DIV: return a / b;
+	case OP_MIN: return a < b ? a : b;
+	case OP_MAX: return a > b ? a : b;
+	case OP_LT: return a < b ? 1 : 0;
+	case OP_LE: return a <= b ? 1 : 0;
+	case OP_GT: return a > b ? 1 : 0;
+	case OP_GE: return a >= b ? 1 : 0;
+	case OP_EQ: return a == b ? 1 : 0;
+	case OP_NE: return a != b ? 1 : 0;
+	case OP_NEG: return -a;
+	case OP_ABS: return fabsf(a);
+	case OP_SQRT: return sqrtf(a);
+	case OP_FLOOR: return floorf(a);
+	case OP_SELECT: return a != 0 ? b : c;
+	case OP_MIX: return a + (b - a) * c;
+	}
+	abort();
+}
+
+static inline uint32_t pack_channel(float v) {
+	v = v < 255 ? v : 255;
+	v = v > 0 ? v : 0;
+	return lrintf(v);
+}
+
+static void unpack_scalar(expr_regs regs, uint32_t *px, int start, int n) {
+	for (int i = start; i < n; ++i) {
+		regs[REG_R][i] = (px[i] >> 16) & 0xff;
+		regs[REG_G][i] = (px[i] >> 8) & 0xff;
+		regs[REG_B][i] = px[i] & 0xff;
+	}
+}
+
+static void pack_scalar(uint32_t *px, expr_regs regs, uint8_t out[3],
+		int start, int n) {
+	for (int i = start; i < n; ++i) {
+		px[i] = (px[i] & 0xff000000) |
+			pack_channel(regs[out[0]][i]) << 16 |
+			pack_channel(regs[out[1]][i]) << 8 |
+			pack_channel(regs[out[2]][i]);
+	}
+}
+
+// A loop per operation, so the compiler can take the switch out of it
+#define SCALAR_CASE(op) \
+	case op: \
+		for (int j = 0; j < EXPR_BLOCK; ++j) { \
+			d[j] = eval_op(op, a[j], b[j], c[j]); \
+		} \
+		break
+
+static void run_block_scalar(struct expr *expr, expr_regs regs,
+		uint32_t *px, int n) {
+	unpack_scalar(regs, px, 0, n);
+	for (int i = 0; i < expr->ninsns; ++i) {
+		struct expr_insn *insn = &expr->insns[i];
+		float *d = regs[insn->dst], *a = regs[insn->a];
+		float *b = regs[insn->b], *c = regs[insn->c];
+		switch (insn->op) {
+		SCALAR_CASE(OP_ADD);
+		SCALAR_CASE(OP_SUB);
+		SCALAR_CASE(OP_MUL);
+		SCALAR_CASE(OP_DIV);
+		SCALAR_CASE(OP_MIN);
+		SCALAR_CASE(OP_MAX);
+		SCALAR_CASE(OP_LT);
+		SCALAR_CASE(OP_LE);
+		SCALAR_CASE(OP_GT);
+		SCALAR_CASE(OP_GE);
+		SCALAR_CASE(OP_EQ);
+		SCALAR_CASE(OP_NE);
+		SCALAR_CASE(OP_NEG);
+		SCALAR_CASE(OP_ABS);
+		SCALAR_CASE(OP_SQRT);
+		SCALAR_CASE(OP_FLOOR);
+		SCALAR_CASE(OP_SELECT);
+		SCALAR_CASE(OP_MIX);
+		}
+	}
+	pack_scalar(px, regs, expr->out, 0, n);
+}
+
+#ifdef CPU_X86_SIMD
+
+// Operands an instruction doesn't use are loaded anyway, and optimized out
+#define SSE2_LOOP(result) \
+	for (int j = 0; j < EXPR_BLOCK; j += 4) { \
+		__m128 va = _mm_load_ps(a + j), vb = _mm_load_ps(b + j); \
+		__m128 vc = _mm_load_ps(c + j); \
+		(void)vb; (void)vc; \
+		_mm_store_ps(d + j, (result)); \
+	} \
+	break
+
+#define SSE2_CMP(cmp) SSE2_LOOP(_mm_and_ps(cmp(va, vb), one))
+
+TARGET_SSE2 static void run_block_sse2(struct expr *expr, expr_regs regs,
+		uint32_t *px, int n) {
+	__m128i mask = _mm_set1_epi32(0xff);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((__m128i *)(px + i));
+		_mm_store_ps(regs[REG_R] + i, _mm_cvtepi32_ps(
+				_mm_and_si128(_mm_srli_epi32(v, 16), mask)));
+		_mm_store_ps(regs[REG_G] + i, _mm_cvtepi32_ps(
+				_mm_and_si128(_mm_srli_epi32(v, 8), mask)));
+		_mm_store_ps(regs[REG_B] + i, _mm_cvtepi32_ps(_mm_and_si128(v, mask)));
+	}
+	unpack_scalar(regs, px, i, n);
+
+	__m128 one = _mm_set1_ps(1), zero = _mm_setzero_ps();
+	__m128 sign = _mm_set1_ps(-0.0f), big = _mm_set1_ps(8388608);
+	for (int k = 0; k < expr->ninsns; ++k) {
+		struct expr_insn *insn = &expr->insns[k];
+		float *d = regs[insn->dst], *a = regs[insn->a];
+		float *b = regs[insn->b], *c = regs[insn->c];
+		switch (insn->op) {
+		case OP_ADD: SSE2_LOOP(_mm_add_ps(va, vb));
+		case OP_SUB: SSE2_LOOP(_mm_sub_ps(va, vb));
+		case OP_MUL: SSE2_LOOP(_mm_mul_ps(va, vb));
+		case OP_DIV: SSE2_LOOP(_mm_div_ps(va, vb));
+		case OP_MIN: SSE2_LOOP(_mm_min_ps(va, vb));
+		case OP_MAX: SSE2_LOOP(_mm_max_ps(va, vb));
+		case OP_LT: SSE2_CMP(_mm_cmplt_ps);
+		case OP_LE: SSE2_CMP(_mm_cmple_ps);
+		case OP_GT: SSE2_CMP(_mm_cmpgt_ps);
+		case OP_GE: SSE2_CMP(_mm_cmpge_ps);
+		case OP_EQ: SSE2_CMP(_mm_cmpeq_ps);
+		case OP_NE: SSE2_CMP(_mm_cmpneq_ps);
+		case OP_NEG: SSE2_LOOP(_mm_xor_ps(va, sign));
+		case OP_ABS: SSE2_LOOP(_mm_andnot_ps(sign, va));
+		case OP_SQRT: SSE2_LOOP(_mm_sqrt_ps(va));
+		case OP_FLOOR: {
+			// Truncate, and step down where that rounded up. Values this big
+			// are whole already, and might not fit in an int.
+			for (int j = 0; j < EXPR_BLOCK; j += 4) {
+				__m128 va = _mm_load_ps(a + j);
+				__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(va));
+				t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, va), one));
+				t = _mm_or_ps(t, _mm_and_ps(va, sign)); // floor(-0) is -0
+				__m128 small = _mm_cmplt_ps(_mm_andnot_ps(sign, va), big);
+				_mm_store_ps(d + j, _mm_or_ps(_mm_and_ps(small, t),
+						_mm_andnot_ps(small, va)));
+			}
+			break;
+		}
+		case OP_SELECT: {
+			for (int j = 0; j < EXPR_BLOCK; j += 4) {
+				__m128 m = _mm_cmpneq_ps(_mm_load_ps(a + j), zero);
+				_mm_store_ps(d + j, _mm_or_ps(_mm_and_ps(m, _mm_load_ps(b + j)),
+						_mm_andnot_ps(m, _mm_load_ps(c + j))));
+			}
+			break;
+		}
+		case OP_MIX: SSE2_LOOP(_mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), vc)));
+		}
+	}
+
+	__m128 max = _mm_set1_ps(255);
+	__m128i alpha = _mm_set1_epi32(0xff000000);
+	i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i r = _mm_cvtps_epi32(_mm_max_ps(
+				_mm_min_ps(_mm_load_ps(regs[expr->out[0]] + i), max), zero));
+		__m128i g = _mm_cvtps_epi32(_mm_max_ps(
+				_mm_min_ps(_mm_load_ps(regs[expr->out[1]] + i), max), zero));
+		__m128i b = _mm_cvtps_epi32(_mm_max_ps(
+				_mm_min_ps(_mm_load_ps(regs[expr->out[2]] + i), max), zero));
+		__m128i v = _mm_and_si128(_mm_loadu_si128((__m128i *)(px + i)), alpha);
+		v = _mm_or_si128(v, _mm_or_si128(_mm_slli_epi32(r, 16),
+				_mm_or_si128(_mm_slli_epi32(g, 8), b)));
+		_mm_storeu_si128((__m128i *)(px + i), v);
+	}
+	pack_scalar(px, regs, expr->out, i, n);
+}
+
+#define AVX2_LOOP(result) \
+	for (int j = 0; j < EXPR_BLOCK; j += 8) { \
+		__m256 va = _mm256_load_ps(a + j), vb = _mm256_load_ps(b + j); \
+		__m256 vc = _mm256_load_ps(c + j); \
+		(void)vb; (void)vc; \
+		_mm256_store_ps(d + j, (result)); \
+	} \
+	break
+
+#define AVX2_CMP(pred) AVX2_LOOP(_mm256_and_ps(_mm256_cmp_ps(va, vb, pred), one))
+
+TARGET_AVX2 static void run_block_avx2(struct expr *expr, expr_regs regs,
+		uint32_t *px, int n) {
+	__m256i mask = _mm256_set1_epi32(0xff);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((__m256i *)(px + i));
+		_mm256_store_ps(regs[REG_R] + i, _mm256_cvtepi32_ps(
+				_mm256_and_si256(_mm256_srli_epi32(v, 16), mask)));
+		_mm256_store_ps(regs[REG_G] + i, _mm256_cvtepi32_ps(
+				_mm256_and_si256(_mm256_srli_epi32(v, 8), mask)));
+		_mm256_store_ps(regs[REG_B] + i, _mm256_cvtepi32_ps(
+				_mm256_and_si256(v, mask)));
+	}
+	unpack_scalar(regs, px, i, n);
+
+	__m256 one = _mm256_set1_ps(1), zero = _mm256_setzero_ps();
+	__m256 sign = _mm256_set1_ps(-0.0f);
+	for (int k = 0; k < expr->ninsns; ++k) {
+		struct expr_insn *insn = &expr->insns[k];
+		float *d = regs[insn->dst], *a = regs[insn->a];
+		float *b = regs[insn->b], *c = regs[insn->c];
+		switch (insn->op) {
+		case OP_ADD: AVX2_LOOP(_mm256_add_ps(va, vb));
+		case OP_SUB: AVX2_LOOP(_mm256_sub_ps(va, vb));
+		case OP_MUL: AVX2_LOOP(_mm256_mul_ps(va, vb));
+		case OP_DIV: AVX2_LOOP(_mm256_div_ps(va, vb));
+		case OP_MIN: AVX2_LOOP(_mm256_min_ps(va, vb));
+		case OP_MAX: AVX2_LOOP(_mm256_max_ps(va, vb));
+		case OP_LT: AVX2_CMP(_CMP_LT_OQ);
+		case OP_LE: AVX2_CMP(_CMP_LE_OQ);
+		case OP_GT: AVX2_CMP(_CMP_GT_OQ);
+		case OP_GE: AVX2_CMP(_CMP_GE_OQ);
+		case OP_EQ: AVX2_CMP(_CMP_EQ_OQ);
+		case OP_NE: AVX2_CMP(_CMP_NEQ_UQ);
+		case OP_NEG: AVX2_LOOP(_mm256_xor_ps(va, sign));
+		case OP_ABS: AVX2_LOOP(_mm256_andnot_ps(sign, va));
+		case OP_SQRT: AVX2_LOOP(_mm256_sqrt_ps(va));
+		case OP_FLOOR: AVX2_LOOP(_mm256_floor_ps(va));
+		case OP_SELECT: AVX2_LOOP(_mm256_blendv_ps(vc, vb,
+				_mm256_cmp_ps(va, zero, _CMP_NEQ_UQ)));
+		case OP_MIX: AVX2_LOOP(_mm256_add_ps(va,
+				_mm256_mul_ps(_mm256_sub_ps(vb, va), vc)));
+		}
+	}
+
+	__m256 max = _mm256_set1_ps(255);
+	__m256i alpha = _mm256_set1_epi32(0xff000000);
+	i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i r = _mm256_cvtps_epi32(_mm256_max_ps(
+				_mm256_min_ps(_mm256_load_ps(regs[expr->out[0]] + i), max), zero));
+		__m256i g = _mm256_cvtps_epi32(_mm256_max_ps(
+				_mm256_min_ps(_mm256_load_ps(regs[expr->out[1]] + i), max), zero));
+		__m256i b = _mm256_cvtps_epi32(_mm256_max_ps(
+				_mm256_min_ps(_mm256_load_ps(regs[expr->out[2]] + i), max), zero));
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256((__m256i *)(px + i)), alpha);
+		v = _mm256_or_si256(v, _mm256_or_si256(_mm256_slli_epi32(r, 16),
+				_mm256_or_si256(_mm256_slli_epi32(g, 8), b)));
+		_mm256_storeu_si256((__m256i *)(px + i), v);
+	}
+	pack_scalar(px, regs, expr->out, i, n);
+}
+
+#endif
+
+void expr_run_rows(struct expr *expr, uint32_t *rows, int stride,
+		int y0, int y1, int width, int height) {
+	void (*run_block)(struct expr *expr, expr_regs regs, uint32_t *px, int n) =
+		run_block_scalar;
+#ifdef CPU_X86_SIMD
+	switch (cpu_level()) {
+	case CPU_LEVEL_AVX2:
+		run_block = run_block_avx2;
+		break;
+	case CPU_LEVEL_SSE2:
+		run_block = run_block_sse2;
+		break;
+	case CPU_LEVEL_SCALAR:
+		break;
+	}
+#endif
+
+	// Lanes past the end of the row are computed too, and ignored
+	_Alignas(32) expr_regs regs;
+	memset(regs, 0, REG_FIRST_FREE * sizeof(*regs));
+	for (int i = 0; i < EXPR_BLOCK; ++i) {
+		regs[REG_W][i] = width;
+		regs[REG_H][i] = height;
+	}
+	for (int k = 0; k < expr->nconsts; ++k) {
+		for (int i = 0; i < EXPR_BLOCK; ++i) {
+			regs[expr->const_regs[k]][i] = expr->const_values[k];
+		}
+	}
+
+	for (int y = y0; y < y1; ++y) {
+		uint32_t *row = rows + (size_t)(y - y0) * stride;
+		for (int i = 0; i < EXPR_BLOCK; ++i) {
+			regs[REG_Y][i] = y;
+		}
+		for (int x = 0; x < width; x += EXPR_BLOCK) {
+			for (int i = 0; i < EXPR_BLOCK; ++i) {
+				regs[REG_X][i] = x + i;
+			}
+			int n = width - x < EXPR_BLOCK ? width - x : EXPR_BLOCK;
+			run_block(expr, regs, row + x, n);
+		}
+	}
+}
+
+// Values while parsing are either constants, which get folded, or the
+// register they're in
+struct value {
+	bool is_const;
+	float constant;
+	int reg;
+};
+
+struct parser {
+	const char *pos;
+	struct expr *expr;
+	bool used[EXPR_MAX_REGS];
+	const char *error;
+	const char *error_pos;
+};
+
+static void parse_error(struct parser *p, const char *error) {
+	if (p->error == NULL) {
+		p->error = error;
+		p->error_pos = p->pos;
+	}
+}
+
+static void skip_space(struct parser *p) {
+	while (isspace((unsigned char)*p->pos)) {
+		p->pos += 1;
+	}
+}
+
+static bool accept(struct parser *p, const char *token) {
+	skip_space(p);
+	size_t len = strlen(token);
+	if (strncmp(p->pos, token, len) != 0) {
+		return false;
+	}
+	p->pos += len;
+	return true;
+}
+
+static void expect(struct parser *p, const char *token, const char *error) {
+	if (!accept(p, token)) {
+		parse_error(p, error);
+	}
+}
+
+static int alloc_reg(struct parser *p) {
+	for (int reg = REG_FIRST_FREE; reg < EXPR_MAX_REGS; ++reg) {
+		if (!p->used[reg]) {
+			p->used[reg] = true;
+			return reg;
+		}
+	}
+	parse_error(p, "expression is too complex");
+	return REG_R;
+}
+
+// Constant registers stay in use until the end
+static void free_value(struct parser *p, struct value v) {
+	if (v.is_const || v.reg < REG_FIRST_FREE) {
+		return;
+	}
+	for (int k = 0; k < p->expr->nconsts; ++k) {
+		if (p->expr->const_regs[k] == v.reg) {
+			return;
+		}
+	}
+	p->used[v.reg] = false;
+}
+
+static struct value constant(float value) {
+	return (struct value){ .is_const = true, .constant = value };
+}
+
+// Once there's an error, nothing more is emitted, so the error can't lead
+// to writing past the instructions or constants
+static int value_reg(struct parser *p, struct value v) {
+	if (p->error != NULL) {
+		return REG_R;
+	} else if (!v.is_const) {
+		return v.reg;
+	}
+
+	struct expr *expr = p->expr;
+	for (int k = 0; k < expr->nconsts; ++k) {
+		if (memcmp(&expr->const_values[k], &v.constant, sizeof(float)) == 0) {
+			return expr->const_regs[k];
+		}
+	}
+	if (expr->nconsts >= EXPR_MAX_REGS) {
+		parse_error(p, "expression is too complex");
+		return REG_R;
+	}
+	int reg = alloc_reg(p);
+	if (p->error != NULL) {
+		return REG_R;
+	}
+	expr->const_regs[expr->nconsts] = reg;
+	expr->const_values[expr->nconsts] = v.constant;
+	expr->nconsts += 1;
+	return reg;
+}
+
+static struct value emit(struct parser *p, enum expr_op op,
+		struct value a, struct value b, struct value c) {
+	if (p->error != NULL) {
+		return constant(0);
+	} else if (a.is_const && b.is_const && c.is_const) {
+		return (struct value){
+			.is_const = true,
+			.constant = eval_op(op, a.constant, b.constant, c.constant),
+		};
+	}
+
+	struct expr *expr = p->expr;
+	if (expr->ninsns >= EXPR_MAX_INSNS) {
+		parse_error(p, "expression is too complex");
+		return constant(0);
+	}
+	struct expr_insn *insn = &expr->insns[expr->ninsns];
+	insn->op = op;
+	insn->a = value_reg(p, a);
+	insn->b = value_reg(p, b);
+	insn->c = value_reg(p, c);
+	// Instructions work lane by lane, so the result can replace an operand
+	free_value(p, a);
+	free_value(p, b);
+	free_value(p, c);
+	insn->dst = alloc_reg(p);
+	if (p->error != NULL) {
+		return constant(0);
+	}
+	expr->ninsns += 1;
+	return (struct value){ .reg = insn->dst };
+}
+
+static struct value emit1(struct parser *p, enum expr_op op, struct value a) {
+	return emit(p, op, a, constant(0), constant(0));
+}
+
+static struct value emit2(struct parser *p, enum expr_op op,
+		struct value a, struct value b) {
+	return emit(p, op, a, b, constant(0));
+}
+
+static struct value parse_conditional(struct parser *p);
+
+static const struct {
+	const char *name;
+	int reg;
+} variables[] = {
+	{ "r", REG_R },
+	{ "g", REG_G },
+	{ "b", REG_B },
+	{ "x", REG_X },
+	{ "y", REG_Y },
+	{ "w", REG_W },
+	{ "h", REG_H },
+};
+
+static struct value parse_call(struct parser *p, const char *name, size_t len) {
+	struct value args[3];
+	int nargs = 0;
+	if (!accept(p, ")")) {
+		do {
+			if (nargs == 3) {
+				parse_error(p, "too many arguments");
+				return constant(0);
+			}
+			args[nargs++] = parse_conditional(p);
+		} while (p->error == NULL && accept(p, ","));
+		expect(p, ")", "expected ')'");
+	}
+
+	static const struct {
+		const char *name;
+		int nargs;
+		enum expr_op op;
+	} functions[] = {
+		{ "min", 2, OP_MIN },
+		{ "max", 2, OP_MAX },
+		{ "abs", 1, OP_ABS },
+		{ "sqrt", 1, OP_SQRT },
+		{ "floor", 1, OP_FLOOR },
+		{ "mix", 3, OP_MIX },
+		{ "clamp", 3, OP_MIN },
+	};
+	for (size_t i = 0; i < sizeof(functions) / sizeof(*functions); ++i) {
+		if (strlen(functions[i].name) != len ||
+				strncmp(functions[i].name, name, len) != 0) {
+			continue;
+		}
+		if (nargs != functions[i].nargs) {
+			p->pos = name;
+			parse_error(p, "wrong number of arguments");
+			return constant(0);
+		}
+		if (strcmp(functions[i].name, "clamp") == 0) {
+			return emit2(p, OP_MIN, emit2(p, OP_MAX, args[0], args[1]), args[2]);
+		}
+		return emit(p, functions[i].op, args[0],
+				nargs > 1 ? args[1] : constant(0),
+				nargs > 2 ? args[2] : constant(0));
+	}
+
+	p->pos = name;
+	parse_error(p, "unknown function");
+	return constant(0);
+}
+
+static struct value parse_primary(struct parser *p) {
+	skip_space(p);
+	const char *start = p->pos;
+
+	if (isdigit((unsigned char)*start) || *start == '.') {
+		char *end;
+		double value = strtod(start, &end);
+		if (end == start) {
+			parse_error(p, "invalid number");
+			return constant(0);
+		}
+		p->pos = end;
+		return constant(value);
+	}
+
+	if (isalpha((unsigned char)*start)) {
+		size_t len = 0;
+		while (isalnum((unsigned char)start[len]) || start[len] == '_') {
+			len += 1;
+		}
+		p->pos += len;
+		if (accept(p, "(")) {
+			return parse_call(p, start, len);
+		}
+		for (size_t i = 0; i < sizeof(variables) / sizeof(*variables); ++i) {
+			if (strlen(variables[i].name) == len &&
+					strncmp(variables[i].name, start, len) == 0) {
+				return (struct value){ .reg = variables[i].reg };
+			}
+		}
+		p->pos = start;
+		parse_error(p, "unknown variable");
+		return constant(0);
+	}
+
+	if (accept(p, "(")) {
+		struct value v = parse_conditional(p);
+		expect(p, ")", "expected ')'");
+		return v;
+	}
+
+	parse_error(p, "expected a number, variable or '('");
+	return constant(0);
+}
+
+static struct value parse_unary(struct parser *p) {
+	if (accept(p, "-")) {
+		return emit1(p, OP_NEG, parse_unary(p));
+	} else if (accept(p, "+")) {
+		return parse_unary(p);
+	}
+	return parse_primary(p);
+}
+
+static struct value parse_product(struct parser *p) {
+	struct value v = parse_unary(p);
+	while (p->error == NULL) {
+		if (accept(p, "*")) {
+			v = emit2(p, OP_MUL, v, parse_unary(p));
+		} else if (accept(p, "/")) {
+			v = emit2(p, OP_DIV, v, parse_unary(p));
+		} else {
+			break;
+		}
+	}
+	return v;
+}
+
+static struct value parse_sum(struct parser *p) {
+	struct value v = parse_product(p);
+	while (p->error == NULL) {
+		if (accept(p, "+")) {
+			v = emit2(p, OP_ADD, v, parse_product(p));
+		} else if (accept(p, "-")) {
+			v = emit2(p, OP_SUB, v, parse_product(p));
+		} else {
+			break;
+		}
+	}
+	return v;
+}
+
+static struct value parse_comparison(struct parser *p) {
+	// Longer operators first, so "<=" isn't taken for "<"
+	static const struct {
+		const char *token;
+		enum expr_op op;
+	} operators[] = {
+		{ "<=", OP_LE },
+		{ ">=", OP_GE },
+		{ "==", OP_EQ },
+		{ "!=", OP_NE },
+		{ "<", OP_LT },
+		{ ">", OP_GT },
+	};
+
+	struct value v = parse_sum(p);
+	bool found = true;
+	while (found && p->error == NULL) {
+		found = false;
+		for (size_t i = 0; i < sizeof(operators) / sizeof(*operators); ++i) {
+			if (accept(p, operators[i].token)) {
+				v = emit2(p, operators[i].op, v, parse_sum(p));
+				found = true;
+				break;
+			}
+		}
+	}
+	return v;
+}
+
+static struct value parse_conditional(struct parser *p) {
+	struct value cond = parse_comparison(p);
+	if (!accept(p, "?")) {
+		return cond;
+	}
+	struct value a = parse_conditional(p);
+	expect(p, ":", "expected ':'");
+	struct value b = parse_conditional(p);
+	return emit(p, OP_SELECT, cond, a, b);
+}
+
+struct expr *expr_parse(const char *source) {
+	struct expr *expr = calloc(1, sizeof(*expr));
+	if (expr == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate expression");
+		return NULL;
+	}
+
+	struct parser p = {
+		.pos = source,
+		.expr = expr,
+	};
+	for (int reg = 0; reg < REG_FIRST_FREE; ++reg) {
+		p.used[reg] = true;
+	}
+
+	struct value out[3];
+	int nout = 0;
+	do {
+		if (nout == 3) {
+			parse_error(&p, "expected one or three channels");
+			break;
+		}
+		out[nout++] = parse_conditional(&p);
+	} while (p.error == NULL && accept(&p, ","));
+	skip_space(&p);
+	if (*p.pos != '\0') {
+		parse_error(&p, "unexpected character");
+	}
+	if (nout == 2) {
+		parse_error(&p, "expected one or three channels");
+	}
+
+	for (int i = 0; i < nout && p.error == NULL; ++i) {
+		expr->out[i] = value_reg(&p, out[i]);
+	}
+	if (nout == 1) {
+		expr->out[1] = expr->out[2] = expr->out[0];
+	}
+
+	if (p.error != NULL) {
+		swaylock_log(LOG_ERROR, "Invalid expression '%s': %s at column %d",
+				source, p.error, (int)(p.error_pos - source) + 1);
+		free(expr);
+		return NULL;
+	}
+	return expr;
+}
+
+void expr_destroy(struct expr *expr) {
+	free(expr);
+}
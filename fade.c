@@ -1,12 +1,16 @@
+#include "cpu.h"
 #include "fade.h"
 #include "pool-buffer.h"
 #include "swaylock.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <omp.h>
 #include <stdalign.h>
 #include <string.h>
 
+#ifdef CPU_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #ifdef FADE_PROFILE
 #include <time.h>
 double get_time() {
@@ -16,20 +20,50 @@ double get_time() {
 }
 #endif
 
-#if defined(USE_SSE) && defined(__SSE2__)
-#define set_alpha set_alpha_sse
+static void set_alpha_slow(uint32_t *orig, struct pool_buffer *buf, float alpha) {
+	for (size_t y = 0; y < buf->height; ++y) {
+		for (size_t x = 0; x < buf->width; ++x) {
+			size_t index = y * buf->width + x;
+			uint32_t srcpix = orig[index];
+			int srcr = (srcpix & 0x00ff0000u) >> 16;
+			int srcg = (srcpix & 0x0000ff00u) >> 8;
+			int srcb = (srcpix & 0x000000ffu);
 
-#include <immintrin.h>
+			((uint32_t *)buf->data)[index] = 0 |
+				(uint32_t)(alpha * 255) << 24 |
+				(uint32_t)(srcr * alpha) << 16 |
+				(uint32_t)(srcg * alpha) << 8 |
+				(uint32_t)(srcb * alpha);
+		}
+	}
+}
+
+// Blends 'from' into 'to' with 8 bits of weight, which is exact at both ends
+static void cross_fade_bytes(uint8_t *from, uint8_t *to, uint8_t *dest,
+		size_t start, size_t end, int weight) {
+	for (size_t i = start; i < end; ++i) {
+		dest[i] = (to[i] * weight + from[i] * (256 - weight)) >> 8;
+	}
+}
+
+static void cross_fade_slow(uint32_t *from, uint32_t *to, struct pool_buffer *buf, float alpha) {
+	size_t size = (size_t)buf->width * (size_t)buf->height * 4;
+	cross_fade_bytes((uint8_t *)from, (uint8_t *)to, (uint8_t *)buf->data,
+			0, size, (int)(alpha * 256));
+}
+
+#ifdef CPU_X86_SIMD
 
-static void set_alpha_sse(uint32_t *orig, struct pool_buffer *buf, float alpha) {
+static int alpha_to_factor(float alpha) {
 	int alpha_factor = (int)(alpha * (1 << 16));
 	if (alpha_factor != 0)
 		alpha_factor -= 1;
+	return alpha_factor;
+}
 
-	__m128i alpha_vec = _mm_set_epi16(
-			alpha_factor, alpha_factor, alpha_factor, alpha_factor,
-			alpha_factor, alpha_factor, alpha_factor, alpha_factor);
-	__m128i dummy_vec = _mm_set_epi16(0, 0, 0, 0, 0, 0, 0, 0);
+TARGET_SSE2 static void set_alpha_sse(uint32_t *orig, struct pool_buffer *buf, float alpha) {
+	__m128i alpha_vec = _mm_set1_epi16(alpha_to_factor(alpha));
+	__m128i dummy_vec = _mm_setzero_si128();
 
 	uint8_t *orig_bytes = (uint8_t *)orig;
 	uint8_t *dest_bytes = (uint8_t *)buf->data;
@@ -39,7 +73,7 @@ static void set_alpha_sse(uint32_t *orig, struct pool_buffer *buf, float alpha)
 		size_t index = i * 8;
 
 		// Read data into SSE register, where each byte is an u16
-		__m128i argb_vec = _mm_loadu_si64(orig_bytes + index);
+		__m128i argb_vec = _mm_loadl_epi64((__m128i *)(orig_bytes + index));
 		argb_vec = _mm_unpacklo_epi8(argb_vec, dummy_vec);
 
 		// Multiply the 8 argb u16s with the 8 alpha u16s
@@ -47,32 +81,169 @@ static void set_alpha_sse(uint32_t *orig, struct pool_buffer *buf, float alpha)
 
 		// Put the low bytes of each argb u16 into the destination buffer
 		argb_vec = _mm_packus_epi16(argb_vec, dummy_vec);
-		_mm_storeu_si64(dest_bytes + index, argb_vec);
+		_mm_storel_epi64((__m128i *)(dest_bytes + index), argb_vec);
 	}
 }
 
-#else
-#define set_alpha set_alpha_slow
+// Same arithmetic as set_alpha_sse, 16 bytes at a time.
+TARGET_AVX2 static void set_alpha_avx2(uint32_t *orig, struct pool_buffer *buf, float alpha) {
+	int alpha_factor = alpha_to_factor(alpha);
+	__m256i alpha_vec = _mm256_set1_epi16(alpha_factor);
 
-static void set_alpha_slow(uint32_t *orig, struct pool_buffer *buf, float alpha) {
-	for (size_t y = 0; y < buf->height; ++y) {
-		for (size_t x = 0; x < buf->width; ++x) {
-			size_t index = y * buf->width + x;
-			uint32_t srcpix = orig[index];
-			int srcr = (srcpix & 0x00ff0000u) >> 16;
-			int srcg = (srcpix & 0x0000ff00u) >> 8;
-			int srcb = (srcpix & 0x000000ffu);
+	uint8_t *orig_bytes = (uint8_t *)orig;
+	uint8_t *dest_bytes = (uint8_t *)buf->data;
+	size_t length = ((size_t)buf->width * (size_t)buf->height * 4) / 8;
 
-			((uint32_t *)buf->data)[index] = 0 |
-				(uint32_t)(alpha * 255) << 24 |
-				(uint32_t)(srcr * alpha) << 16 |
-				(uint32_t)(srcg * alpha) << 8 |
-				(uint32_t)(srcb * alpha);
+	size_t i = 0;
+	for (; i + 2 <= length; i += 2) {
+		size_t index = i * 8;
+		__m256i argb_vec = _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((__m128i *)(orig_bytes + index)));
+		argb_vec = _mm256_mulhi_epu16(argb_vec, alpha_vec);
+		__m128i packed = _mm_packus_epi16(
+				_mm256_castsi256_si128(argb_vec),
+				_mm256_extracti128_si256(argb_vec, 1));
+		_mm_storeu_si128((__m128i *)(dest_bytes + index), packed);
+	}
+	if (i < length) {
+		size_t index = i * 8;
+		__m128i argb_vec = _mm_cvtepu8_epi16(
+				_mm_loadl_epi64((__m128i *)(orig_bytes + index)));
+		argb_vec = _mm_mulhi_epu16(argb_vec, _mm_set1_epi16(alpha_factor));
+		argb_vec = _mm_packus_epi16(argb_vec, argb_vec);
+		_mm_storel_epi64((__m128i *)(dest_bytes + index), argb_vec);
+	}
+}
+
+TARGET_SSE2 static void cross_fade_sse(uint32_t *from, uint32_t *to, struct pool_buffer *buf, float alpha) {
+	int weight = (int)(alpha * 256);
+	__m128i to_weight = _mm_set1_epi16(weight);
+	__m128i from_weight = _mm_set1_epi16(256 - weight);
+	__m128i dummy_vec = _mm_setzero_si128();
+
+	uint8_t *from_bytes = (uint8_t *)from;
+	uint8_t *to_bytes = (uint8_t *)to;
+	uint8_t *dest_bytes = (uint8_t *)buf->data;
+	size_t size = (size_t)buf->width * (size_t)buf->height * 4;
+
+	size_t index = 0;
+	for (; index + 8 <= size; index += 8) {
+		__m128i to_vec = _mm_unpacklo_epi8(
+				_mm_loadl_epi64((__m128i *)(to_bytes + index)), dummy_vec);
+		__m128i from_vec = _mm_unpacklo_epi8(
+				_mm_loadl_epi64((__m128i *)(from_bytes + index)), dummy_vec);
+
+		// Neither product nor their sum can overflow an u16
+		__m128i sum = _mm_add_epi16(_mm_mullo_epi16(to_vec, to_weight),
+				_mm_mullo_epi16(from_vec, from_weight));
+		sum = _mm_srli_epi16(sum, 8);
+		_mm_storel_epi64((__m128i *)(dest_bytes + index),
+				_mm_packus_epi16(sum, dummy_vec));
+	}
+	cross_fade_bytes(from_bytes, to_bytes, dest_bytes, index, size, weight);
+}
+
+// Same arithmetic as cross_fade_sse, 16 bytes at a time.
+TARGET_AVX2 static void cross_fade_avx2(uint32_t *from, uint32_t *to, struct pool_buffer *buf, float alpha) {
+	int weight = (int)(alpha * 256);
+	__m256i to_weight = _mm256_set1_epi16(weight);
+	__m256i from_weight = _mm256_set1_epi16(256 - weight);
+
+	uint8_t *from_bytes = (uint8_t *)from;
+	uint8_t *to_bytes = (uint8_t *)to;
+	uint8_t *dest_bytes = (uint8_t *)buf->data;
+	size_t size = (size_t)buf->width * (size_t)buf->height * 4;
+
+	size_t index = 0;
+	for (; index + 16 <= size; index += 16) {
+		__m256i to_vec = _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((__m128i *)(to_bytes + index)));
+		__m256i from_vec = _mm256_cvtepu8_epi16(
+				_mm_loadu_si128((__m128i *)(from_bytes + index)));
+		__m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(to_vec, to_weight),
+				_mm256_mullo_epi16(from_vec, from_weight));
+		sum = _mm256_srli_epi16(sum, 8);
+		__m128i packed = _mm_packus_epi16(
+				_mm256_castsi256_si128(sum),
+				_mm256_extracti128_si256(sum, 1));
+		_mm_storeu_si128((__m128i *)(dest_bytes + index), packed);
+	}
+	cross_fade_bytes(from_bytes, to_bytes, dest_bytes, index, size, weight);
+}
+
+#endif
+
+static void (*set_alpha_impl)(uint32_t *orig, struct pool_buffer *buf, float alpha);
+
+static void set_alpha(uint32_t *orig, struct pool_buffer *buf, float alpha) {
+	if (!set_alpha_impl) {
+		set_alpha_impl = set_alpha_slow;
+#ifdef CPU_X86_SIMD
+		switch (cpu_level()) {
+		case CPU_LEVEL_AVX2:
+			set_alpha_impl = set_alpha_avx2;
+			break;
+		case CPU_LEVEL_SSE2:
+			set_alpha_impl = set_alpha_sse;
+			break;
+		case CPU_LEVEL_SCALAR:
+			break;
 		}
+#endif
 	}
+	set_alpha_impl(orig, buf, alpha);
 }
 
+static void (*cross_fade_impl)(uint32_t *from, uint32_t *to, struct pool_buffer *buf, float alpha);
+
+static void cross_fade(uint32_t *from, uint32_t *to, struct pool_buffer *buf, float alpha) {
+	if (!cross_fade_impl) {
+		cross_fade_impl = cross_fade_slow;
+#ifdef CPU_X86_SIMD
+		switch (cpu_level()) {
+		case CPU_LEVEL_AVX2:
+			cross_fade_impl = cross_fade_avx2;
+			break;
+		case CPU_LEVEL_SSE2:
+			cross_fade_impl = cross_fade_sse;
+			break;
+		case CPU_LEVEL_SCALAR:
+			break;
+		}
 #endif
+	}
+	cross_fade_impl(from, to, buf, alpha);
+}
+
+// Fades in from transparent, or from the frame fade_begin_cross() kept
+static void fade_apply(struct swaylock_fade *fade, struct pool_buffer *buffer, float alpha) {
+	if (fade->from_buffer != NULL) {
+		cross_fade(fade->from_buffer, fade->original_buffer, buffer, alpha);
+	} else {
+		set_alpha(fade->original_buffer, buffer, alpha);
+	}
+}
+
+void fade_begin_cross(struct swaylock_fade *fade, struct pool_buffer *buffer,
+		uint32_t duration) {
+	fade_destroy(fade);
+	fade->original_buffer = NULL;
+	fade->from_buffer = NULL;
+	fade->target_time = duration;
+	fade->current_time = 0;
+	fade->old_time = 0;
+	if (!duration) {
+		return;
+	}
+
+	size_t size = (size_t)buffer->width * (size_t)buffer->height * 4;
+	fade->from_buffer = malloc(size);
+	if (fade->from_buffer != NULL) {
+		memcpy(fade->from_buffer, buffer->data, size);
+		fade->from_width = buffer->width;
+		fade->from_height = buffer->height;
+	}
+}
 
 void fade_prepare(struct swaylock_fade *fade, struct pool_buffer *buffer) {
 	if (!fade->target_time) {
@@ -80,11 +251,19 @@ void fade_prepare(struct swaylock_fade *fade, struct pool_buffer *buffer) {
 		return;
 	}
 
+	// The surface may have been resized since the cross-fade began
+	if (fade->from_buffer != NULL && (fade->from_width != buffer->width ||
+			fade->from_height != buffer->height)) {
+		free(fade->from_buffer);
+		fade->from_buffer = NULL;
+	}
+
 	size_t size = (size_t)buffer->width * (size_t)buffer->height * 4;
+	free(fade->original_buffer);
 	fade->original_buffer = malloc(size);
 	memcpy(fade->original_buffer, buffer->data, size);
 
-	set_alpha(fade->original_buffer, buffer, 0);
+	fade_apply(fade, buffer, 0);
 }
 
 void fade_update(struct swaylock_fade *fade, struct pool_buffer *buffer, uint32_t time) {
@@ -109,7 +288,7 @@ void fade_update(struct swaylock_fade *fade, struct pool_buffer *buffer, uint32_
 	double before = get_time();
 #endif
 
-	set_alpha(fade->original_buffer, buffer, alpha);
+	fade_apply(fade, buffer, alpha);
 
 #ifdef FADE_PROFILE
 	double after = get_time();
@@ -125,4 +304,5 @@ bool fade_is_complete(struct swaylock_fade *fade) {
 
 void fade_destroy(struct swaylock_fade *fade) {
 	free(fade->original_buffer);
+	free(fade->from_buffer);
 }
@@ -17,8 +17,16 @@ struct swaylock_surface;
 
 enum background_mode parse_background_mode(const char *mode);
 cairo_surface_t *load_background_image(const char *path);
+// 'create_image' allocates the image the buffer is converted into, usually
+// cairo_image_surface_create
 cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
-		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform);
+		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform,
+		cairo_surface_t *(*create_image)(cairo_format_t format, int width, int height));
+/**
+ * A blurry copy of 'image' which is quick to make, shrunk by 'factor' and
+ * scaled back up.
+ */
+cairo_surface_t *create_background_preview(cairo_surface_t *image, int factor);
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height);
 
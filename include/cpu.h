@@ -0,0 +1,38 @@
+#ifndef _SWAYLOCK_CPU_H
+#define _SWAYLOCK_CPU_H
+
+#include <stdbool.h>
+
+// SIMD kernels are compiled with per-function target attributes and chosen
+// at runtime with cpu_level(), so the rest of swaylock can be built for
+// baseline x86.
+#if defined(USE_SSE) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86_SIMD
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Instruction set levels pixel kernels are implemented for. Each level
+// includes everything below it.
+enum cpu_level {
+	CPU_LEVEL_SCALAR,
+	CPU_LEVEL_SSE2,
+	CPU_LEVEL_AVX2,
+};
+
+/**
+ * The best level both the CPU and the build support, capped by
+ * cpu_set_max_level(). Detection only happens on the first call.
+ */
+enum cpu_level cpu_level(void);
+
+/**
+ * Limit which kernels get picked. Has to be called before any kernel runs,
+ * since callers cache their choice.
+ */
+void cpu_set_max_level(enum cpu_level level);
+
+bool cpu_parse_level(const char *name, enum cpu_level *level);
+const char *cpu_level_name(enum cpu_level level);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _SWAYLOCK_EFFECTS_HELPER_H
+#define _SWAYLOCK_EFFECTS_HELPER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cairo.h"
+
+struct swaylock_args;
+
+/**
+ * Forks the process effects run in when --effects-process is given. Has to
+ * be called before any threads are started, since only the calling thread
+ * survives the fork.
+ */
+bool spawn_effects_helper(struct swaylock_args *args);
+
+/**
+ * Creates an image in shared memory, which can be passed to the helper
+ * without copying it. Falls back to a normal image surface.
+ */
+cairo_surface_t *effects_helper_image_create(cairo_format_t format,
+		int width, int height);
+
+/**
+ * Runs the effects on 'image' in the helper and returns the result, taking
+ * ownership of 'image'. Returns NULL if the effects fail, the helper dies,
+ * or it takes more than 'deadline' ms (if not 0) on this image, in which
+ * case the helper is killed and every later call fails too. Safe to call
+ * from several threads, which then take turns; the deadline starts when
+ * it's this call's turn.
+ */
+cairo_surface_t *effects_helper_run(cairo_surface_t *image, int scale,
+		uint32_t deadline);
+
+#endif
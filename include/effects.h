@@ -5,6 +5,8 @@
 
 #include "cairo.h"
 
+struct expr;
+
 struct swaylock_effect_screen_pos {
 	float pos;
 	bool is_percent;
@@ -15,10 +17,22 @@ struct swaylock_effect {
 		struct {
 			int radius, times;
 		} blur;
+		struct {
+			int radius;
+		} blur_fast;
+		struct {
+			double sigma;
+		} blur_gaussian;
 		struct {
 			int factor;
 		} pixelate;
-		double scale;
+		struct {
+			double factor;
+			enum {
+				EFFECT_SCALE_FILTER_SMOOTH,
+				EFFECT_SCALE_FILTER_NEAREST,
+			} filter;
+		} scale;
 		struct {
 			double base;
 			double factor;
@@ -42,23 +56,71 @@ struct swaylock_effect {
 			char *imgpath;
 		} compose;
 		char *custom;
+		struct {
+			char *source;
+			struct expr *expr;
+		} expr;
 	} e;
 
 	enum {
 		EFFECT_BLUR,
+		EFFECT_BLUR_FAST,
+		EFFECT_BLUR_GAUSSIAN,
 		EFFECT_PIXELATE,
 		EFFECT_SCALE,
 		EFFECT_GREYSCALE,
 		EFFECT_VIGNETTE,
 		EFFECT_COMPOSE,
 		EFFECT_CUSTOM,
+		EFFECT_EXPR,
 	} tag;
 };
 
+/**
+ * Starts compiling the custom effects which are C source files and not
+ * cached yet, in the background. Running the effects waits for it.
+ */
+void swaylock_effects_compile(struct swaylock_effect *effects, int count);
+
+/**
+ * Compiles the custom effects which are C source files and not cached yet,
+ * and waits for them. Returns false if any of them failed.
+ */
+bool swaylock_effects_precompile(struct swaylock_effect *effects, int count);
+
+/**
+ * Lets the planner make changes to the effect chain which are faster but
+ * change the result slightly, like running wide blurs at a lower
+ * resolution. Off by default.
+ */
+void swaylock_effects_set_approximate(bool approximate);
+
+/**
+ * Runs chains of blur, greyscale, vignette and pixelate effects on a planar
+ * copy of the image, instead of band by band on packed pixels. Which is
+ * faster depends on the CPU and the chain. Off by default.
+ */
+void swaylock_effects_set_planar(bool planar);
+
+/**
+ * Makes the buffers effects create their images in come from 'create',
+ * which returns a file descriptor of the given size to map, or -1 to use
+ * normal memory. The effects helper uses it to pass back results without
+ * copying them.
+ */
+void swaylock_effects_set_buffer_fd(int (*create)(size_t size));
+
+/**
+ * Returns the file descriptor behind an image returned by the effects, if
+ * it was made with a buffer from swaylock_effects_set_buffer_fd(), or -1.
+ * The image keeps ownership of it.
+ */
+int swaylock_effects_image_fd(cairo_surface_t *image);
+
 cairo_surface_t *swaylock_effects_run(cairo_surface_t *surface, int scale,
 		struct swaylock_effect *effects, int count);
 
 cairo_surface_t *swaylock_effects_run_timed(cairo_surface_t *surface, int scale,
-		struct swaylock_effect *effects, int count);
+		struct swaylock_effect *effects, int count, bool show_plan);
 
 #endif
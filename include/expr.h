@@ -0,0 +1,29 @@
+#ifndef _SWAYLOCK_EXPR_H
+#define _SWAYLOCK_EXPR_H
+
+#include <stdint.h>
+
+/**
+ * A per-pixel expression effect, such as "r*0.8, g*0.9, b + 10*y/h". It's
+ * either one expression for all three colour channels, or one for each of
+ * red, green and blue, separated by commas.
+ */
+struct expr;
+
+/**
+ * Compiles an expression. Logs what's wrong with it and returns NULL if it
+ * isn't valid.
+ */
+struct expr *expr_parse(const char *source);
+
+/**
+ * Applies the expression to rows [y0, y1) of an image which is 'width' by
+ * 'height' pixels, with 'rows' pointing to row y0 and 'stride' in pixels.
+ * Can be called from several threads at once.
+ */
+void expr_run_rows(struct expr *expr, uint32_t *rows, int stride,
+		int y0, int y1, int width, int height);
+
+void expr_destroy(struct expr *expr);
+
+#endif
@@ -11,9 +11,19 @@ struct swaylock_fade {
 	float target_time;
 	uint32_t old_time;
 	uint32_t *original_buffer;
+	// Set for a cross-fade, which starts from this frame instead of from
+	// transparent
+	uint32_t *from_buffer;
+	uint32_t from_width, from_height;
 };
 
 void fade_prepare(struct swaylock_fade *fade, struct pool_buffer *buffer);
+/**
+ * Makes the next fade_prepare() start a fade of 'duration' ms from what
+ * 'buffer' currently shows to the newly rendered frame.
+ */
+void fade_begin_cross(struct swaylock_fade *fade, struct pool_buffer *buffer,
+		uint32_t duration);
 void fade_update(struct swaylock_fade *fade, struct pool_buffer *buffer, uint32_t time);
 bool fade_is_complete(struct swaylock_fade *fade);
 void fade_destroy(struct swaylock_fade *fade);
@@ -53,6 +53,13 @@ struct swaylock_texts {
 	char *wrong;
 };
 
+// What to show while effects on screenshots are still running
+enum effects_placeholder {
+	EFFECTS_PLACEHOLDER_NONE, // don't lock until effects are done
+	EFFECTS_PLACEHOLDER_COLOR,
+	EFFECTS_PLACEHOLDER_PREVIEW,
+};
+
 struct swaylock_args {
 	struct swaylock_colors colors;
 	struct swaylock_texts texts;
@@ -79,6 +86,12 @@ struct swaylock_args {
 	struct swaylock_effect *effects;
 	int effects_count;
 	bool time_effects;
+	bool effects_plan;
+	enum effects_placeholder effects_placeholder;
+	uint32_t effects_crossfade;
+	bool effects_process;
+	uint32_t effects_deadline;
+	bool precompile_effects;
 	bool indicator;
 	bool clock;
 	char *timestr;
@@ -116,6 +129,10 @@ struct swaylock_state {
 	int render_randnum;
 	int failed_attempts;
 	size_t n_screenshots_done;
+	int screencopies_pending; // effects wait until all screenshots are in
+	struct loop_timer *screencopy_timer; // gives up on screenshots which hang
+	struct wl_list background_effects; // effects running while locked
+	int background_effects_fd; // eventfd, signalled when one is done
 	bool run_display;
 	struct zxdg_output_manager_v1 *zxdg_output_manager;
 };
@@ -127,6 +144,8 @@ struct swaylock_surface {
 		enum wl_output_transform transform;
 		void *data;
 		struct swaylock_image *image;
+		bool effects_pending;
+		cairo_surface_t *placeholder; // shown until effects are done
 	} screencopy;
 	struct swaylock_state *state;
 	struct wl_output *output;
@@ -143,6 +162,7 @@ struct swaylock_surface {
 	struct swaylock_fade fade;
 	int events_pending;
 	bool configured;
+	bool keyboard_focus;
 	bool frame_pending, dirty;
 	uint32_t width, height;
 	uint32_t indicator_width, indicator_height;
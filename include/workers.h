@@ -0,0 +1,64 @@
+#ifndef _SWAYLOCK_WORKERS_H
+#define _SWAYLOCK_WORKERS_H
+#include <stdbool.h>
+
+/**
+ * A pool of threads the effects run their pixel loops on. Threads are
+ * started the first time the pool is used, sleep while there's nothing to
+ * do, and exit on workers_stop().
+ *
+ * Every thread working for the pool has an index below workers_count(),
+ * so work can pick a per-thread buffer with it. A thread outside the pool
+ * which calls into it gets index 0, so only one such thread may use the
+ * pool at a time.
+ */
+
+/**
+ * Runs iterations [start, end) of a loop.
+ */
+typedef void (*workers_range_func)(void *data, int start, int end, int thread);
+
+typedef void (*workers_task_func)(void *data, int thread);
+
+/**
+ * Sets how many threads to use, counting the one calling into the pool.
+ * 0 means as many as the CPU affinity mask and the cgroup CPU quota allow.
+ * Only takes effect when the pool isn't running.
+ */
+void workers_set_threads(int count);
+
+/**
+ * How many threads the pool runs work on.
+ */
+int workers_count(void);
+
+/**
+ * Runs [start, end) across the pool in chunks of 'chunk' iterations, or one
+ * contiguous chunk per thread if 'chunk' is 0, and returns once all of them
+ * are done. The calling thread runs chunks too. Can be called from within
+ * work running on the pool.
+ */
+void workers_parallel_for(int start, int end, int chunk,
+		workers_range_func func, void *data);
+
+/**
+ * Queues 'func' to run on one of the pool's threads. Queued work with a
+ * higher priority runs first, and loops the task runs with
+ * workers_parallel_for() get the same priority, so idle threads help with
+ * the most important task before the others. If the pool has no threads,
+ * the task runs right away on the calling thread.
+ */
+bool workers_submit(workers_task_func func, void *data, int priority);
+
+/**
+ * Waits until every task queued with workers_submit() is done.
+ */
+void workers_wait(void);
+
+/**
+ * Waits for queued tasks and exits all threads. The pool starts again the
+ * next time it's used.
+ */
+void workers_stop(void);
+
+#endif
@@ -4,11 +4,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <poll.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -18,11 +21,15 @@
 #include "background-image.h"
 #include "cairo.h"
 #include "comm.h"
+#include "cpu.h"
+#include "effects-helper.h"
+#include "expr.h"
 #include "log.h"
 #include "loop.h"
 #include "pool-buffer.h"
 #include "seat.h"
 #include "swaylock.h"
+#include "workers.h"
 #include "wlr-input-inhibitor-unstable-v1-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
@@ -239,10 +246,27 @@ static void daemonize_done(void *fdptr) {
 	*fd = -1;
 }
 
+static void screencopy_done(struct swaylock_surface *surface);
+static void forget_background_effects(struct swaylock_surface *surface);
+
 static void destroy_surface(struct swaylock_surface *surface) {
 	swaylock_log(LOG_DEBUG, "Destroy surface for output %s", surface->output_name);
 
 	wl_list_remove(&surface->link);
+	if (surface->screencopy_frame != NULL) {
+		// Don't hold up the other outputs' effects for this screenshot
+		screencopy_done(surface);
+	} else if (surface->screencopy.effects_pending) {
+		// The screenshot was waiting for the other outputs' screenshots
+		// before its effects could start, and nothing else refers to it
+		cairo_surface_destroy(surface->screencopy.image->cairo_surface);
+		free(surface->screencopy.image);
+		surface->screencopy.image = NULL;
+	}
+	forget_background_effects(surface);
+	if (surface->screencopy.placeholder != NULL) {
+		cairo_surface_destroy(surface->screencopy.placeholder);
+	}
 	if (surface->layer_surface != NULL) {
 		zwlr_layer_surface_v1_destroy(surface->layer_surface);
 	}
@@ -504,10 +528,15 @@ static cairo_surface_t *apply_effects(cairo_surface_t *image, struct swaylock_st
 		return image;
 	}
 
-	if (state->args.time_effects) {
+	if (state->args.effects_process) {
+		return effects_helper_run(image, scale, state->args.effects_deadline);
+	}
+
+	if (state->args.time_effects || state->args.effects_plan) {
 		return swaylock_effects_run_timed(
 				image, scale,
-				state->args.effects, state->args.effects_count);
+				state->args.effects, state->args.effects_count,
+				state->args.effects_plan);
 	} else {
 		return swaylock_effects_run(
 				image, scale,
@@ -515,6 +544,259 @@ static cairo_surface_t *apply_effects(cairo_surface_t *image, struct swaylock_st
 	}
 }
 
+struct image_effects {
+	struct swaylock_state *state;
+	struct swaylock_image *image;
+};
+
+static void image_effects_task(void *data, int thread) {
+	struct image_effects *task = data;
+	task->image->cairo_surface = apply_effects(
+			task->image->cairo_surface, task->state, 1);
+}
+
+// Applies effects to all images loaded with --image, all at the same time
+static void apply_image_effects(struct swaylock_state *state) {
+	int count = wl_list_length(&state->images);
+	if (state->args.effects_count == 0 || count == 0) {
+		return;
+	}
+
+	struct image_effects *tasks = calloc(count, sizeof(*tasks));
+	if (tasks == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate image effects");
+		return;
+	}
+
+	struct swaylock_image *image;
+	int i = 0;
+	wl_list_for_each(image, &state->images, link) {
+		tasks[i].state = state;
+		tasks[i].image = image;
+		if (!workers_submit(image_effects_task, &tasks[i], 0)) {
+			image_effects_task(&tasks[i], 0);
+		}
+		i += 1;
+	}
+	workers_wait();
+	free(tasks);
+}
+
+static void screenshot_effects_task(void *data, int thread) {
+	struct swaylock_surface *surface = data;
+	struct swaylock_image *image = surface->screencopy.image;
+	image->cairo_surface = apply_effects(
+			image->cairo_surface, surface->state, surface->scale);
+}
+
+// The output with keyboard focus goes first, then the others in the order the
+// compositor announced them, which usually starts with the primary output.
+static int screenshot_effects_priority(struct swaylock_surface *surface) {
+	if (surface->keyboard_focus) {
+		return INT_MAX;
+	}
+	return -(int)surface->output_global_name;
+}
+
+// Effects on a screenshot which run while the screen is already locked
+// with a placeholder. The task only touches the job; once it's marked done
+// and the eventfd signalled, the event loop shows the result.
+struct background_effects {
+	struct swaylock_state *state;
+	struct swaylock_surface *surface; // NULL once the output is gone
+	struct swaylock_image *image;
+	int scale;
+	atomic_bool done;
+	struct wl_list link;
+};
+
+static void background_effects_task(void *data, int thread) {
+	struct background_effects *job = data;
+	job->image->cairo_surface = apply_effects(
+			job->image->cairo_surface, job->state, job->scale);
+
+	// The job may be freed as soon as it's marked done
+	int fd = job->state->background_effects_fd;
+	atomic_store(&job->done, true);
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+		swaylock_log_errno(LOG_ERROR, "Failed to signal finished effects");
+	}
+}
+
+static void forget_background_effects(struct swaylock_surface *surface) {
+	struct background_effects *job;
+	wl_list_for_each(job, &surface->state->background_effects, link) {
+		if (job->surface == surface) {
+			job->surface = NULL;
+		}
+	}
+}
+
+// Replaces the placeholder on an output which is already locked with its
+// finished screenshot, cross-fading between the two if asked to
+static void show_screenshot(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	struct swaylock_image *screenshot = surface->screencopy.image;
+	wl_list_insert(&state->images, &screenshot->link);
+	if (screenshot->cairo_surface == NULL) {
+		// The effects failed, so the placeholder stays
+		screenshot->cairo_surface = surface->screencopy.placeholder;
+		surface->screencopy.placeholder = NULL;
+		return;
+	}
+	surface->image = screenshot->cairo_surface;
+
+	if (surface->current_buffer != NULL) {
+		if (state->args.effects_crossfade) {
+			fade_begin_cross(&surface->fade, surface->current_buffer,
+					state->args.effects_crossfade);
+		}
+		render_frame_background(surface);
+		render_background_fade_prepare(surface, surface->current_buffer);
+		damage_surface(surface);
+	}
+
+	if (surface->screencopy.placeholder != NULL) {
+		cairo_surface_destroy(surface->screencopy.placeholder);
+		surface->screencopy.placeholder = NULL;
+	}
+}
+
+static void start_background_effects(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	struct background_effects *job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate background effects");
+		screenshot_effects_task(surface, 0);
+		show_screenshot(surface);
+		return;
+	}
+
+	job->state = state;
+	job->surface = surface;
+	job->image = surface->screencopy.image;
+	job->scale = surface->scale;
+	wl_list_insert(&state->background_effects, &job->link);
+	if (!workers_submit(background_effects_task, job,
+				screenshot_effects_priority(surface))) {
+		background_effects_task(job, 0);
+	}
+}
+
+static void background_effects_in(int fd, short mask, void *data) {
+	struct swaylock_state *state = data;
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		swaylock_log_errno(LOG_ERROR, "Failed to read finished effects");
+	}
+
+	struct background_effects *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &state->background_effects, link) {
+		if (!atomic_load(&job->done)) {
+			continue;
+		}
+		wl_list_remove(&job->link);
+		if (job->surface != NULL) {
+			show_screenshot(job->surface);
+		} else {
+			wl_list_insert(&state->images, &job->image->link);
+		}
+		free(job);
+	}
+
+	if (wl_list_empty(&state->background_effects)) {
+		workers_stop();
+	}
+}
+
+// Runs effects on all outputs' screenshots together, so the worker pool can
+// spread every output's work across the cores rather than doing one output
+// after the other and leaving cores idle at the end of each effect.
+static void apply_screenshot_effects(struct swaylock_state *state) {
+	bool background = state->args.effects_placeholder != EFFECTS_PLACEHOLDER_NONE;
+	if (background) {
+		// Get the placeholders on screen before the effects can hold
+		// anything up
+		wl_display_flush(state->display);
+	}
+
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (!surface->screencopy.effects_pending) {
+			continue;
+		}
+		if (background) {
+			surface->screencopy.effects_pending = false;
+			start_background_effects(surface);
+		} else if (!workers_submit(screenshot_effects_task, surface,
+					screenshot_effects_priority(surface))) {
+			screenshot_effects_task(surface, 0);
+		}
+	}
+	if (background) {
+		return;
+	}
+	workers_wait();
+
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (!surface->screencopy.effects_pending) {
+			continue;
+		}
+		surface->screencopy.effects_pending = false;
+		surface->image = surface->screencopy.image->cairo_surface;
+		wl_list_insert(&state->images, &surface->screencopy.image->link);
+		if (--surface->events_pending == 0) {
+			initially_render_surface(surface);
+		}
+	}
+}
+
+static void screencopy_done(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	zwlr_screencopy_frame_v1_destroy(surface->screencopy_frame);
+	surface->screencopy_frame = NULL;
+	if (--state->screencopies_pending == 0) {
+		if (state->screencopy_timer != NULL) {
+			loop_remove_timer(state->eventloop, state->screencopy_timer);
+			state->screencopy_timer = NULL;
+		}
+		apply_screenshot_effects(state);
+	}
+}
+
+// The output goes without a screenshot, and the others don't wait for it
+static void screencopy_failed(struct swaylock_surface *surface) {
+	free(surface->screencopy.image);
+	surface->screencopy.image = NULL;
+	if (--surface->events_pending == 0) {
+		initially_render_surface(surface);
+	}
+	screencopy_done(surface);
+}
+
+// Screenshots normally take a frame or two. One the compositor never
+// finishes would otherwise keep every output's effects waiting.
+#define SCREENCOPY_TIMEOUT_MS 3000
+
+static void give_up_screencopies(struct swaylock_state *state) {
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->screencopy_frame != NULL) {
+			swaylock_log(LOG_ERROR, "Screenshot of output %s took too long",
+					surface->output_name);
+			screencopy_failed(surface);
+		}
+	}
+}
+
+static void screencopy_timeout(void *data) {
+	struct swaylock_state *state = data;
+	// The loop frees the timer once this returns
+	state->screencopy_timer = NULL;
+	give_up_screencopies(state);
+}
+
 static void handle_screencopy_frame_buffer(void *data,
 		struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width,
 		uint32_t height, uint32_t stride) {
@@ -528,7 +810,9 @@ static void handle_screencopy_frame_buffer(void *data,
 	void *bufdata;
 	struct wl_buffer *buf = create_shm_buffer(surface->state->shm, format, width, height, stride, &bufdata);
 	if (buf == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to create buffer for screenshot");
 		free(image);
+		screencopy_failed(surface);
 		return;
 	}
 
@@ -597,26 +881,45 @@ static void handle_screencopy_frame_ready(void *data,
 	struct swaylock_surface *surface = data;
 	struct swaylock_state *state = surface->state;
 
+	// The effects helper gets screenshots without them being copied
+	bool shared = state->args.effects_process && state->args.effects_count > 0;
 	cairo_surface_t *image = load_background_from_buffer(
 			surface->screencopy.data,
 			surface->screencopy.format,
 			surface->screencopy.width,
 			surface->screencopy.height,
 			surface->screencopy.stride,
-			surface->screencopy.transform);
+			surface->screencopy.transform,
+			shared ? effects_helper_image_create : cairo_image_surface_create);
 	if (image == NULL) {
 		swaylock_log(LOG_ERROR, "Failed to create image from screenshot");
-	} else  {
-		surface->screencopy.image->cairo_surface =
-			apply_effects(image, state, surface->scale);
-		surface->image = surface->screencopy.image->cairo_surface;
+	} else {
+		surface->screencopy.image->cairo_surface = image;
+		surface->screencopy.effects_pending = state->args.effects_count > 0;
 	}
-
 	swaylock_log(LOG_DEBUG, "Loaded screenshot for output %s", surface->output_name);
-	wl_list_insert(&state->images, &surface->screencopy.image->link);
-	if (--surface->events_pending == 0) {
-		initially_render_surface(surface);
+
+	if (!surface->screencopy.effects_pending) {
+		if (image != NULL) {
+			surface->image = image;
+		}
+		wl_list_insert(&state->images, &surface->screencopy.image->link);
+		if (--surface->events_pending == 0) {
+			initially_render_surface(surface);
+		}
+	} else if (state->args.effects_placeholder != EFFECTS_PLACEHOLDER_NONE) {
+		// Lock right away, the screenshot replaces the placeholder once its
+		// effects are done
+		if (state->args.effects_placeholder == EFFECTS_PLACEHOLDER_PREVIEW) {
+			surface->screencopy.placeholder = create_background_preview(image, 16);
+		}
+		surface->image = surface->screencopy.placeholder;
+		if (--surface->events_pending == 0) {
+			initially_render_surface(surface);
+		}
 	}
+	// Otherwise the surface stays pending until its effects have run
+	screencopy_done(surface);
 }
 
 static void handle_screencopy_frame_failed(void *data,
@@ -624,10 +927,7 @@ static void handle_screencopy_frame_failed(void *data,
 	swaylock_trace();
 	struct swaylock_surface *surface = data;
 	swaylock_log(LOG_ERROR, "Screencopy failed");
-
-	if (--surface->events_pending == 0) {
-		initially_render_surface(surface);
-	}
+	screencopy_failed(surface);
 }
 
 static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener = {
@@ -675,6 +975,12 @@ static void handle_xdg_output_done(void *data, struct zxdg_output_v1 *output) {
 			zwlr_screencopy_frame_v1_add_listener(surface->screencopy_frame,
 					&screencopy_frame_listener, surface);
 			surface->events_pending += 1;
+			state->screencopies_pending += 1;
+			// Before the event loop exists, main() keeps the time itself
+			if (state->eventloop != NULL && state->screencopy_timer == NULL) {
+				state->screencopy_timer = loop_add_timer(state->eventloop,
+						SCREENCOPY_TIMEOUT_MS, screencopy_timeout, state);
+			}
 		} else if (!has_printed_screencopy_error) {
 			swaylock_log(LOG_INFO, "Compositor does not support screencopy manager, "
 					"screenshots will not work");
@@ -950,13 +1256,26 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		LO_TEXT_VER,
 		LO_TEXT_WRONG,
 		LO_EFFECT_BLUR,
+		LO_EFFECT_BLUR_FAST,
+		LO_EFFECT_BLUR_GAUSSIAN,
 		LO_EFFECT_PIXELATE,
 		LO_EFFECT_SCALE,
 		LO_EFFECT_GREYSCALE,
 		LO_EFFECT_VIGNETTE,
 		LO_EFFECT_COMPOSE,
 		LO_EFFECT_CUSTOM,
+		LO_EFFECT_EXPR,
 		LO_TIME_EFFECTS,
+		LO_EFFECTS_PLAN,
+		LO_EFFECTS_APPROXIMATE,
+		LO_EFFECTS_PLANAR,
+		LO_CPU_FEATURES,
+		LO_EFFECTS_THREADS,
+		LO_EFFECTS_PLACEHOLDER,
+		LO_EFFECTS_CROSSFADE,
+		LO_EFFECTS_PROCESS,
+		LO_EFFECTS_DEADLINE,
+		LO_PRECOMPILE_EFFECTS,
 		LO_INDICATOR,
 		LO_CLOCK,
 		LO_TIMESTR,
@@ -1029,13 +1348,26 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"text-ver", required_argument, NULL, LO_TEXT_VER},
 		{"text-wrong", required_argument, NULL, LO_TEXT_WRONG},
 		{"effect-blur", required_argument, NULL, LO_EFFECT_BLUR},
+		{"effect-blur-fast", required_argument, NULL, LO_EFFECT_BLUR_FAST},
+		{"effect-blur-gaussian", required_argument, NULL, LO_EFFECT_BLUR_GAUSSIAN},
 		{"effect-pixelate", required_argument, NULL, LO_EFFECT_PIXELATE},
 		{"effect-scale", required_argument, NULL, LO_EFFECT_SCALE},
 		{"effect-greyscale", no_argument, NULL, LO_EFFECT_GREYSCALE},
 		{"effect-vignette", required_argument, NULL, LO_EFFECT_VIGNETTE},
 		{"effect-compose", required_argument, NULL, LO_EFFECT_COMPOSE},
 		{"effect-custom", required_argument, NULL, LO_EFFECT_CUSTOM},
+		{"effect-expr", required_argument, NULL, LO_EFFECT_EXPR},
 		{"time-effects", no_argument, NULL, LO_TIME_EFFECTS},
+		{"effects-plan", no_argument, NULL, LO_EFFECTS_PLAN},
+		{"effects-approximate", no_argument, NULL, LO_EFFECTS_APPROXIMATE},
+		{"effects-planar", no_argument, NULL, LO_EFFECTS_PLANAR},
+		{"cpu-features", required_argument, NULL, LO_CPU_FEATURES},
+		{"effects-threads", required_argument, NULL, LO_EFFECTS_THREADS},
+		{"effects-placeholder", required_argument, NULL, LO_EFFECTS_PLACEHOLDER},
+		{"effects-crossfade", required_argument, NULL, LO_EFFECTS_CROSSFADE},
+		{"effects-process", no_argument, NULL, LO_EFFECTS_PROCESS},
+		{"effects-deadline", required_argument, NULL, LO_EFFECTS_DEADLINE},
+		{"precompile-effects", no_argument, NULL, LO_PRECOMPILE_EFFECTS},
 		{"indicator", no_argument, NULL, LO_INDICATOR},
 		{"clock", no_argument, NULL, LO_CLOCK},
 		{"timestr", required_argument, NULL, LO_TIMESTR},
@@ -1197,18 +1529,44 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		    "Sets the text when invalid.\n"
 		"  --effect-blur <radius>x<times>   "
 			"Blur images.\n"
+		"  --effect-blur-fast <radius>      "
+			"Blur images at a reduced resolution; faster for large radii.\n"
+		"  --effect-blur-gaussian <sigma>   "
+			"Blur images with a true gaussian blur.\n"
 		"  --effect-pixelate <factor>       "
 			"Pixelate images.\n"
-		"  --effect-scale <scale>           "
-			"Scale images.\n"
+		"  --effect-scale <scale>[:<filter>]"
+			"Scale images, with filter 'smooth' (default) or 'nearest'.\n"
 		"  --effect-greyscale               "
 			"Make images greyscale.\n"
 		"  --effect-vignette <base>:<factor>"
 			"Apply a vignette effect to images. Base and factor should be numbers between 0 and 1.\n"
 		"  --effect-custom <path>           "
 			"Apply a custom effect from a shared object or C source file.\n"
+		"  --effect-expr <expression>       "
+			"Compute each pixel's red, green and blue from an expression.\n"
 		"  --time-effects                   "
 			"Measure the time it takes to run each effect.\n"
+		"  --effects-plan                   "
+			"Print how effects will be run, with estimated and measured times.\n"
+		"  --effects-approximate            "
+			"Run wide blurs at a lower resolution, changing the result slightly.\n"
+		"  --effects-planar                 "
+			"Run chains with blurs on separate colour planes, not in bands.\n"
+		"  --cpu-features <level>           "
+			"Limit pixel kernels to auto, avx2, sse2 or scalar.\n"
+		"  --effects-threads <count>        "
+			"Number of threads to run effects on, 0 for one per usable CPU.\n"
+		"  --effects-placeholder <mode>     "
+			"Lock right away, showing 'color' or a blurry 'preview' until effects are done.\n"
+		"  --effects-crossfade <seconds>    "
+			"Cross-fade from the placeholder to the finished background.\n"
+		"  --effects-process                "
+			"Run effects in a separate, unprivileged process.\n"
+		"  --effects-deadline <seconds>     "
+			"Give up on effects run with --effects-process after this long.\n"
+		"  --precompile-effects             "
+			"Compile the custom effects ahead of time, then exit.\n"
 		"\n"
 		"All <color> options are of the form <rrggbb[aa]>.\n";
 
@@ -1525,6 +1883,30 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				}
 			}
 			break;
+		case LO_EFFECT_BLUR_FAST:
+			if (state) {
+				state->args.effects = realloc(state->args.effects,
+						sizeof(*state->args.effects) * ++state->args.effects_count);
+				struct swaylock_effect *effect = &state->args.effects[state->args.effects_count - 1];
+				effect->tag = EFFECT_BLUR_FAST;
+				if (sscanf(optarg, "%d", &effect->e.blur_fast.radius) != 1) {
+					swaylock_log(LOG_ERROR, "Invalid blur-fast effect argument %s, ignoring", optarg);
+					state->args.effects_count -= 1;
+				}
+			}
+			break;
+		case LO_EFFECT_BLUR_GAUSSIAN:
+			if (state) {
+				state->args.effects = realloc(state->args.effects,
+						sizeof(*state->args.effects) * ++state->args.effects_count);
+				struct swaylock_effect *effect = &state->args.effects[state->args.effects_count - 1];
+				effect->tag = EFFECT_BLUR_GAUSSIAN;
+				if (sscanf(optarg, "%lf", &effect->e.blur_gaussian.sigma) != 1) {
+					swaylock_log(LOG_ERROR, "Invalid blur-gaussian effect argument %s, ignoring", optarg);
+					state->args.effects_count -= 1;
+				}
+			}
+			break;
 		case LO_EFFECT_PIXELATE:
 			if (state) {
 				state->args.effects = realloc(state->args.effects,
@@ -1540,7 +1922,12 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 						sizeof(*state->args.effects) * ++state->args.effects_count);
 				struct swaylock_effect *effect = &state->args.effects[state->args.effects_count - 1];
 				effect->tag = EFFECT_SCALE;
-				if (sscanf(optarg, "%lf", &effect->e.scale) != 1) {
+				effect->e.scale.filter = EFFECT_SCALE_FILTER_SMOOTH;
+				char filter[16] = "";
+				int n = sscanf(optarg, "%lf:%15s", &effect->e.scale.factor, filter);
+				if (n == 2 && strcmp(filter, "nearest") == 0) {
+					effect->e.scale.filter = EFFECT_SCALE_FILTER_NEAREST;
+				} else if (n < 1 || (n == 2 && strcmp(filter, "smooth") != 0)) {
 					swaylock_log(LOG_ERROR, "Invalid scale effect argument %s, ignoring", optarg);
 					state->args.effects_count -= 1;
 				}
@@ -1584,11 +1971,95 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				effect->e.custom = strdup(optarg);
 			}
 			break;
+		case LO_EFFECT_EXPR:
+			if (state) {
+				state->args.effects = realloc(state->args.effects,
+						sizeof(*state->args.effects) * ++state->args.effects_count);
+				struct swaylock_effect *effect = &state->args.effects[state->args.effects_count - 1];
+				effect->tag = EFFECT_EXPR;
+				effect->e.expr.expr = expr_parse(optarg);
+				if (effect->e.expr.expr == NULL) {
+					swaylock_log(LOG_ERROR, "Invalid expression effect argument, ignoring");
+					state->args.effects_count -= 1;
+				} else {
+					effect->e.expr.source = strdup(optarg);
+				}
+			}
+			break;
 		case LO_TIME_EFFECTS:
 			if (state) {
 				state->args.time_effects = true;
 			}
 			break;
+		case LO_EFFECTS_PLAN:
+			if (state) {
+				state->args.effects_plan = true;
+			}
+			break;
+		case LO_EFFECTS_APPROXIMATE:
+			if (state) {
+				swaylock_effects_set_approximate(true);
+			}
+			break;
+		case LO_EFFECTS_PLANAR:
+			if (state) {
+				swaylock_effects_set_planar(true);
+			}
+			break;
+		case LO_CPU_FEATURES:
+			if (state) {
+				enum cpu_level level;
+				if (cpu_parse_level(optarg, &level)) {
+					cpu_set_max_level(level);
+				} else {
+					swaylock_log(LOG_ERROR, "Invalid cpu features level %s, ignoring", optarg);
+				}
+			}
+			break;
+		case LO_EFFECTS_THREADS:
+			if (state) {
+				char *end;
+				long count = strtol(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0' || count < 0 || count > 1024) {
+					swaylock_log(LOG_ERROR, "Invalid effects thread count %s, ignoring", optarg);
+				} else {
+					workers_set_threads(count);
+				}
+			}
+			break;
+		case LO_EFFECTS_PLACEHOLDER:
+			if (state) {
+				if (strcmp(optarg, "none") == 0) {
+					state->args.effects_placeholder = EFFECTS_PLACEHOLDER_NONE;
+				} else if (strcmp(optarg, "color") == 0) {
+					state->args.effects_placeholder = EFFECTS_PLACEHOLDER_COLOR;
+				} else if (strcmp(optarg, "preview") == 0) {
+					state->args.effects_placeholder = EFFECTS_PLACEHOLDER_PREVIEW;
+				} else {
+					swaylock_log(LOG_ERROR, "Invalid effects placeholder %s, ignoring", optarg);
+				}
+			}
+			break;
+		case LO_EFFECTS_CROSSFADE:
+			if (state) {
+				state->args.effects_crossfade = parse_seconds(optarg);
+			}
+			break;
+		case LO_EFFECTS_PROCESS:
+			if (state) {
+				state->args.effects_process = true;
+			}
+			break;
+		case LO_EFFECTS_DEADLINE:
+			if (state) {
+				state->args.effects_deadline = parse_seconds(optarg);
+			}
+			break;
+		case LO_PRECOMPILE_EFFECTS:
+			if (state) {
+				state->args.precompile_effects = true;
+			}
+			break;
 		case LO_INDICATOR:
 			if (state) {
 				state->args.indicator = true;
@@ -1832,6 +2303,19 @@ int main(int argc, char **argv) {
 		state.auth_state = AUTH_STATE_GRACE;
 	}
 
+	if (state.args.precompile_effects) {
+		bool ok = swaylock_effects_precompile(state.args.effects,
+				state.args.effects_count);
+		free(state.args.font);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Compile custom effects while we connect to the compositor and take
+	// screenshots. The effects helper starts its own compiles.
+	if (!state.args.effects_process) {
+		swaylock_effects_compile(state.args.effects, state.args.effects_count);
+	}
+
 #ifdef __linux__
 	// Most non-linux platforms require root to mlock()
 	if (mlock(state.password.buffer, sizeof(state.password.buffer)) != 0) {
@@ -1841,6 +2325,8 @@ int main(int argc, char **argv) {
 #endif
 
 	wl_list_init(&state.surfaces);
+	wl_list_init(&state.background_effects);
+	state.background_effects_fd = -1;
 	state.xkb.context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	state.display = wl_display_connect(NULL);
 	if (!state.display) {
@@ -1870,18 +2356,32 @@ int main(int argc, char **argv) {
 		return 2;
 	}
 
-	// Must daemonize before we run any effects, since effects use openmp
+	// Must daemonize before we run any effects, since the effect worker
+	// threads don't survive the fork
 	int daemonfd;
 	if (state.args.daemonize) {
 		wl_display_roundtrip(state.display);
 		daemonfd = daemonize_start();
 	}
 
+	// Has to be forked before the effect threads are started
+	if (state.args.effects_process && state.args.effects_count > 0 &&
+			!spawn_effects_helper(&state.args)) {
+		swaylock_log(LOG_ERROR, "Running effects in swaylock itself instead");
+		state.args.effects_process = false;
+		swaylock_effects_compile(state.args.effects, state.args.effects_count);
+	}
+
 	// Need to apply effects to all images loaded with --image
-	struct swaylock_image *iter_image, *temp;
-	wl_list_for_each_safe(iter_image, temp, &state.images, link) {
-		iter_image->cairo_surface = apply_effects(
-				iter_image->cairo_surface, &state, 1);
+	apply_image_effects(&state);
+
+	if (state.args.effects_placeholder != EFFECTS_PLACEHOLDER_NONE) {
+		state.background_effects_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (state.background_effects_fd < 0) {
+			swaylock_log_errno(LOG_ERROR, "Failed to create eventfd, "
+					"waiting for effects before locking");
+			state.args.effects_placeholder = EFFECTS_PLACEHOLDER_NONE;
+		}
 	}
 
 	struct swaylock_surface *surface;
@@ -1889,18 +2389,40 @@ int main(int argc, char **argv) {
 		create_layer_surface(surface);
 	}
 
+	struct timespec screencopy_start;
+	clock_gettime(CLOCK_MONOTONIC, &screencopy_start);
 	wl_list_for_each(surface, &state.surfaces, link) {
 		while (surface->events_pending > 0) {
 			wl_display_roundtrip(state.display);
+
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long ms = (now.tv_sec - screencopy_start.tv_sec) * 1000 +
+				(now.tv_nsec - screencopy_start.tv_nsec) / 1000000;
+			if (state.screencopies_pending > 0 && ms >= SCREENCOPY_TIMEOUT_MS) {
+				give_up_screencopies(&state);
+			}
 		}
 	}
 
+	// All backgrounds are ready, so the effect threads aren't needed while
+	// the screen is locked. Outputs which appear later start them again.
+	// Effects still running behind placeholders stop them once they're done.
+	if (wl_list_empty(&state.background_effects)) {
+		workers_stop();
+	}
+
 	state.eventloop = loop_create();
 	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN,
 			display_in, NULL);
 
 	loop_add_fd(state.eventloop, get_comm_reply_fd(), POLLIN, comm_in, NULL);
 
+	if (state.background_effects_fd >= 0) {
+		loop_add_fd(state.eventloop, state.background_effects_fd, POLLIN,
+				background_effects_in, &state);
+	}
+
 	loop_add_timer(state.eventloop, 1000, timer_render, &state);
 
 	if (state.args.daemonize && state.args.fade_in) {
@@ -37,14 +37,27 @@ static void keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard,
 	state->xkb.state = xkb_state;
 }
 
+// Focus is only tracked so the focused output's effects can run first
+static void set_keyboard_focus(struct swaylock_state *state,
+		struct wl_surface *wl_surface, bool focus) {
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->surface == wl_surface) {
+			surface->keyboard_focus = focus;
+		}
+	}
+}
+
 static void keyboard_enter(void *data, struct wl_keyboard *wl_keyboard,
 		uint32_t serial, struct wl_surface *surface, struct wl_array *keys) {
-	// Who cares
+	struct swaylock_seat *seat = data;
+	set_keyboard_focus(seat->state, surface, true);
 }
 
 static void keyboard_leave(void *data, struct wl_keyboard *wl_keyboard,
 		uint32_t serial, struct wl_surface *surface) {
-	// Who cares
+	struct swaylock_seat *seat = data;
+	set_keyboard_focus(seat->state, surface, false);
 }
 
 static void keyboard_repeat(void *data) {
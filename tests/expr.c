@@ -0,0 +1,115 @@
+// Checks that expressions parse and evaluate as documented, and that ones
+// which don't fit in the interpreter's registers are rejected cleanly
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "expr.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, const char *source) {
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s: %s\n", what, source);
+		failures += 1;
+	}
+}
+
+static void check_pixel(const char *source, uint32_t in, uint32_t want) {
+	struct expr *expr = expr_parse(source);
+	check(expr != NULL, "should parse", source);
+	if (expr == NULL) {
+		return;
+	}
+
+	static const enum cpu_level levels[] = {
+		CPU_LEVEL_SCALAR, CPU_LEVEL_SSE2, CPU_LEVEL_AVX2,
+	};
+	for (size_t i = 0; i < sizeof(levels) / sizeof(*levels); ++i) {
+		cpu_set_max_level(levels[i]);
+		// Wider than a block, so the last one is partial
+		uint32_t row[100];
+		for (int x = 0; x < 100; ++x) {
+			row[x] = in;
+		}
+		expr_run_rows(expr, row, 100, 0, 1, 100, 1);
+		bool ok = true;
+		for (int x = 0; x < 100; ++x) {
+			ok = ok && (row[x] & 0xffffff) == want;
+		}
+		check(ok, cpu_level_name(levels[i]), source);
+	}
+	expr_destroy(expr);
+}
+
+static void check_rejected(const char *source) {
+	struct expr *expr = expr_parse(source);
+	check(expr == NULL, "should be rejected", source);
+	if (expr != NULL) {
+		expr_destroy(expr);
+	}
+}
+
+// A sum of 'terms' products, each with its own constant, inside 'depth'
+// calls to mix() which add two more constants each
+static char *nested_sum(int terms, int depth) {
+	size_t size = (size_t)terms * 16 + (size_t)depth * 32 + 1;
+	char *source = malloc(size);
+	char *tmp = malloc(size);
+	if (source == NULL || tmp == NULL) {
+		abort();
+	}
+	source[0] = '\0';
+	for (int i = 0; i < terms; ++i) {
+		size_t len = strlen(source);
+		snprintf(source + len, size - len, "%sr*%d.25", i > 0 ? "+" : "", i);
+	}
+	for (int i = 0; i < depth; ++i) {
+		snprintf(tmp, size, "mix(%s, %d.5, %d.75)", source, i, i);
+		strcpy(source, tmp);
+	}
+	free(tmp);
+	return source;
+}
+
+int main(void) {
+	check_pixel("r", 0x102030, 0x101010);
+	check_pixel("r*0.5, g, 255 - b", 0x806040, 0x4060bf);
+	check_pixel("x < 0 ? 0 : 255", 0x000000, 0xffffff);
+	check_pixel("clamp(r - 100, 0, 50), mix(0, 200, 0.25), sqrt(b)",
+		0x4000ff, 0x003210);
+	check_pixel("min(r, g), max(r, g), abs(floor(-1.5))", 0x1020ff, 0x102002);
+	check_pixel("(1 + 2) * 3 == 9, 4 != 4, -(2) <= -2", 0x000000, 0x010001);
+
+	check_rejected("");
+	check_rejected("r,");
+	check_rejected("r, g");
+	check_rejected("r, g, b, r");
+	check_rejected("q");
+	check_rejected("foo(r)");
+	check_rejected("min(r)");
+	check_rejected("mix(r, g, b, r)");
+	check_rejected("(r");
+	check_rejected("r ? g");
+	check_rejected("r $ g");
+
+	// Constants, temporaries and instructions all run out somewhere in here
+	for (int terms = 1; terms <= 80; ++terms) {
+		char *source = nested_sum(terms, 60);
+		struct expr *expr = expr_parse(source);
+		if (expr != NULL) {
+			expr_destroy(expr);
+		}
+		free(source);
+	}
+	char *source = nested_sum(56, 60);
+	check_rejected(source);
+	free(source);
+	source = nested_sum(300, 0);
+	check_rejected(source);
+	free(source);
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
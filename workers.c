@@ -0,0 +1,399 @@
+#define _GNU_SOURCE // sched_getaffinity
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "workers.h"
+
+// Work in the pool is a queue of jobs. A job is a loop whose chunks get
+// claimed one at a time by whichever thread is free, or a task, which is a
+// job with one iteration. Jobs leave the queue once all their chunks are
+// claimed. The queue is ordered by priority, so free threads always pick up
+// chunks of the most important job first; jobs of equal priority run in the
+// order they were queued.
+struct job {
+	workers_range_func func;
+	workers_task_func task_func;
+	void *data;
+	int priority;
+	int next, end, chunk;
+	int running; // chunks claimed but not done yet
+	struct job *link;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct job *queue_head;
+static int pending_tasks;
+
+static int requested_threads;
+static int nthreads; // 0 until the count is worked out
+static pthread_t *threads;
+static int nstarted; // threads running, not counting the caller
+static bool stopping;
+
+static _Thread_local int thread_index;
+// Priority of the work the thread is running, which loops it starts inherit
+static _Thread_local int thread_priority;
+
+// Reads a cgroup v2 cpu.max file, "max <period>" or "<quota> <period>".
+static int read_cpu_max(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	long quota, period;
+	int limit = 0;
+	if (fscanf(f, "%ld %ld", &quota, &period) == 2 && quota > 0 && period > 0) {
+		limit = (quota + period - 1) / period;
+	}
+	fclose(f);
+	return limit;
+}
+
+static long read_long(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	long value;
+	if (fscanf(f, "%ld", &value) != 1) {
+		value = -1;
+	}
+	fclose(f);
+	return value;
+}
+
+// How many CPUs' worth of time the cgroup quota allows, rounded up, or 0 if
+// there's no quota. Limits on parent cgroups apply too, so the whole path
+// up to the root is checked.
+static int cgroup_cpu_limit(void) {
+	int limit = 0;
+
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	char *line = NULL;
+	size_t linesize = 0;
+	while (f != NULL && getline(&line, &linesize, f) > 0) {
+		if (strncmp(line, "0::", 3) != 0) {
+			continue;
+		}
+		char *cgroup = line + 3;
+		cgroup[strcspn(cgroup, "\n")] = '\0';
+
+		char path[4096];
+		while (true) {
+			snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max",
+					strcmp(cgroup, "/") == 0 ? "" : cgroup);
+			int level = read_cpu_max(path);
+			if (level > 0 && (limit == 0 || level < limit)) {
+				limit = level;
+			}
+			char *slash = strrchr(cgroup, '/');
+			if (slash == NULL || slash == cgroup) {
+				break;
+			}
+			*slash = '\0';
+		}
+		break;
+	}
+	free(line);
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	// cgroup v1 only has the quota of the cgroup itself
+	long quota = read_long("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+	long period = read_long("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+	if (quota > 0 && period > 0) {
+		int level = (quota + period - 1) / period;
+		if (limit == 0 || level < limit) {
+			limit = level;
+		}
+	}
+	return limit;
+}
+
+static int detect_threads(void) {
+	int count = 1;
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		count = CPU_COUNT(&set);
+	} else {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		if (online > 0) {
+			count = online;
+		}
+	}
+
+	int limit = cgroup_cpu_limit();
+	if (limit > 0 && limit < count) {
+		swaylock_log(LOG_DEBUG, "Limiting effect threads to the cgroup CPU quota of %d",
+				limit);
+		count = limit;
+	}
+	return count > 0 ? count : 1;
+}
+
+void workers_set_threads(int count) {
+	pthread_mutex_lock(&lock);
+	requested_threads = count;
+	if (nstarted == 0) {
+		nthreads = 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// Must be called with the lock held
+static int thread_count(void) {
+	if (nthreads == 0) {
+		nthreads = requested_threads > 0 ? requested_threads : detect_threads();
+		swaylock_log(LOG_DEBUG, "Using %d effect threads", nthreads);
+	}
+	return nthreads;
+}
+
+int workers_count(void) {
+	pthread_mutex_lock(&lock);
+	int count = thread_count();
+	pthread_mutex_unlock(&lock);
+	return count;
+}
+
+// Claims the next chunk of the first job in the queue, or of 'only' if it
+// isn't NULL. Must be called with the lock held.
+static struct job *claim(struct job *only, int *start, int *end) {
+	struct job *prev = NULL, *job = queue_head;
+	while (job != NULL && only != NULL && job != only) {
+		prev = job;
+		job = job->link;
+	}
+	if (job == NULL) {
+		return NULL;
+	}
+
+	*start = job->next;
+	*end = job->end - job->next > job->chunk ? job->next + job->chunk : job->end;
+	job->next = *end;
+	job->running += 1;
+
+	if (job->next >= job->end) {
+		if (prev == NULL) {
+			queue_head = job->link;
+		} else {
+			prev->link = job->link;
+		}
+	}
+	return job;
+}
+
+// Runs a claimed chunk, and takes the lock again afterwards
+static void run_chunk(struct job *job, int start, int end) {
+	pthread_mutex_unlock(&lock);
+	int priority = thread_priority;
+	thread_priority = job->priority;
+	if (job->task_func != NULL) {
+		job->task_func(job->data, thread_index);
+	} else {
+		job->func(job->data, start, end, thread_index);
+	}
+	thread_priority = priority;
+	pthread_mutex_lock(&lock);
+
+	job->running -= 1;
+	if (job->running == 0 && job->next >= job->end) {
+		if (job->task_func != NULL) {
+			free(job);
+			pending_tasks -= 1;
+		}
+		pthread_cond_broadcast(&done_cond);
+	}
+}
+
+static void *worker_main(void *data) {
+	thread_index = (int)(intptr_t)data;
+
+	pthread_mutex_lock(&lock);
+	while (true) {
+		int start, end;
+		struct job *job = claim(NULL, &start, &end);
+		if (job != NULL) {
+			run_chunk(job, start, end);
+		} else if (stopping) {
+			break;
+		} else {
+			pthread_cond_wait(&work_cond, &lock);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+// Must be called with the lock held
+static void start_threads(void) {
+	int count = thread_count();
+	if (nstarted > 0 || count < 2) {
+		return;
+	}
+
+	threads = calloc(count - 1, sizeof(*threads));
+	if (threads == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate effect threads");
+		return;
+	}
+
+	// Signals are for the main thread to handle
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	stopping = false;
+	for (int i = 0; i < count - 1; ++i) {
+		int ret = pthread_create(&threads[i], NULL, worker_main, (void *)(intptr_t)(i + 1));
+		if (ret != 0) {
+			swaylock_log(LOG_ERROR, "Failed to start effect thread: %s", strerror(ret));
+			break;
+		}
+		nstarted += 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (nstarted == 0) {
+		free(threads);
+		threads = NULL;
+	}
+}
+
+// Must be called with the lock held
+static void enqueue(struct job *job) {
+	struct job *prev = NULL, *next = queue_head;
+	while (next != NULL && next->priority >= job->priority) {
+		prev = next;
+		next = next->link;
+	}
+	job->link = next;
+	if (prev == NULL) {
+		queue_head = job;
+	} else {
+		prev->link = job;
+	}
+	start_threads();
+	pthread_cond_broadcast(&work_cond);
+}
+
+void workers_parallel_for(int start, int end, int chunk,
+		workers_range_func func, void *data) {
+	if (end <= start) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	int count = thread_count();
+	if (chunk <= 0) {
+		chunk = (end - start + count - 1) / count;
+	}
+	if (count < 2 || chunk >= end - start) {
+		pthread_mutex_unlock(&lock);
+		func(data, start, end, thread_index);
+		return;
+	}
+
+	struct job job = {
+		.func = func,
+		.data = data,
+		.priority = thread_priority,
+		.next = start,
+		.end = end,
+		.chunk = chunk,
+	};
+	enqueue(&job);
+
+	// Help out with this loop, rather than with whatever else is queued,
+	// so the caller doesn't get held up by unrelated work
+	while (job.next < job.end || job.running > 0) {
+		int cstart, cend;
+		if (job.next < job.end && claim(&job, &cstart, &cend) != NULL) {
+			run_chunk(&job, cstart, cend);
+		} else {
+			pthread_cond_wait(&done_cond, &lock);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+bool workers_submit(workers_task_func func, void *data, int priority) {
+	pthread_mutex_lock(&lock);
+	// Without threads, because there's one CPU or they failed to start,
+	// nothing would pick the task up unless someone waits for it
+	start_threads();
+	if (nstarted == 0) {
+		pthread_mutex_unlock(&lock);
+		func(data, thread_index);
+		return true;
+	}
+
+	struct job *job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		pthread_mutex_unlock(&lock);
+		swaylock_log(LOG_ERROR, "Failed to allocate effect task");
+		return false;
+	}
+	job->task_func = func;
+	job->data = data;
+	job->priority = priority;
+	job->end = 1;
+	job->chunk = 1;
+	pending_tasks += 1;
+	enqueue(job);
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+// Must be called with the lock held
+static void wait_tasks(void) {
+	while (pending_tasks > 0) {
+		int start, end;
+		struct job *job = claim(NULL, &start, &end);
+		if (job != NULL) {
+			run_chunk(job, start, end);
+		} else {
+			pthread_cond_wait(&done_cond, &lock);
+		}
+	}
+}
+
+void workers_wait(void) {
+	pthread_mutex_lock(&lock);
+	wait_tasks();
+	pthread_mutex_unlock(&lock);
+}
+
+void workers_stop(void) {
+	pthread_mutex_lock(&lock);
+	wait_tasks();
+	if (nstarted == 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&work_cond);
+	int count = nstarted;
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < count; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_lock(&lock);
+	free(threads);
+	threads = NULL;
+	nstarted = 0;
+	nthreads = 0;
+	pthread_mutex_unlock(&lock);
+}